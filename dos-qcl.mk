@@ -29,7 +29,7 @@ FEATURESLT = -DOPL -DOPLLPT -DCMS -DCMSLPT
 CC = qcl
 CFLAGS = -Os -Gs -AS -W1 -I compat
 
-SOURCES = cms.c dosmid.c fio.c gus.c lpt.c mem.c midi.c mpu401.c mus.c opl.c outdev.c rs232.c sbdsp.c syx.c timer.c ui.c xms.c
+SOURCES = cms.c dosmid.c fio.c gus.c lpt.c mem.c midi.c mpu401.c mus.c opl.c outdev.c rs232.c sbdsp.c songcache.c stats.c syx.c timer.c ui.c xms.c
 
 all:	dosmid.exe dosmidlt.exe
 
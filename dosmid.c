@@ -31,6 +31,7 @@
 #include "defines.h"
 #ifdef MSDOS
 #include <dos.h>    /* REGS */
+#include <time.h>   /* clock() */
 #else
 #include <sys/param.h>
 #if defined __FreeBSD__ && !defined __FreeBSD_kernel__
@@ -72,8 +73,17 @@
 #include "mem.h"
 #include "midi.h"
 #include "mus.h"
+#ifdef OPL
+#include "opl.h"
+#endif
 #include "outdev.h"
 #include "rs232.h"
+#ifndef MSDOS
+#include <pthread.h>
+#include "rt.h"
+#endif
+#include "songcache.h"
+#include "stats.h"
 #include "syx.h"
 #include "timer.h"
 #include "ui.h"
@@ -92,6 +102,18 @@
 #define EVENTSCACHESIZE 64 /* *must* be a power of 2 !!! */
 #define EVENTSCACHEMASK 63 /* used by the circular events buffer */
 
+#define PROGWINDOW 3    /* seconds of song loaded before playback starts, when
+                           the song is loaded progressively */
+#define PROGBATCH 8     /* events loaded at once while waiting for the next
+                           event to play */
+#define PROGMARGIN 4000 /* no loading when the next event is closer than that
+                           (in us) */
+
+#define TIMING_SELECT   0 /* sleep in select() until the next event (default) */
+#define TIMING_DEADLINE 1 /* sleep to an absolute deadline, then spin */
+#define TIMINGSLICE 10000 /* with TIMING_DEADLINE, the keyboard is still polled
+                             that often (in us) until the next event is close */
+
 #define PRESET_GM   0 /* default */
 #define PRESET_GS   1
 #define PRESET_XG   2
@@ -130,6 +152,10 @@ struct clioptions {
   int delay;        /* additional delay to apply before playing a file */
   char *playlist;   /* the playlist to read files from */
   char *sbnk;       /* optional sound bank to use (IBK file or so) */
+  char *cachedir;   /* directory where pre-parsed songs are kept, if any */
+#ifndef MSDOS
+  unsigned long memcache; /* KB of memory for songs kept in memory */
+#endif
 #ifdef DBGFILE
   FILE *logfile;      /* an open debug log file */
 #endif
@@ -139,6 +165,17 @@ struct clioptions {
   unsigned char volume;
   /* 'flags' */
   unsigned char xmsdelay;
+  unsigned char nopack;       /* store songs as arrays of events, not packed */
+  unsigned char stream;       /* play MIDI songs from their file, not loaded */
+  unsigned char render;       /* play as fast as possible, on a virtual clock */
+  unsigned int speed;         /* playback speed, in percent of the normal */
+#ifndef MSDOS
+  unsigned char gapless;      /* preload the next song of the playlist */
+  unsigned char thread;       /* draw the screen from a thread of its own */
+  int rtprio;                 /* SCHED_FIFO priority of playback, 0 if none */
+  int cpu;                    /* cpu to run playback on, -1 if any */
+  unsigned char timing;       /* how to wait for events (TIMING_xxx) */
+#endif
   char nockdev;
 #ifdef MSDOS
   unsigned char nopowersave;
@@ -751,6 +788,13 @@ static char *feedarg(char *arg, struct clioptions *params, int option_allowed, i
 #endif
     } else if (stringstartswith(o, "syx=")) {
       params->syxrst = strdup(o + 4);
+    } else if (stringstartswith(o, "cache=")) {
+      if (params->cachedir != NULL) free(params->cachedir);
+      params->cachedir = strdup(o + 6);
+#ifndef MSDOS
+    } else if (stringstartswith(o, "memcache=")) {
+      params->memcache = atol(o + 9);
+#endif
     } else if (stringstartswith(o, "delay=")) {
       params->delay = atoi(o + 6);
       if ((params->delay < 1) || (params->delay > 9000)) {
@@ -759,6 +803,36 @@ static char *feedarg(char *arg, struct clioptions *params, int option_allowed, i
 #ifdef MSDOS
     } else if (strcasecmp(o, "fullcpu") == 0) {
       params->nopowersave = 1;
+#endif
+    } else if (strcasecmp(o, "nopack") == 0) {
+      params->nopack = 1;
+    } else if (strcasecmp(o, "stream") == 0) {
+      params->stream = 1;
+    } else if (strcasecmp(o, "render") == 0) {
+      params->render = 1;
+    } else if (stringstartswith(o, "speed=")) {
+      params->speed = atoi(o + 6);
+      if ((params->speed < 10) || (params->speed > 1000)) {
+        return("Invalid speed: must be in the range 10..1000");
+      }
+#ifndef MSDOS
+    } else if (strcasecmp(o, "gapless") == 0) {
+      params->gapless = 1;
+    } else if (strcasecmp(o, "thread") == 0) {
+      params->thread = 1;
+    } else if (stringstartswith(o, "rtprio=")) {
+      params->rtprio = atoi(o + 7);
+      if ((params->rtprio < 1) || (params->rtprio > 99)) {
+        return("Invalid real-time priority: must be in the range 1..99");
+      }
+    } else if (stringstartswith(o, "cpu=")) {
+      params->cpu = atoi(o + 4);
+      if (params->cpu < 0) return("Invalid cpu number");
+    } else if (stringstartswith(o, "timing=")) {
+      o += 7;
+      if (strcasecmp(o, "select") == 0) params->timing = TIMING_SELECT;
+      else if (strcasecmp(o, "deadline") == 0) params->timing = TIMING_DEADLINE;
+      else return("Invalid timing setting");
 #endif
     } else if (strcasecmp(o, "dontstop") == 0) {
       params->dontstop = 1;
@@ -914,20 +988,64 @@ static int compute_elapsed_time(unsigned long starttime, unsigned long *elapsed)
 }
 
 
+/* fetches up to max events into events[], starting with the one located at
+ * id and following their next links. returns the amount of events fetched,
+ * or -1 on error. events of arrays are fetched in runs, with a single memory
+ * copy each. to forget about the packed stream currently being decoded,
+ * issue a call with id < 0. */
+static int pullevents(long id, struct midi_event *events, int max, int layout) {
+  static struct midi_packreader reader = {-1};
+  int i;
+  if (id < 0) {
+    reader.chunk = -1;
+    return(0);
+  }
+  switch (layout) {
+    case MIDI_LAYOUT_PACKED:
+      for (i = 0; i < max; i++) {
+        if (midi_packpull(&reader, id, events + i) != 0) return(-1);
+        id = events[i].next;
+        if (id < 0) return(i + 1);
+      }
+      return(max);
+    case MIDI_LAYOUT_STREAM: /* events simply come one after another */
+      i = midi_streampull(events, max);
+      return((i < 1) ? -1 : i);
+    case MIDI_LAYOUT_ARRAY:
+      max = mem_run(id, sizeof(struct midi_event), max);
+      if (mem_pull(id, events, max * sizeof(struct midi_event)) != 0) return(-1);
+      /* keep events for as long as they follow each other in memory */
+      for (i = 1; i < max; i++) {
+        if (events[i - 1].next != id + (long)(i * sizeof(struct midi_event))) break;
+      }
+      return(i);
+    default:
+      if (mem_pull(id, events, sizeof(struct midi_event)) != 0) return(-1);
+      return(1);
+  }
+}
+
+
 /* check the event cache for a given event. to reset the cache, issue a single
- * call with trackpos < 0. */
-static struct midi_event *getnexteventfromcache(struct midi_event *eventscache, long int trackpos, int xmsdelay) {
+ * call with trackpos < 0. events that can be accessed in place (see
+ * mem_ptr()) are not cached at all. */
+static struct midi_event far *getnexteventfromcache(struct midi_event *eventscache, long int trackpos, int xmsdelay, int layout) {
   static unsigned int itemsincache = 0;
   static unsigned int curcachepos = 0;
-  struct midi_event *res = NULL;
+  struct midi_event far *res = NULL;
   long nextevent;
   /* if trackpos < 0 then this is only about flushing cache */
   if (trackpos < 0) {
     memset(eventscache, 0, sizeof(*eventscache));
     itemsincache = 0;
     curcachepos = 0;
+    pullevents(-1, NULL, 0, 0);
     return(NULL);
   }
+  if ((layout == MIDI_LAYOUT_LIST) || (layout == MIDI_LAYOUT_ARRAY)) {
+    res = mem_ptr(trackpos);
+    if (res != NULL) return(res);
+  }
   /* if we have available cache */
   if (itemsincache > 0) {
       curcachepos++;
@@ -936,7 +1054,7 @@ static struct midi_event *getnexteventfromcache(struct midi_event *eventscache,
       res = &eventscache[curcachepos];
       /* if we have some free time, refill the cache proactively */
       if (res->deltatime > 0) {
-        int nextslot, pullres;
+        int nextslot, pullres, room;
         /* sleep 2ms after a MIDI OUT write, and before accessing XMS.
            This is especially important for SoundBlaster "AWE" cards with the
            AWEUTIL TSR midi emulation enabled, without this AWEUTIL crashes. */
@@ -946,13 +1064,17 @@ static struct midi_event *getnexteventfromcache(struct midi_event *eventscache,
         while ((itemsincache < EVENTSCACHESIZE - 1) && (nextevent >= 0)) {
           nextslot++;
           nextslot &= EVENTSCACHEMASK;
-          pullres = mem_pull(nextevent, &eventscache[nextslot], sizeof(struct midi_event));
-          if (pullres != 0) {
+          /* fetch as many events as possible without wrapping the cache */
+          room = EVENTSCACHESIZE - 1 - itemsincache;
+          if (room > EVENTSCACHESIZE - nextslot) room = EVENTSCACHESIZE - nextslot;
+          pullres = pullevents(nextevent, &eventscache[nextslot], room, layout);
+          if (pullres < 1) {
             /* printf("pullevent() ERROR: %u (eventid = %ld)\n", pullres, trackpos); */
             return(NULL);
           }
+          nextslot += pullres - 1;
           nextevent = eventscache[nextslot].next;
-          itemsincache++;
+          itemsincache += pullres;
         }
       }
     } else { /* need to refill the cache NOW */
@@ -963,14 +1085,14 @@ static struct midi_event *getnexteventfromcache(struct midi_event *eventscache,
       if (xmsdelay != 0) udelay(2000);
       nextevent = trackpos;
       curcachepos = 0;
-      for (refillcount = 0; refillcount < EVENTSCACHESIZE; refillcount++) {
-        pullres = mem_pull(nextevent, &eventscache[refillcount], sizeof(struct midi_event));
-        if (pullres != 0) {
+      for (refillcount = 0; refillcount < EVENTSCACHESIZE; refillcount += pullres) {
+        pullres = pullevents(nextevent, &eventscache[refillcount], EVENTSCACHESIZE - refillcount, layout);
+        if (pullres < 1) {
           /* printf("pullevent() ERROR: %u (eventid = %ld)\n", pullres, trackpos); */
           return(NULL);
         }
-        nextevent = eventscache[refillcount].next;
-        itemsincache++;
+        nextevent = eventscache[refillcount + pullres - 1].next;
+        itemsincache += pullres;
         if (nextevent < 0) break;
       }
       itemsincache--;
@@ -980,6 +1102,59 @@ static struct midi_event *getnexteventfromcache(struct midi_event *eventscache,
 }
 
 
+/* file of the song being loaded progressively (see loadmore()) or streamed */
+static struct fiofile songfile;
+static struct midi_progress progress;
+static struct songkey songkey; /* what identifies the song in the cache */
+
+#ifndef MSDOS
+/* the next song of the playlist, preloaded into the other memory arena while
+ * the current song plays (see preloadnext()) */
+enum nextstate {
+  NEXT_NONE = 0,    /* not looked up yet */
+  NEXT_NAMED = 1,   /* looked up, but to be loaded the usual way */
+  NEXT_LOADING = 2, /* being loaded progressively */
+  NEXT_READY = 3    /* loaded entirely */
+};
+static enum nextstate nextstate = NEXT_NONE;
+static struct trackinfodata nexttrack;
+static struct songkey nextsongkey;
+static long nexttrackpos;
+static char *nextmidifile;      /* as returned by getnextm3uitem() */
+static unsigned int nextm3upos; /* playlist position before the lookup */
+static int songarena = 0;       /* memory arena of the song being played */
+static char songnamebuf[2][256];
+#endif
+
+extern size_t mem_allocated_peak;
+
+
+/* loads some more of a song that is being loaded progressively, up to
+ * untilsec seconds of it or maxevents events (0 = no limit). once the song is
+ * fully loaded, or on error, its file is closed and trackinfo->loading reset.
+ * returns ACTION_NONE on success, ACTION_ERR_SOFT on error. */
+static enum playaction loadmore(const struct clioptions *params, struct trackinfodata *trackinfo, unsigned long untilsec, unsigned int maxevents) {
+  int r;
+  r = midi_progstep(untilsec, maxevents, &progress);
+  /* the events reader might hold a piece of the song that just changed */
+  pullevents(-1, NULL, 0, 0);
+  trackinfo->totlen = progress.totlen;
+  trackinfo->loadperc = progress.parsed / (progress.total / 100 + 1);
+  if (r == 0) return(ACTION_NONE);
+  if (trackinfo->loading != 0) {
+    fio_close(&songfile);
+    trackinfo->loading = 0;
+  }
+  if (r == 1) return(ACTION_NONE);
+  if (r == MIDI_OUTOFMEM) {
+    ui_puterrmsg(params->midifile, "Error: Out of memory");
+  } else {
+    ui_puterrmsg(params->midifile, "Error: Malformed MIDI file");
+  }
+  return(ACTION_ERR_SOFT);
+}
+
+
 /* reads the BLASTER variable for best guessing of current hardware and port.
  * If nothing found, fallbacks to MPU and 0x330 */
 static void preload_outdev(struct clioptions *params) {
@@ -1085,35 +1260,37 @@ static void randomize_playlist(long int *offsets, unsigned int nitems) {
   }
 }
 
+/* position of the next entry of the playlist (see getnextm3uitem()) */
+static unsigned int m3upos;
+
 /* reads a position from an M3U file and returns a ptr from static mem */
 static char *getnextm3uitem(int loop, const char *playlist, long int *playlist_offsets, unsigned int playlist_len, enum order playlist_order) {
   static char fnamebuf[256];
-  static unsigned int i;
   char tempstr[256];
   int slen;
   struct fiofile f;
 
   if(playlist_len > 1 && playlist_order == REVERSE_ORDER) {
-    switch(i) {
+    switch(m3upos) {
       case 0:
-        i = playlist_len - 2;
+        m3upos = playlist_len - 2;
         break;
       case 1:
-        i = playlist_len - 1;
+        m3upos = playlist_len - 1;
         break;
       default:
-        i -= 2;
+        m3upos -= 2;
         break;
     }
-  } else if(i >= playlist_len) {
+  } else if(m3upos >= playlist_len) {
     if(!loop) return "";
-    i = 0;
+    m3upos = 0;
     if(playlist_order == RANDOM_ORDER) randomize_playlist(playlist_offsets, playlist_len);
   }
 
   /* open the playlist and read its size */
   if (fio_open(playlist, FIO_OPEN_RD, &f) != 0) return(NULL);
-  fio_seek(&f, FIO_SEEK_START, playlist_offsets[i++]);
+  fio_seek(&f, FIO_SEEK_START, playlist_offsets[m3upos++]);
 
   /* read the string into fnamebuf */
   slen = 0;
@@ -1183,15 +1360,18 @@ static void copyline(char *d, int l, char *s) {
 
 static enum playaction loadfile_midi(struct fiofile *f, const struct clioptions *params, struct trackinfodata *trackinfo, long int *trackpos) {
   static unsigned long trackmap[MAXTRACKS];
+  static unsigned long tracklens[MAXTRACKS];
+  static long trackheads[MAXTRACKS];
   int miditracks;
   int i;
+  int progressive;
   long newtrack;
   char copystring[UI_TITLEMAXLEN];
   char text[256];
 
   *trackpos = -1;
 
-  miditracks = midi_readhdr(f, &(trackinfo->midiformat), &(trackinfo->miditimeunitdiv), trackmap, MAXTRACKS);
+  miditracks = midi_readhdr(f, &(trackinfo->midiformat), &(trackinfo->miditimeunitdiv), trackmap, tracklens, MAXTRACKS);
   if (miditracks < 1) {
     char errstr[64];
     sprintf(errstr, "Error: Invalid MIDI file format (ERR %d)", miditracks);
@@ -1220,14 +1400,96 @@ static enum playaction loadfile_midi(struct fiofile *f, const struct clioptions
     return(ACTION_ERR_SOFT);
   }
 
+  /* the song is loaded progressively if possible, so playback can start
+   * after its first seconds are loaded: that is if the file has a single
+   * track, or if all its tracks are resident in memory. patches to preload
+   * into a GUS must be known up front, though. */
+  progressive = (params->nopack == 0);
+#ifdef MSDOS
+  if ((params->device == DEV_GUS) || (miditracks > 1)) progressive = 0;
+#else
+  for (i = 0; (i < miditracks) && (miditracks > 1); i++) {
+    fio_seek(f, FIO_SEEK_START, trackmap[i]);
+    if (fio_getptr(f, tracklens[i]) == NULL) progressive = 0;
+  }
+#endif
+  /* tracks of streamed songs are added the same way, whatever they are */
+  if (params->stream != 0) progressive = 1;
+
+  if (params->stream != 0) {
+#ifdef DBGFILE
+    midi_streamopen(f, trackinfo->miditimeunitdiv, &(trackinfo->channelsusage), params->logfile, trackinfo->reqpatches);
+#else
+    midi_streamopen(f, trackinfo->miditimeunitdiv, &(trackinfo->channelsusage), trackinfo->reqpatches);
+#endif
+  } else if (progressive) {
+#ifdef DBGFILE
+    *trackpos = midi_progopen(f, trackinfo->miditimeunitdiv, &(trackinfo->channelsusage), params->logfile, trackinfo->reqpatches);
+#else
+    *trackpos = midi_progopen(f, trackinfo->miditimeunitdiv, &(trackinfo->channelsusage), trackinfo->reqpatches);
+#endif
+    if (*trackpos == MIDI_OUTOFMEM) {
+      ui_puterrmsg(params->midifile, "Error: Out of memory");
+      return(ACTION_ERR_SOFT);
+    }
+  } else {
+#ifdef MSDOS
+    struct midi_songsize songsize;
+#endif
+    /* tracks are loaded as packed event streams */
+    midi_packtracks(1);
+#ifdef MSDOS
+    /* the song is sized first, so all the memory it needs is reserved at once
+     * and a song that does not fit is rejected before being parsed. the unix
+     * arena grows as needed, there this pass would only slow the load down */
+    memset(&songsize, 0, sizeof(songsize));
+    for (i = 0; i < miditracks; i++) {
+      fio_seek(f, FIO_SEEK_START, trackmap[i]);
+      if (midi_tracksize(f, tracklens[i], &songsize) != 0) {
+        ui_puterrmsg(params->midifile, "Error: Malformed MIDI file");
+        return(ACTION_ERR_SOFT);
+      }
+    }
+#ifdef DBGFILE
+    if (params->logfile) fprintf(params->logfile, "SONG SIZE: %lu EVENTS, %lu PACKED BYTES, %lu SYSEX BYTES\n", songsize.events, songsize.packedbytes, songsize.sysexbytes);
+#endif
+    if (midi_reserve(&songsize, (params->nopack != 0) ? (MIDI_MERGE_PACKED | MIDI_MERGE_ARRAY) : MIDI_MERGE_PACKED) < 0) {
+      ui_puterrmsg(params->midifile, "Error: Out of memory");
+      return(ACTION_ERR_SOFT);
+    }
+#endif
+  }
   for (i = 0; i < miditracks; i++) {
     char tracktitle[UI_TITLEMAXLEN];
     unsigned long tracklen;
+    const unsigned char *trackbuf = NULL;
 
 #ifdef DBGFILE
     if (params->logfile) fprintf(params->logfile, "LOADING TRACK %d FROM OFFSET 0x%04X\n", i, trackmap[i]);
 #endif
     fio_seek(f, FIO_SEEK_START, trackmap[i]);
+#ifndef MSDOS
+    trackbuf = fio_getptr(f, tracklens[i]);
+#endif
+    if (progressive) { /* parse only the very start of the track for now */
+      newtrack = midi_progtrack(trackbuf, tracklens[i], tracktitle, UI_TITLEMAXLEN,
+                                (i == 0) ? copystring : NULL, (i == 0) ? UI_TITLEMAXLEN : 0,
+                                (i == 0) ? text : NULL, (i == 0) ? sizeof(text) : 0,
+                                &tracklen);
+    } else
+#ifndef MSDOS
+    /* if the whole chunk is resident in memory, parse it from there */
+    if (trackbuf != NULL) {
+      newtrack = midi_trackbuf2events(trackbuf, tracklens[i], tracktitle, UI_TITLEMAXLEN,
+                                      (i == 0) ? copystring : NULL, (i == 0) ? UI_TITLEMAXLEN : 0,
+                                      (i == 0) ? text : NULL, (i == 0) ? sizeof(text) : 0,
+                                      &(trackinfo->channelsusage),
+#ifdef DBGFILE
+                                      params->logfile,
+#endif
+                                      &tracklen, trackinfo->reqpatches);
+    } else
+#endif
     if (i == 0) { /* copyright and text events are fetched from track 0 only */
       newtrack = midi_track2events(f, tracktitle, UI_TITLEMAXLEN, copystring,
                                    UI_TITLEMAXLEN, text, sizeof(text),
@@ -1261,13 +1523,40 @@ static enum playaction loadfile_midi(struct fiofile *f, const struct clioptions
         memcpy(trackinfo->title[trackinfo->titlescount++], tracktitle, UI_TITLEMAXLEN);
       }
     }
-    /* merge the track now */
-    if (newtrack >= 0) {
-      *trackpos = midi_mergetrack(*trackpos, newtrack, &(trackinfo->totlen), trackinfo->miditimeunitdiv);
+    /* remember the track so it gets merged with others once all are loaded */
+    trackheads[i] = newtrack;
+  }
+  if (params->stream != 0) {
+    /* go through the song once for its length, then play it from the file */
+    if (midi_streamstart(&progress) != 0) {
+      ui_puterrmsg(params->midifile, "Error: Malformed MIDI file");
+      return(ACTION_ERR_SOFT);
+    }
+    trackinfo->totlen = progress.totlen;
+    *trackpos = (progress.events == 0) ? -1 : 0;
+    trackinfo->layout = MIDI_LAYOUT_STREAM;
+  } else if (progressive) {
+    /* load the first seconds of the song, the rest is loaded during playback */
+    if (loadmore(params, trackinfo, PROGWINDOW, 0) != ACTION_NONE) return(ACTION_ERR_SOFT);
+    trackinfo->loading = (progress.done == 0);
+    if (progress.events == 0) *trackpos = -1;
+    trackinfo->layout = MIDI_LAYOUT_PACKED;
+  } else if (params->nopack == 0) {
+    /* merge all tracks now, in a single pass, converting deltas to
+     * microseconds so the playback loop does not need to recompute them */
+    *trackpos = midi_mergetracks(trackheads, miditracks, &(trackinfo->totlen), trackinfo->miditimeunitdiv, MIDI_MERGE_USDELTA | MIDI_MERGE_PACKED);
+    trackinfo->layout = MIDI_LAYOUT_PACKED;
+  } else {
+    *trackpos = midi_mergetracks(trackheads, miditracks, &(trackinfo->totlen), trackinfo->miditimeunitdiv, MIDI_MERGE_USDELTA | MIDI_MERGE_PACKED | MIDI_MERGE_ARRAY);
+    trackinfo->layout = MIDI_LAYOUT_ARRAY;
+  }
+  trackinfo->usdeltas = 1;
 #ifdef DBGFILE
-      if (params->logfile) fprintf(params->logfile, "TRACK %d MERGED (start id=%ld) -> TOTAL TIME: %ld\n", i, *trackpos, trackinfo->totlen);
+  if (params->logfile) fprintf(params->logfile, "%d TRACKS MERGED (start id=%ld) -> TOTAL TIME: %ld\n", miditracks, *trackpos, trackinfo->totlen);
 #endif
-    }
+  if (*trackpos == MIDI_OUTOFMEM) {
+    ui_puterrmsg(params->midifile, "Error: Out of memory");
+    return(ACTION_ERR_SOFT);
   }
   /* if we got any 'text', but no 'titles', then push the text into titles */
   if ((text[0] != 0) && (trackinfo->titlescount == 0)) {
@@ -1285,23 +1574,25 @@ static enum playaction loadfile_midi(struct fiofile *f, const struct clioptions
 
 
 static enum playaction loadfile(const struct clioptions *params, struct trackinfodata *trackinfo, long int *trackpos) {
-  struct fiofile f;
+  struct fiofile *f = &songfile;
   unsigned char hdr[16];
   enum playaction res;
 
+  memset(&songkey, 0, sizeof(songkey));
+
   /* (try to) open the music file */
-  if (fio_open(params->midifile, FIO_OPEN_RD, &f) != 0) {
+  if (fio_open(params->midifile, FIO_OPEN_RD, f) != 0) {
     ui_puterrmsg(params->midifile, "Error: Failed to open the file");
     return(ACTION_ERR_SOFT);
   }
 
   /* read first few bytes of the file to detect its format, and rewind */
-  if (fio_read(&f, hdr, 16) != 16) {
-    fio_close(&f);
+  if (fio_read(f, hdr, 16) != 16) {
+    fio_close(f);
     ui_puterrmsg(params->midifile, "Error: Unknown file format");
     return(ACTION_ERR_SOFT);
   }
-  fio_seek(&f, FIO_SEEK_START, 0);
+  fio_seek(f, FIO_SEEK_START, 0);
 
   /* analyze the header to guess the format of the file */
   trackinfo->fileformat = header2fileformat(hdr);
@@ -1310,10 +1601,35 @@ static enum playaction loadfile(const struct clioptions *params, struct trackinf
   switch (trackinfo->fileformat) {
     case FORMAT_MIDI:
     case FORMAT_RMID:
-      res = loadfile_midi(&f, params, trackinfo, trackpos);
+#ifndef MSDOS
+      /* the song might have been played recently and be kept in memory */
+      if (params->stream == 0) {
+        *trackpos = songcache_recall(params->midifile, f, trackinfo, &songkey);
+#ifdef DBGFILE
+        if (params->logfile) fprintf(params->logfile, "SONG MEMORY CACHE: %s (hits=%lu misses=%lu)\n", (songkey.kept != 0) ? "HIT" : "MISS", songcache_hits, songcache_misses);
+#endif
+        if (songkey.kept != 0) {
+          fio_close(f);
+          res = ACTION_NONE;
+          break;
+        }
+      }
+#endif
+      /* a pre-parsed copy of the song might be available */
+      if ((params->cachedir != NULL) && (params->nopack == 0) && (params->stream == 0)) {
+        *trackpos = songcache_load(params->cachedir, params->midifile, f, trackinfo, &songkey);
+        if (songkey.hit != 0) {
+#ifdef DBGFILE
+          if (params->logfile) fprintf(params->logfile, "LOADED FROM CACHE (start id=%ld) -> TOTAL TIME: %ld\n", *trackpos, trackinfo->totlen);
+#endif
+          res = ACTION_NONE;
+          break;
+        }
+      }
+      res = loadfile_midi(f, params, trackinfo, trackpos);
       break;
     case FORMAT_MUS:
-      *trackpos = mus_load(&f, &(trackinfo->totlen), &(trackinfo->miditimeunitdiv), &(trackinfo->channelsusage), trackinfo->reqpatches);
+      *trackpos = mus_load(f, &(trackinfo->totlen), &(trackinfo->miditimeunitdiv), &(trackinfo->channelsusage), trackinfo->reqpatches);
       if (*trackpos == MUS_OUTOFMEM) { /* detect out of memory */
         res = ACTION_ERR_SOFT;
         ui_puterrmsg(params->midifile, "Error: Out of memory");
@@ -1336,7 +1652,9 @@ static enum playaction loadfile(const struct clioptions *params, struct trackinf
       ui_puterrmsg(params->midifile, "Error: Unknown file format");
       break;
   }
-  fio_close(&f);
+  /* the file is still needed if the song is being loaded progressively, or
+   * streamed */
+  if ((trackinfo->loading == 0) && (trackinfo->layout != MIDI_LAYOUT_STREAM)) fio_close(f);
 
   /* if no text data could be found at all, add a note about that */
   if ((res == ACTION_NONE) && (trackinfo->titlescount == 0)) {
@@ -1347,14 +1665,135 @@ static enum playaction loadfile(const struct clioptions *params, struct trackinf
 }
 
 
-static void pauseplay(unsigned long *starttime, unsigned long *nexteventtime, struct trackinfodata *trackinfo) {
+#ifndef MSDOS
+/* with /thread, the screen is drawn and the keyboard read by a thread of
+ * their own, so a slow terminal never delays playback. what the screen shows
+ * is handed to it through uiring (whenever the playback thread would have
+ * drawn it), and keys come back through keyring */
+struct uistate {
+  unsigned short refreshflags;
+  unsigned short refreshchans;
+  unsigned char volume;
+  struct trackinfodata trackinfo;
+};
+static struct ring uiring;
+static struct ring keyring;
+static pthread_t uithreadid;
+static int uithreadstop;
+
+static void *uithread(void *arg) {
+  const struct clioptions *params = arg;
+  static struct uistate st, msg;
+  unsigned short refreshflags = 0, refreshchans = 0;
+  int paused = 0;
+  int k;
+  /* the playback thread might be real-time, this one must not be */
+  rt_unsetsched(params->cpu);
+  while (__atomic_load_n(&uithreadstop, __ATOMIC_ACQUIRE) == 0) {
+    /* only the last state matters, but what needs to be redrawn adds up */
+    while (ring_get(&uiring, &msg) == 0) {
+      refreshflags |= msg.refreshflags;
+      refreshchans |= msg.refreshchans;
+      memcpy(&st, &msg, sizeof(st));
+    }
+    if ((refreshflags != 0) && (paused == 0)) {
+      ui_draw(&(st.trackinfo), &refreshflags, &refreshchans, params->devtypename, params->devname,
+#ifdef HAVE_PORT_IO
+        params->devport, params->onlpt,
+#endif
+        st.volume);
+    }
+    k = getkey_ifany();
+    if (k == -1) { /* wait for a key, or for the next update */
+      fd_set rfds;
+      struct timeval timeout = { .tv_sec = 0, .tv_usec = 10000 };
+      FD_ZERO(&rfds);
+      FD_SET(STDIN_FILENO, &rfds);
+      select(STDIN_FILENO + 1, &rfds, NULL, NULL, &timeout);
+      continue;
+    }
+    /* the pause message is displayed from here, so nothing draws over it */
+    if (paused != 0) {
+      paused = 0;
+    } else if (k == ' ') {
+      ui_puterrmsg("PAUSE", "[ Press any key ]");
+      paused = 1;
+    }
+    while ((ring_put(&keyring, &k) != 0) && (__atomic_load_n(&uithreadstop, __ATOMIC_ACQUIRE) == 0)) usleep(1000);
+  }
+  return(NULL);
+}
+
+/* hands the screen state to the ui thread, in place of ui_draw(). if the ui
+ * thread lags behind, the update is dropped, and what needs to be redrawn
+ * goes with the next one */
+static void postuistate(const struct trackinfodata *trackinfo, unsigned short *refreshflags, unsigned short *refreshchans, unsigned char volume) {
+  static struct uistate msg;
+  static unsigned short pendingflags, pendingchans;
+  msg.refreshflags = *refreshflags | pendingflags;
+  msg.refreshchans = *refreshchans | pendingchans;
+  msg.volume = volume;
+  memcpy(&(msg.trackinfo), trackinfo, sizeof(struct trackinfodata));
+  if (ring_put(&uiring, &msg) == 0) {
+    pendingflags = 0;
+    pendingchans = 0;
+  } else {
+    pendingflags = msg.refreshflags;
+    pendingchans = msg.refreshchans;
+  }
+  *refreshflags = 0;
+  *refreshchans = 0;
+}
+
+/* starts the ui thread for the song described by trackinfo. returns 0 on
+ * success, non-zero otherwise */
+static int uithread_start(struct clioptions *params, const struct trackinfodata *trackinfo) {
+  unsigned short refreshflags = 0, refreshchans = 0;
+  if (ring_init(&uiring, sizeof(struct uistate), 16) != 0) return(-1);
+  if (ring_init(&keyring, sizeof(int), 16) != 0) {
+    ring_free(&uiring);
+    return(-1);
+  }
+  /* the screen is up to date already, the ui thread only needs the state */
+  postuistate(trackinfo, &refreshflags, &refreshchans, params->volume);
+  uithreadstop = 0;
+  if (pthread_create(&uithreadid, NULL, uithread, params) != 0) {
+    ring_free(&uiring);
+    ring_free(&keyring);
+    return(-1);
+  }
+  return(0);
+}
+
+static void uithread_stop(void) {
+  __atomic_store_n(&uithreadstop, 1, __ATOMIC_RELEASE);
+  pthread_join(uithreadid, NULL);
+  ring_free(&uiring);
+  ring_free(&keyring);
+}
+#endif
+
+
+/* returns the next key pressed, or -1 if none. with /thread, keys are read
+ * by the ui thread */
+static int nextkey(int threaded) {
+  int k = -1;
+  if (threaded == 0) return(getkey_ifany());
+#ifndef MSDOS
+  if (ring_get(&keyring, &k) != 0) k = -1;
+#endif
+  return(k);
+}
+
+
+static void pauseplay(unsigned long *starttime, unsigned long *nexteventtime, struct trackinfodata *trackinfo, int threaded) {
   unsigned long beforepause, afterpause, deltaremainder;
   int i;
   /* save timing information */
   timer_read(&beforepause);
   deltaremainder = *nexteventtime - beforepause;
-  /* print a pause message on screen */
-  ui_puterrmsg("PAUSE", "[ Press any key ]");
+  /* print a pause message on screen (the ui thread does, if any) */
+  if (threaded == 0) ui_puterrmsg("PAUSE", "[ Press any key ]");
   /* turn off all notes before pausing */
   for (i = 0; i < 128; i++) {
     if (trackinfo->notestates[i] != 0) {
@@ -1367,8 +1806,13 @@ static void pauseplay(unsigned long *starttime, unsigned long *nexteventtime, st
       }
     }
   }
+  dev_flush();
   /* wait for a key press */
-  getkey();
+  if (threaded == 0) {
+    getkey();
+  } else {
+    while (nextkey(threaded) == -1) udelay(10000);
+  }
   /* restore play timing */
   /* FIXME if paused for a long time (over a hour and some), the timer might wrap, leading to very bad things */
   timer_read(&afterpause);
@@ -1395,6 +1839,59 @@ static void init_trackinfo(struct trackinfodata *trackinfo, const struct cliopti
 #endif
 }
 
+#ifndef MSDOS
+/* looks up the next song of the playlist and starts loading it into the
+ * other memory arena. the song being played must be loaded entirely. errors
+ * are not reported now: a song that fails to preload is loaded again the
+ * usual way when its turn comes (the caller must redraw the screen then) */
+static void preloadnext(struct clioptions *params, long int *playlist_offsets, unsigned int playlist_len, enum order playlist_order) {
+  struct clioptions nextparams;
+  struct songkey cursongkey;
+  enum playaction res;
+
+  /* the name of the current song is kept away from getnextm3uitem() */
+  if (params->midifile != songnamebuf[0]) {
+    strcpy(songnamebuf[0], params->midifile);
+    params->midifile = songnamebuf[0];
+  }
+  nextm3upos = m3upos;
+  nextmidifile = getnextm3uitem(params->dontstop, params->playlist, playlist_offsets, playlist_len, playlist_order);
+  nextstate = NEXT_NAMED;
+  if ((nextmidifile == NULL) || (nextmidifile[0] == 0)) return;
+  strcpy(songnamebuf[1], nextmidifile);
+  nextmidifile = songnamebuf[1];
+
+  if (mem_arena(1 - songarena) < 0) return;
+  mem_clear();
+  nextparams = *params;
+  nextparams.midifile = nextmidifile;
+  init_trackinfo(&nexttrack, &nextparams);
+  cursongkey = songkey;
+  res = loadfile(&nextparams, &nexttrack, &nexttrackpos);
+  nextsongkey = songkey;
+  songkey = cursongkey;
+  mem_arena(songarena);
+  if (res != ACTION_NONE) return;
+  nextstate = (nexttrack.loading != 0) ? NEXT_LOADING : NEXT_READY;
+}
+
+
+/* loads some more of the next song, if it is being preloaded */
+static void preloadmore(const struct clioptions *params) {
+  struct clioptions nextparams = *params;
+  enum playaction res;
+  nextparams.midifile = nextmidifile;
+  mem_arena(1 - songarena);
+  res = loadmore(&nextparams, &nexttrack, ULONG_MAX, PROGBATCH);
+  mem_arena(songarena);
+  if (res != ACTION_NONE) {
+    nextstate = NEXT_NAMED;
+  } else if (nexttrack.loading == 0) {
+    nextstate = NEXT_READY;
+  }
+}
+#endif
+
 static int load_playlist_offsets(const char *playlist_path, int should_randomize, long int **offsets, unsigned int *nitems) {
   struct fiofile f;
   long int next_line_offset = -1;
@@ -1437,6 +1934,30 @@ static int load_playlist_offsets(const char *playlist_path, int should_randomize
   return ACTION_NEXT;
 }
 
+static struct playstats playstats; /* statistics of the song being played */
+static unsigned char showstats;    /* toggled with the 's' key */
+
+/* totals of what was played with /render, reported on exit */
+static unsigned long renderevents; /* events played */
+static unsigned long rendermusic;  /* time of music played (ms) */
+static unsigned long renderwall;   /* real time it took (us) */
+
+/* sums up the playback statistics into trackinfo, for the screen. called
+ * once every second of playback. */
+static void sumupstats(struct trackinfodata *trackinfo, unsigned long starttime, unsigned long *lastevents) {
+  unsigned long t;
+  timer_read(&t);
+  t -= starttime;
+  trackinfo->statlate[0] = stats_percentile(&playstats, 5000);
+  trackinfo->statlate[1] = stats_percentile(&playstats, 9900);
+  trackinfo->statlate[2] = stats_percentile(&playstats, 9990);
+  trackinfo->statlate[3] = playstats.maxlate;
+  trackinfo->statevps = playstats.events - *lastevents;
+  *lastevents = playstats.events;
+  trackinfo->statdevload = (t >= 1000) ? (unsigned short)(playstats.devtime / (t / 1000)) : 0;
+}
+
+
 /* plays a file. returns 0 on success, non-zero if the program must exit */
 static enum playaction playfile(struct clioptions *params, struct trackinfodata *trackinfo, struct midi_event *eventscache, long int *playlist_offsets, unsigned int playlist_len, enum order playlist_order) {
   int i;
@@ -1445,10 +1966,24 @@ static enum playaction playfile(struct clioptions *params, struct trackinfodata
   unsigned short refreshflags = UI_REFRESH_ALL;
   unsigned short refreshchans = 0xffffu;
   long trackpos;
+  long songstart;
+  int cacheable;
+  int gapless = 0; /* non-zero if the song was preloaded while the previous played */
+  int threaded = 0; /* non-zero if the screen is handled by the ui thread */
+#ifndef MSDOS
+  int keepable;
+#endif
   unsigned long midiplaybackstart;
-  struct midi_event *curevent;
+  unsigned long eventsplayed = 0;
+  unsigned long dispatchtime, dispatchend;
+  unsigned long songwallstart; /* real time when the song started loading */
+  unsigned long statsevents = 0; /* events played until the last second */
+  struct midi_event far *curevent;
 #ifdef DBGFILE
-  unsigned long elticks = 0; /* used only to count clock ticks in debug mode */
+  unsigned long elticks = 0; /* used only to count clock ticks (or us) in debug mode */
+#ifdef OPL
+  struct oplstats oplstart = {0}; /* OPL counters before the song */
+#endif
 #endif
   unsigned char *sysexbuff;
 
@@ -1459,27 +1994,55 @@ static enum playaction playfile(struct clioptions *params, struct trackinfodata
       return(ACTION_EXIT);
   }
 
-  /* flush all MIDI events from memory for new events to have where to load */
-  mem_clear();
-
-  /* init trackinfo & cache data */
-  init_trackinfo(trackinfo, params);
-  getnexteventfromcache(eventscache, -1, 0);
-
-  /* update screen with the next operation */
-  sprintf(trackinfo->title[0], "Loading file...");
-  ui_draw(trackinfo, &refreshflags, &refreshchans, params->devtypename,
 #ifndef MSDOS
-    params->devname,
+  /* the next song might have been looked up, or even preloaded, already. it
+   * is used only when going forward in the playlist: when going back, the
+   * playlist is just put back where it was before the lookup */
+  if ((nextstate != NEXT_NONE) && (playlist_order == REVERSE_ORDER)) {
+    if (nextstate == NEXT_LOADING) fio_close(&songfile);
+    m3upos = nextm3upos;
+    nextstate = NEXT_NONE;
+  }
+  if ((nextstate == NEXT_LOADING) || (nextstate == NEXT_READY)) {
+    /* the song is there already, in the other memory arena */
+    songarena = 1 - songarena;
+    mem_arena(songarena);
+    *trackinfo = nexttrack;
+    trackpos = nexttrackpos;
+    songkey = nextsongkey;
+    gapless = 1;
+  }
+#endif
+
+  if (gapless == 0) {
+    /* flush all MIDI events from memory for new events to have where to load */
+    mem_clear();
+
+    /* init trackinfo & cache data */
+    init_trackinfo(trackinfo, params);
+
+    /* update screen with the next operation */
+    sprintf(trackinfo->title[0], "Loading file...");
+    ui_draw(trackinfo, &refreshflags, &refreshchans, params->devtypename,
+#ifndef MSDOS
+      params->devname,
 #endif
 #ifdef HAVE_PORT_IO
-    params->devport, params->onlpt,
+      params->devport, params->onlpt,
 #endif
-    params->volume);
-  refreshflags = UI_REFRESH_ALL;
+      params->volume);
+    refreshflags = UI_REFRESH_ALL;
+  }
+  getnexteventfromcache(eventscache, -1, 0, 0);
 
   /* if running on a playlist, load next song */
   if (params->playlist != NULL) {
+#ifndef MSDOS
+    if (nextstate != NEXT_NONE) {
+      params->midifile = nextmidifile;
+      nextstate = NEXT_NONE;
+    } else
+#endif
     params->midifile = getnextm3uitem(params->dontstop, params->playlist, playlist_offsets, playlist_len, playlist_order);
     if (params->midifile == NULL) {
       ui_puterrmsg("Playlist error", "Failed to fetch an entry from the playlist");
@@ -1491,6 +2054,7 @@ static enum playaction playfile(struct clioptions *params, struct trackinfodata
   /* reset the timer, to make sure it doesn't wrap around during playback */
   timer_reset();
   timer_read(&nexteventtime); /* save current time, to schedule when the song shall start */
+  timer_readreal(&songwallstart);
 
 #ifdef DBGFILE
   if (params->logfile) fprintf(params->logfile, "Reset MPU\n");
@@ -1513,8 +2077,9 @@ static enum playaction playfile(struct clioptions *params, struct trackinfodata
   /* reset the device's master volume via sysex */
   //dev_sysex(0x7F, "\xF0\x7F\x7F\x04\x01\x7F\x7F\xF7", 8);
 
-  /* preset the midi device to GM/GS/XG mode (or nothing) */
-  switch (params->gmgspreset) {
+  /* preset the midi device to GM/GS/XG mode (or nothing). this, and the SYX
+   * file below, are skipped between songs that play without a gap */
+  switch ((gapless != 0) ? PRESET_NONE : params->gmgspreset) {
     case PRESET_GM: /* GM RESET */
       dev_sysex(0, "\xF0\x7E\x7F\x09\x01\xF7", 6);
       break;
@@ -1528,7 +2093,7 @@ static enum playaction playfile(struct clioptions *params, struct trackinfodata
   }
 
   /* if a SYX init file is provided, feed it to the MIDI synth now */
-  if (params->syxrst != NULL) {
+  if ((params->syxrst != NULL) && (gapless == 0)) {
     int syxlen;
     struct fiofile syxfh;
 #ifdef DBGFILE
@@ -1565,27 +2130,32 @@ static enum playaction playfile(struct clioptions *params, struct trackinfodata
     fio_close(&syxfh); /* close the syx file */
   }
 
-  /* load the file into memory */
-  sprintf(trackinfo->title[0], "Loading...");
-  filename2basename(params->midifile, trackinfo->filename, NULL, UI_FILENAMEMAXLEN);
+  if (gapless == 0) {
+    /* load the file into memory */
+    sprintf(trackinfo->title[0], "Loading...");
+    filename2basename(params->midifile, trackinfo->filename, NULL, UI_FILENAMEMAXLEN);
 #ifdef MSDOS
-  ucasestr(trackinfo->filename);
+    ucasestr(trackinfo->filename);
 #endif
-  ui_draw(trackinfo, &refreshflags, &refreshchans, params->devtypename,
+    ui_draw(trackinfo, &refreshflags, &refreshchans, params->devtypename,
 #ifndef MSDOS
-    params->devname,
+      params->devname,
 #endif
 #ifdef HAVE_PORT_IO
-    params->devport, params->onlpt,
+      params->devport, params->onlpt,
 #endif
-    params->volume);
-  memset(trackinfo->title[0], 0, 16);
-  refreshflags = UI_REFRESH_ALL;
+      params->volume);
+    memset(trackinfo->title[0], 0, 16);
+    refreshflags = UI_REFRESH_ALL;
 
-  if ((params->playlist != NULL) && (params->delay < 2000)) nexteventtime += (2000 - params->delay) * 1000L; /* playback starts no sooner than in 2s (for playlist listening comfort) */
+    if ((params->playlist != NULL) && (params->delay < 2000)) nexteventtime += (2000 - params->delay) * 1000L; /* playback starts no sooner than in 2s (for playlist listening comfort) */
+    exitaction = loadfile(params, trackinfo, &trackpos);
+    if (exitaction != ACTION_NONE) return(exitaction);
+  } else {
+    exitaction = ACTION_NONE;
+  }
   nexteventtime += params->delay * 1000L; /* add the extra custom delay */
-  exitaction = loadfile(params, trackinfo, &trackpos);
-  if (exitaction != ACTION_NONE) return(exitaction);
+  songstart = trackpos;
 #ifdef MSDOS
   /* if driving a GUS, preload needed MIDI patches up front */
   if (params->device == DEV_GUS) {
@@ -1610,33 +2180,67 @@ static enum playaction playfile(struct clioptions *params, struct trackinfodata
     params->devport, params->onlpt,
 #endif
     params->volume);
+  if (params->render != 0) timer_advance(nexteventtime);
   for (;;) {
     timer_read(&midiplaybackstart); /* save start time so we can compute elapsed time later */
     if (midiplaybackstart >= nexteventtime) break; /* wait until the scheduled start time is met */
+    /* the song might as well go on loading meanwhile */
+    if ((trackinfo->loading != 0) && (nexteventtime - midiplaybackstart > PROGMARGIN)) {
+      exitaction = loadmore(params, trackinfo, ULONG_MAX, PROGBATCH);
+      if (exitaction != ACTION_NONE) break;
+    }
+  }
+#if defined DBGFILE && defined OPL
+  if ((params->device == DEV_OPL) || (params->device == DEV_OPL2) || (params->device == DEV_OPL3)) {
+    opl_getstats(&oplstart);
   }
+#endif
   nexteventtime = midiplaybackstart;
+  stats_clear(&playstats);
+  trackinfo->showstats = showstats;
+
+#ifndef MSDOS
+  if ((params->thread != 0) && (uithread_start(params, trackinfo) == 0)) threaded = 1;
+#endif
 
   while (trackpos >= 0) {
 
+    /* a song that is being loaded must always be loaded further than the
+     * events cache may read ahead */
+    while ((exitaction == ACTION_NONE) && (trackinfo->loading != 0) && (progress.events <= eventsplayed + EVENTSCACHESIZE)) {
+      exitaction = loadmore(params, trackinfo, ULONG_MAX, EVENTSCACHESIZE);
+    }
+    if (exitaction != ACTION_NONE) break;
+
     /* fetch next event */
-    curevent = getnexteventfromcache(eventscache, trackpos, params->xmsdelay);
+    curevent = getnexteventfromcache(eventscache, trackpos, params->xmsdelay, trackinfo->layout);
+    eventsplayed++;
     if (curevent == NULL) { /* abort on error */
       ui_puterrmsg(params->midifile, "Error: Memory access fault");
       exitaction = ACTION_ERR_HARD;
       break;
     }
 
-    /* give some time to the outdev driver for doing its things */
-    dev_tick();
-
     /* printf("Action: %d / Note: %d / Vel: %d / t=%lu / next->%ld\n", curevent->type, curevent->data.note.note, curevent->data.note.velocity, curevent->deltatime, curevent->next); */
     if (curevent->deltatime > 0) { /* if I have some time ahead, I can do a few things */
-      nexteventtime += DELTATIME2US(curevent->deltatime, trackinfo->tempo, trackinfo->miditimeunitdiv);
+      /* all events due at the previous instant are dispatched: send what the
+       * device held back of them, and give it some time for its things */
+      timer_readreal(&dispatchtime);
+      dev_flush();
+      dev_tick();
+      timer_readreal(&dispatchend);
+      playstats.devtime += dispatchend - dispatchtime;
+      if (trackinfo->usdeltas != 0) {
+        nexteventtime += curevent->deltatime;
+      } else {
+        nexteventtime += DELTATIME2US(curevent->deltatime, trackinfo->tempo, trackinfo->miditimeunitdiv);
+      }
 #ifdef DBGFILE
       elticks += curevent->deltatime;
 #endif
       while (exitaction == ACTION_NONE) {
         unsigned long int t;
+        int uitime;
         /* is time for next event yet? */
         timer_read(&t);
         if (t >= nexteventtime) break;
@@ -1644,9 +2248,15 @@ static enum playaction playfile(struct clioptions *params, struct trackinfodata
         /* detect wraparound of the timer counter */
         if (t > ULONG_MAX / 2) break;
         /* if next event not due yet, do some keyboard/screen processing */
-        if (compute_elapsed_time(midiplaybackstart, &(trackinfo->elapsedsec)) != 0) refreshflags |= UI_REFRESH_TIME;
+        if (compute_elapsed_time(midiplaybackstart, &(trackinfo->elapsedsec)) != 0) {
+          sumupstats(trackinfo, midiplaybackstart, &statsevents);
+          refreshflags |= UI_REFRESH_TIME;
+        }
+        /* when rendering, the keyboard and the screen are looked after only
+         * once per second of the song */
+        uitime = (params->render == 0) || ((refreshflags & UI_REFRESH_TIME) != 0);
         /* read keypresses */
-        switch (getkey_ifany()) {
+        switch (uitime ? nextkey(threaded) : -1) {
           case 0x1B: /* escape */
           case 'q':
             exitaction = ACTION_EXIT;
@@ -1675,13 +2285,25 @@ static enum playaction playfile(struct clioptions *params, struct trackinfodata
             refreshflags |= UI_REFRESH_VOLUME;
             break;
           case ' ':  /* pause */
-            pauseplay(&midiplaybackstart, &nexteventtime, trackinfo);
+            pauseplay(&midiplaybackstart, &nexteventtime, trackinfo, threaded);
             refreshflags = UI_REFRESH_ALL; /* force a full-screen refresh to wipe */
             refreshchans = 0xffffu;        /* the pause message out of the screen */
             break;
+          case 's':  /* show/hide playback statistics */
+            showstats ^= 1;
+            trackinfo->showstats = showstats;
+            refreshflags |= UI_REFRESH_TITLECOPYR | UI_REFRESH_TIME;
+            break;
         }
-        /* do I need to refresh the screen now? if not, just call INT28h */
-        if (refreshflags != 0) {
+        /* do I need to refresh the screen now? if not, load some more of the
+         * song if it isn't loaded yet, and if there is time for it. else just
+         * call INT28h */
+        if ((refreshflags != 0) && (uitime != 0)) {
+#ifndef MSDOS
+          if (threaded) {
+            postuistate(trackinfo, &refreshflags, &refreshchans, params->volume);
+          } else
+#endif
           ui_draw(trackinfo, &refreshflags, &refreshchans, params->devtypename,
 #ifndef MSDOS
             params->devname,
@@ -1690,6 +2312,32 @@ static enum playaction playfile(struct clioptions *params, struct trackinfodata
             params->devport, params->onlpt,
 #endif
             params->volume);
+        } else if ((trackinfo->loading != 0) && (t > PROGMARGIN)) {
+          unsigned char loadperc = trackinfo->loadperc;
+          exitaction = loadmore(params, trackinfo, ULONG_MAX, PROGBATCH);
+          if ((trackinfo->loadperc != loadperc) || (trackinfo->loading == 0)) refreshflags |= UI_REFRESH_TIME;
+        } else
+#ifndef MSDOS
+        /* once the song is loaded, the next one can be loaded meanwhile */
+        if ((params->gapless != 0) && (params->playlist != NULL) && (params->nopack == 0) && (params->stream == 0) && (trackinfo->loading == 0) && (t > PROGMARGIN) && ((nextstate == NEXT_NONE) || (nextstate == NEXT_LOADING))) {
+          if (nextstate == NEXT_NONE) {
+            preloadnext(params, playlist_offsets, playlist_len, playlist_order);
+          } else {
+            preloadmore(params);
+          }
+          if (nextstate == NEXT_NAMED) { /* wipe any error message out */
+            refreshflags = UI_REFRESH_ALL;
+            refreshchans = 0xffffu;
+          }
+          if (nextstate == NEXT_READY) {
+            trackinfo->nextready = 1;
+            refreshflags |= UI_REFRESH_TIME;
+          }
+        } else
+#endif
+        if (params->render != 0) {
+          /* no waiting when rendering: the virtual clock jumps to the event */
+          timer_advance(nexteventtime);
         } else
 #ifdef MSDOS
         if (!params->nopowersave)
@@ -1701,17 +2349,35 @@ static enum playaction playfile(struct clioptions *params, struct trackinfodata
           union REGS regs;
           int86(0x28, &regs, &regs);
 #else
-          fd_set rfds;
-          FD_ZERO(&rfds);
-          FD_SET(STDIN_FILENO, &rfds);
-          struct timeval timeout = { .tv_sec = t / 1000000, .tv_usec = t % 1000000 };
-          select(STDIN_FILENO + 1, &rfds, NULL, NULL, &timeout);
+          if ((params->timing == TIMING_DEADLINE) && (t <= TIMINGSLICE)) {
+            timer_waituntil(nexteventtime);
+          } else {
+            fd_set rfds;
+            FD_ZERO(&rfds);
+            /* with TIMING_DEADLINE, wake up early enough to wait for the
+             * event itself with timer_waituntil() */
+            if (params->timing == TIMING_DEADLINE) t -= TIMINGSLICE;
+            t = timer_realspan(t);
+            struct timeval timeout = { .tv_sec = t / 1000000, .tv_usec = t % 1000000 };
+            /* the keyboard is not to be waited for if the ui thread reads it */
+            if (threaded == 0) FD_SET(STDIN_FILENO, &rfds);
+            select(STDIN_FILENO + 1, &rfds, NULL, NULL, &timeout);
+          }
 #endif
         }
       }
       if (exitaction != ACTION_NONE) break;
     }
 
+    /* how late is the event played compared to when it was due */
+    timer_read(&dispatchtime);
+    stats_add(&playstats, ((dispatchtime > nexteventtime) && (dispatchtime - nexteventtime < ULONG_MAX / 2)) ? dispatchtime - nexteventtime : 0);
+    /* the time spent in the device is real time, whatever the clock */
+    if ((params->render != 0) || (params->speed != 100)) timer_readreal(&dispatchtime);
+
+    /* events due at the same time go out together, if the device can */
+    dev_hold();
+
     switch (curevent->type) {
       case EVENT_NOTEON:
 #ifdef DBGFILE
@@ -1793,16 +2459,21 @@ static enum playaction playfile(struct clioptions *params, struct trackinfodata
       case EVENT_SYSEX:
       {
         uint16_t sysexlen;
-        /* read two bytes from sysexptr so I know how long the thing is */
-        mem_pull(curevent->data.sysex.sysexptr, &sysexlen, 2);
+        sysexbuff = (void *)wbuff;
+        if (trackinfo->layout == MIDI_LAYOUT_PACKED) {
+          sysexlen = midi_packsysex(curevent->data.sysex.sysexptr, sysexbuff);
+        } else if (trackinfo->layout == MIDI_LAYOUT_STREAM) {
+          sysexlen = midi_streamsysex(curevent->data.sysex.sysexptr, sysexbuff);
+        } else {
+          /* read two bytes from sysexptr so I know how long the thing is */
+          mem_pull(curevent->data.sysex.sysexptr, &sysexlen, 2);
+          i = sysexlen;
+          if ((i & 1) != 0) i++; /* XMS moves MUST occur on even-aligned data only */
+          mem_pull(curevent->data.sysex.sysexptr, sysexbuff, i + 2);
+        }
 #ifdef DBGFILE
         if (params->logfile) fprintf(params->logfile, "%lu: SYSEX is %d bytes long", trackinfo->elapsedsec, sysexlen);
 #endif
-        /* */
-        i = sysexlen;
-        if ((i & 1) != 0) i++; /* XMS moves MUST occur on even-aligned data only */
-        sysexbuff = (void *)wbuff;
-        mem_pull(curevent->data.sysex.sysexptr, sysexbuff, i + 2);
         dev_sysex(sysexbuff[2] & 0x0F, sysexbuff + 2, sysexlen);
 #ifdef DBGFILE
         if (params->logfile) {
@@ -1821,13 +2492,71 @@ static enum playaction playfile(struct clioptions *params, struct trackinfodata
         break;
     }
 
+    /* time spent sending the event (with DBGFILE, logging it as well) */
+    timer_readreal(&dispatchend);
+    playstats.devtime += dispatchend - dispatchtime;
+
     if (trackpos < 0) break;
     trackpos = curevent->next;
 
   }
 
+  dev_flush();
+
+  if (params->render != 0) {
+    unsigned long t;
+    timer_read(&t);
+    rendermusic += (t - midiplaybackstart) / 1000;
+    timer_readreal(&t);
+    renderwall += t - songwallstart;
+    renderevents += playstats.events;
+  }
+
+#ifndef MSDOS
+  if (threaded) uithread_stop();
+#endif
+
 #ifdef DBGFILE
   if (params->logfile) fprintf(params->logfile, "Clear notes\n");
+  if (params->logfile) {
+    unsigned long t;
+    timer_read(&t);
+    t -= midiplaybackstart;
+    fprintf(params->logfile, "EVENTS PLAYED: %lu in %lu ms (%lu per second)\n", playstats.events, t / 1000, (t >= 1000000lu) ? playstats.events / (t / 1000000lu) : playstats.events);
+    fprintf(params->logfile, "DEVICE TIME (%s): %lu us\n", params->devtypename, playstats.devtime);
+    fprintf(params->logfile, "LATENESS: p50=%lu us p99=%lu us p99.9=%lu us max=%lu us\n", stats_percentile(&playstats, 5000), stats_percentile(&playstats, 9900), stats_percentile(&playstats, 9990), playstats.maxlate);
+    fprintf(params->logfile, "LATENESS HISTOGRAM (up to N us: events):\n");
+    for (i = 0; i < STATS_BUCKETS; i++) {
+      if (playstats.hist[i] != 0) fprintf(params->logfile, "  %lu: %lu\n", stats_bucketmax(i), playstats.hist[i]);
+    }
+#ifndef MSDOS
+    if (params->timing == TIMING_DEADLINE) fprintf(params->logfile, "WAKE-AHEAD MARGIN: %lu us\n", timer_waitmargin());
+#endif
+#ifdef OPL
+    if ((params->device == DEV_OPL) || (params->device == DEV_OPL2) || (params->device == DEV_OPL3)) {
+      struct oplstats oplend;
+      opl_getstats(&oplend);
+      fprintf(params->logfile, "OPL REGISTER WRITES: %lu issued in %lu bursts, %lu skipped\n", oplend.issued - oplstart.issued, oplend.bursts - oplstart.bursts, oplend.skipped - oplstart.skipped);
+      fprintf(params->logfile, "OPL VOICE STEALS: %lu\n", oplend.steals - oplstart.steals);
+    }
+#endif
+  }
+#endif
+
+  /* the song can be cached for next time only if it was loaded entirely */
+  cacheable = (params->cachedir != NULL) && (songkey.size != 0) && (songkey.hit == 0) && (songkey.kept == 0) && (trackinfo->layout == MIDI_LAYOUT_PACKED) && (trackinfo->loading == 0) && (exitaction != ACTION_ERR_SOFT) && (exitaction != ACTION_ERR_HARD);
+
+#ifndef MSDOS
+  keepable = (songkey.size != 0) && (songkey.kept == 0) && (trackinfo->layout != MIDI_LAYOUT_STREAM) && (trackinfo->loading == 0) && (exitaction != ACTION_ERR_SOFT) && (exitaction != ACTION_ERR_HARD);
+#endif
+
+  /* stop loading the song, if it wasn't loaded entirely */
+  if ((trackinfo->loading != 0) || (trackinfo->layout == MIDI_LAYOUT_STREAM)) {
+    fio_close(&songfile);
+    trackinfo->loading = 0;
+  }
+#ifdef DBGFILE
+  if (params->logfile) fprintf(params->logfile, "PEAK MEMORY USE: %lu bytes\n", (unsigned long)mem_allocated_peak);
 #endif
 
   /* Look for notes that are still ON and turn them OFF */
@@ -1846,6 +2575,22 @@ static enum playaction playfile(struct clioptions *params, struct trackinfodata
   /* reset the device (all notes off, reset master volume, etc) */
   dev_clear(params->dev_clear_flags);
 
+  /* now that nothing plays anymore, keep a pre-parsed copy of the song */
+  if (cacheable) {
+    i = songcache_save(params->cachedir, params->midifile, &songkey, trackinfo, songstart);
+#ifdef DBGFILE
+    if (params->logfile) fprintf(params->logfile, "SONG CACHE WRITE: %s\n", (i == 0) ? "OK" : "FAILED");
+#endif
+  }
+#ifndef MSDOS
+  if (keepable) {
+    i = songcache_keep(params->midifile, &songkey, trackinfo, songstart);
+#ifdef DBGFILE
+    if (params->logfile) fprintf(params->logfile, "SONG KEPT IN MEMORY: %s\n", (i == 0) ? "OK" : "FAILED");
+#endif
+  }
+#endif
+
   return(exitaction);
 }
 
@@ -1860,11 +2605,17 @@ int main(int argc, char **argv) {
   long int *playlist_offsets = NULL;
   unsigned int playlist_len = 0;
   enum order playlistdir;
+  clock_t cputime = 0;
 
 #ifndef MSDOS
   params.devfd = -1;
 #endif
   params.volume = 100;
+  params.speed = 100;
+#ifndef MSDOS
+  params.memcache = 8192;
+  params.cpu = -1;
+#endif
 
 #ifndef MSDOS
   setlocale(LC_CTYPE, "");
@@ -1913,6 +2664,17 @@ int main(int argc, char **argv) {
                " /gus       use the Gravis UltraSound card (requires ULTRAMID)\n"
 #endif
                " /syx=<FILE> use SYSEX instructions from <FILE> for MIDI initialization\n"
+               " /cache=<DIR> keep pre-parsed copies of MIDI files in <DIR> to reload faster\n"
+#ifndef MSDOS
+               " /memcache=<KB> keep recently played songs in up to <KB> of memory\n"
+               " /gapless   load the next song of a playlist during playback, no pause\n"
+               " /thread    draw the screen from another thread than the one playing\n"
+               " /rtprio=<N> play with the real-time priority <N> (1..99)\n"
+#ifdef __linux__
+               " /cpu=<N>   play on cpu <N> only\n"
+#endif
+               " /timing={SELECT|DEADLINE} how to wait for events (default SELECT)\n"
+#endif
                " /sbnk=<FILE> load custom sound bank file (IBK on OPL, SBK on AWE)\n"
 #ifdef DBGFILE
                " /log=<FILE> write highly verbose logs about DOSMid's activity to <FILE>\n"
@@ -1921,6 +2683,10 @@ int main(int argc, char **argv) {
 #ifdef MSDOS
                " /fullcpu   do not let DOSMid try to be CPU-friendly\n"
 #endif
+               " /nopack    store songs unpacked (faster to read, but takes more memory)\n"
+               " /stream    play MIDI files straight from disk (for songs too big for memory)\n"
+               " /render    play as fast as possible and report the speed reached on exit\n"
+               " /speed=<N> play at <N> percent of the normal speed (10..1000)\n"
                " /dontstop  never wait for a keypress on error and continue the playlist\n"
                " /random    randomize playlist order\n"
                " /nosound   disable sound output\n"
@@ -2038,6 +2804,15 @@ int main(int argc, char **argv) {
     getkey();
     goto memallocfail;
   }
+#ifndef MSDOS
+  songcache_setbudget(params.memcache);
+
+  /* playback happens in this thread, that might get real-time scheduling */
+  if (((params.rtprio > 0) || (params.cpu >= 0)) && (rt_setsched(params.rtprio, params.cpu) != 0)) {
+    ui_puterrmsg("Warning", "Failed to set real-time scheduling (not permitted?)");
+    if (params.dontstop == 0) getkey();
+  }
+#endif
 
   if(params.playlist) {
     unsigned short int rflags = UI_REFRESH_TITLECOPYR, rchans = 0;
@@ -2054,6 +2829,12 @@ int main(int argc, char **argv) {
   }
 
   /* playlist loop */
+  if (params.render != 0) {
+    timer_setclock(TIMER_CLOCK_VIRTUAL, 0);
+  } else if (params.speed != 100) {
+    timer_setclock(TIMER_CLOCK_SCALED, params.speed);
+  }
+  cputime = clock();
   do {
     switch (action) {
       case ACTION_ERR_HARD: /* wait for a keypress and quit */
@@ -2074,7 +2855,7 @@ int main(int argc, char **argv) {
       case ACTION_NONE: /* choose an action depending on the mode we are in */
         if (params.playlist) goto next;
         /* wait 1s before quit, so it doesn't feel 'brutal', but don't if */
-        if (action == ACTION_NONE) udelay(1000000lu); /* an error occured */
+        if ((action == ACTION_NONE) && (params.render == 0)) udelay(1000000lu); /* an error occured */
         action = ACTION_EXIT;
         break;
       case ACTION_PREV:
@@ -2088,6 +2869,7 @@ int main(int argc, char **argv) {
         break;
     }
   } while (action != ACTION_EXIT);
+  cputime = clock() - cputime;
 
   /* unload XMS memory */
   mem_close();
@@ -2107,6 +2889,10 @@ hardwarefailure: /* this label I jump to when sound hardware init fails */
 
   free(params.sbnk);
   free(params.syxrst);
+  free(params.cachedir);
+#ifndef MSDOS
+  songcache_setbudget(0);
+#endif
   free(playlist_offsets);
 
   /* if a verbose log file was used, close it now */
@@ -2122,5 +2908,12 @@ hardwarefailure: /* this label I jump to when sound hardware init fails */
   puts("Copyright (C) 2014-2023 Mateusz Viste");
   puts("Copyright 2015-2024 Rivoreo");
 
+  if (params.render != 0) {
+    unsigned long wallms = renderwall / 1000, evps = 0;
+    if (wallms > 0) evps = (renderevents / wallms) * 1000 + (renderevents % wallms) * 1000 / wallms;
+    printf("\nRendered %lu events (%lu.%03lu s of music) in %lu.%03lu s: %lu events per second\n", renderevents, rendermusic / 1000, rendermusic % 1000, wallms / 1000, wallms % 1000, evps);
+    printf("CPU time: %lu ms\n", ((unsigned long)cputime * 1000lu) / CLOCKS_PER_SEC);
+  }
+
   return(0);
 }
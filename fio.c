@@ -12,6 +12,8 @@
 #ifdef MSDOS
 #include <dos.h>    /* REGS */
 #else
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -72,6 +74,7 @@ static void fio_seek_sync(struct fiofile *f) {
   return(((long)regs.x.dx << 16) | regs.x.ax); */
 #else
   lseek(f->fh, f->curpos, SEEK_SET);
+  f->flags &= ~FIO_FLAG_SEEKSYNC;
 #endif
 }
 
@@ -101,6 +104,15 @@ int fio_getline(struct fiofile *f, void far *buff, short int buflen) {
   short linelen = 0;
   buflen--; /* leave space for the zero terminator */
   for (;;) {
+#ifndef MSDOS
+    if (f->map != NULL) { /* mapped file: no need to go through fio_read() */
+      if (f->curpos >= f->flen) {
+        if (linelen == 0) linelen = -1;
+        break;
+      }
+      bytebuf = f->map[f->curpos++];
+    } else
+#endif
     if (fio_read(f, &bytebuf, 1) == 0) { /* EOF */
       if (linelen == 0) linelen = -1;
       break;
@@ -167,7 +179,9 @@ int fio_open(const char far *fname, int mode, struct fiofile *f) {
   if (regs.x.cflag != 0) return(-1);
 #else
   int flags;
-  switch(mode) {
+  struct stat st;
+  f->map = NULL;
+  switch(mode & ~FIO_OPEN_NOMMAP) {
     case FIO_OPEN_RD:
       flags = O_RDONLY;
       break;
@@ -183,6 +197,19 @@ int fio_open(const char far *fname, int mode, struct fiofile *f) {
   int fd = open(fname, flags);
   if(fd == -1) return -1;
   f->fh = fd;
+  /* read-only regular files are mapped as a whole, so reading from them is
+   * nothing more than a memcpy() - fall back to the read() cache otherwise */
+  if(flags == O_RDONLY && !(mode & FIO_OPEN_NOMMAP) && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= 0x7fffffffL) {
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(p != MAP_FAILED) {
+      f->map = p;
+      f->flen = st.st_size;
+      f->curpos = 0;
+      f->bufoffs = 0;
+      f->flags = 0;
+      return 0;
+    }
+  }
 #endif
   f->curpos = 0;
   loadcache(f);
@@ -226,7 +253,18 @@ int fio_read(struct fiofile *f, void far *buff, int count) {
   struct SREGS sregs;
 #endif
   if (f->curpos + count > f->flen) count = f->flen - f->curpos;
-  if (count == 0) return(0);
+  if (count <= 0) return(0);
+#ifndef MSDOS
+  if (f->map != NULL) {
+    if (count == 1) {
+      *(unsigned char *)buff = f->map[f->curpos++];
+    } else {
+      memcpy(buff, f->map + f->curpos, count);
+      f->curpos += count;
+    }
+    return(count);
+  }
+#endif
   if (count <= FIO_CACHE) {
     if ((f->curpos < f->bufoffs) || (f->curpos + count > f->bufoffs + FIO_CACHE)) {
       loadcache(f);
@@ -247,7 +285,120 @@ int fio_read(struct fiofile *f, void far *buff, int count) {
   f->curpos += regs.x.ax;
   return(regs.x.ax);
 #else
-  return sync_read(f->fh, buff, count);
+  count = sync_read(f->fh, buff, count);
+  if (count > 0) f->curpos += count;
+  return(count);
+#endif
+}
+
+#ifndef MSDOS
+/* returns a pointer to the len bytes found at the current position of the
+ * file if they are resident in memory (mapped file), NULL otherwise */
+const unsigned char *fio_getptr(struct fiofile *f, unsigned long int len) {
+  if ((f->map == NULL) || (f->curpos > f->flen) || (len > f->flen - f->curpos)) return(NULL);
+  return(f->map + f->curpos);
+}
+#endif
+
+/* creates (or truncates) file fname and opens it for writing. returns 0 on success, non-zero otherwise */
+int fio_create(const char far *fname, struct fiofile *f) {
+#ifdef MSDOS
+  /* DOS 2+ - CREAT - CREATE OR TRUNCATE FILE
+     AH = 3Ch
+     CX = file attributes
+     DS:DX -> ASCIZ filename
+     Return:
+     CF clear if successful
+     AX = file handle or error code
+     CF set on error */
+  union REGS regs;
+  struct SREGS sregs;
+  regs.h.ah = 0x3c;
+  regs.x.cx = 0;
+  sregs.ds = FP_SEG(fname);
+  regs.x.dx = FP_OFF(fname);
+  int86x(0x21, &regs, &regs, &sregs);
+  f->fh = regs.x.ax;
+  if (regs.x.cflag != 0) return(-1);
+#else
+  int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1) return(-1);
+  f->fh = fd;
+  f->map = NULL;
+#endif
+  f->flen = 0;
+  f->curpos = 0;
+  f->bufoffs = 0;
+  f->flags = 0;
+  return(0);
+}
+
+/* writes count bytes from buff to file pointed at by fhandle. files being written are never read from. returns the number of bytes actually written, or a negative number on error */
+int fio_write(struct fiofile *f, const void far *buff, int count) {
+#ifdef MSDOS
+/* DOS 2+ - WRITE - WRITE TO FILE OR DEVICE
+ * AH = 40h
+ * BX = file handle
+ * CX = number of bytes to write
+ * DS:DX -> data to write
+ * Return:
+ * CF clear if successful
+ * AX = number of bytes actually written
+ * CF set on error
+ * AX = error code (05h,06h) */
+  union REGS regs;
+  struct SREGS sregs;
+#else
+  const char *p = buff;
+#endif
+  fio_seek_sync(f);
+#ifdef MSDOS
+  regs.h.ah = 0x40;
+  regs.x.bx = f->fh;
+  regs.x.cx = count;
+  sregs.ds = FP_SEG(buff);
+  regs.x.dx = FP_OFF(buff);
+  int86x(0x21, &regs, &regs, &sregs);
+  if (regs.x.cflag != 0) return(0 - regs.x.ax);
+  count = regs.x.ax;
+#else
+  while (p < (const char *)buff + count) {
+    int s = write(f->fh, p, (const char *)buff + count - p);
+    if (s < 0) {
+      if (errno == EINTR) continue;
+      return(-1);
+    }
+    p += s;
+  }
+#endif
+  f->curpos += count;
+  if (f->curpos > f->flen) f->flen = f->curpos;
+  return(count);
+}
+
+/* returns the time of the last modification of the file, in a format that
+ * is only meant to be compared with another result of fio_mtime(), or 0 on
+ * error */
+unsigned long fio_mtime(struct fiofile *f) {
+#ifdef MSDOS
+  /* DOS 2+ - GET FILE'S LAST-WRITTEN DATE AND TIME
+     AX = 5700h
+     BX = file handle
+     Return:
+     CF clear if successful
+     CX = file's time
+     DX = file's date
+     CF set on error */
+  union REGS regs;
+  regs.x.ax = 0x5700u;
+  regs.x.bx = f->fh;
+  int86(0x21, &regs, &regs);
+  if (regs.x.cflag != 0) return(0);
+  return(((unsigned long)regs.x.dx << 16) | regs.x.cx);
+#else
+  struct stat st;
+  if (fstat(f->fh, &st) != 0) return(0);
+  return((unsigned long)st.st_mtime);
 #endif
 }
 
@@ -270,6 +421,10 @@ int fio_close(struct fiofile *f) {
   if (regs.x.cflag != 0) return(0 - regs.x.ax);
   return(0);
 #else
+  if (f->map != NULL) {
+    munmap((void *)f->map, f->flen);
+    f->map = NULL;
+  }
   return close(f->fh);
 #endif
 }
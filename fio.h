@@ -16,6 +16,9 @@
 #define FIO_OPEN_RD 0
 #define FIO_OPEN_WR 1
 #define FIO_OPEN_RW 2
+#ifndef MSDOS
+#define FIO_OPEN_NOMMAP 0x100 /* never map the file, always read it through the cache */
+#endif
 
 #define FIO_FLAG_SEEKSYNC 1
 
@@ -28,6 +31,9 @@ struct fiofile {
   unsigned char buff[FIO_CACHE]; /* buffer storage   */
   unsigned long int bufoffs;     /* offset of buffer */
   unsigned char flags;           /* flags */
+#ifndef MSDOS
+  const unsigned char *map;      /* whole file mapped in memory, or NULL */
+#endif
 };
 
 /* open file fname and set fhandle with the associated file handle. returns 0 on success, non-zero otherwise */
@@ -42,6 +48,22 @@ signed long int fio_seek(struct fiofile *f, unsigned short int origin, signed lo
 /* reads a line from file pointed at by fhandle, fill buff up to buflen bytes. returns the line length (possibly longer than buflen) */
 int fio_getline(struct fiofile *f, void far *buff, short int buflen);
 
+#ifndef MSDOS
+/* returns a pointer to the len bytes found at the current position of the
+ * file if they are resident in memory (mapped file), NULL otherwise. the
+ * file position is left unchanged. */
+const unsigned char *fio_getptr(struct fiofile *f, unsigned long int len);
+#endif
+
+/* creates (or truncates) file fname and opens it for writing. returns 0 on success, non-zero otherwise */
+int fio_create(const char far *fname, struct fiofile *f);
+
+/* writes count bytes from buff to file pointed at by fhandle. returns the number of bytes actually written, or a negative number on error */
+int fio_write(struct fiofile *f, const void far *buff, int count);
+
+/* returns the time of the last modification of the file (only meant to be compared with another fio_mtime() result), or 0 on error */
+unsigned long fio_mtime(struct fiofile *f);
+
 /* close file handle. returns 0 on success, non-zero otherwise */
 int fio_close(struct fiofile *f);
 
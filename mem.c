@@ -33,30 +33,91 @@
 #include "xms.h"
 #include <malloc.h>  /* _ffree(), _fmalloc() */
 #else
-#include <stdlib.h>
+#include <sys/mman.h> /* mmap(), mprotect() */
 #endif
 #include "midi.h"
 #include "mem.h" /* include self for control */
 #include <string.h>  /* memcpy() */
 
-#ifndef MSDOS
-#define _fmemcpy memcpy
-#define _fmalloc malloc
-#define _ffree free
-#endif
-
+#ifdef MSDOS
 #define LOWMEMBUFCOUNT 64    /* how many memory pools I can try using for 'noxms' allocations */
 #define LOWMEMBUFSIZE  8192  /* how big each memory pool is, in bytes */
 
 static unsigned char far *mempool[LOWMEMBUFCOUNT];
-#ifdef MSDOS
 static struct xms xms;
+#else
+/* on unix, memory is a single arena of address space that is reserved once
+ * and committed as it fills up. addresses are plain offsets within it, so
+ * a block can be allocated anywhere and blocks allocated one after another
+ * are always contiguous. committed pages are kept from one song to the
+ * next. */
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#define ARENAMAX  (1024ul << 20) /* address space to reserve, if available */
+#define ARENASTEP (64ul << 10)   /* granularity of commits */
+
+static unsigned char *arena = NULL;
+static unsigned long arenasize = 0;      /* reserved bytes */
+static unsigned long arenacommitted = 0; /* usable bytes, from the start */
+
+/* a second arena can be used to load a song while another one plays from
+ * the first. the selected arena lives in the variables above and below, the
+ * other one is parked here (see mem_arena()) */
+#define ARENAS 2
+struct memarena {
+  unsigned char *base;
+  unsigned long size;
+  unsigned long committed;
+  long nexteventid;
+  size_t allocated_size;
+  size_t allocated_peak;
+};
+static struct memarena arenas[ARENAS];
+static int curarena = 0;
 #endif
 static long nexteventid = 0;
 #ifdef MSDOS
 unsigned short int mem_mode = 0;
 #endif
 size_t mem_allocated_size = 0; /* total allocated memory counter (bytes) */
+size_t mem_allocated_peak = 0; /* highest value of mem_allocated_size so far */
+int mem_direct = 1; /* if zero, mem_ptr() always fails (for benchmarks) */
+
+
+#ifndef MSDOS
+/* makes the first len bytes of the arena usable, committing at least twice
+ * as much as before so growing it costs nothing in the long run. returns 0
+ * on success, non-zero if the arena cannot grow that much */
+static int arena_commit(unsigned long len) {
+  unsigned long newlen;
+  if (len <= arenacommitted) return(0);
+  if (len > arenasize) return(-1);
+  newlen = (len + ARENASTEP - 1) & ~(ARENASTEP - 1);
+  if (newlen < arenacommitted * 2) newlen = arenacommitted * 2;
+  if (newlen > arenasize) newlen = arenasize;
+  if (mprotect(arena + arenacommitted, newlen - arenacommitted, PROT_READ | PROT_WRITE) != 0) return(-1);
+  arenacommitted = newlen;
+  return(0);
+}
+
+
+/* reserves as much address space as possible for the arena, committing none
+ * of it yet. returns 0 on success, non-zero otherwise */
+static int arena_reserve(void) {
+  for (arenasize = ARENAMAX; (arena == NULL) && (arenasize >= ARENASTEP); arenasize >>= 1) {
+    arena = mmap(NULL, arenasize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena == MAP_FAILED) arena = NULL;
+    if (arena != NULL) break;
+  }
+  if (arena == NULL) return(-1);
+  arenacommitted = 0;
+  return(arena_commit(ARENASTEP));
+}
+#endif
 
 
 /* initializes the memory module using 'mode' method, returns the number of
@@ -64,36 +125,77 @@ size_t mem_allocated_size = 0; /* total allocated memory counter (bytes) */
 unsigned int mem_init(int mode) {
   nexteventid = 0;
   mem_allocated_size = 0;
+  mem_allocated_peak = 0;
 #ifdef MSDOS
   mem_mode = mode;
   if (mem_mode == MEM_XMS) {
     return(xms_init(&xms, 16384));
   } else {
-#endif
     /* try to allocate one mem pool so we have anything to start */
     mempool[0] = _fmalloc(LOWMEMBUFSIZE);
     if (mempool[0] == NULL) { /* if malloc() failed, then abort */
       return(0);
     }
     mem_allocated_size = LOWMEMBUFSIZE;
+    mem_allocated_peak = LOWMEMBUFSIZE;
     return(LOWMEMBUFSIZE >> 10);
-#ifdef MSDOS
   }
+#else
+  if (arena_reserve() != 0) return(0);
+  return(arenacommitted >> 10);
 #endif
 }
 
 
+#ifndef MSDOS
+/* selects the arena n (0 or 1) that all other mem_ functions work on, its
+ * address space being reserved the first time it is selected. the memory of
+ * the other arena is left untouched, and pointers into it stay valid.
+ * returns the arena that was selected before, or -1 if arena n cannot be
+ * used (the selection does not change then) */
+int mem_arena(int n) {
+  struct memarena *a;
+  int prev = curarena;
+  if ((n < 0) || (n >= ARENAS)) return(-1);
+  if (n == curarena) return(prev);
+  /* park the selected arena */
+  a = arenas + curarena;
+  a->base = arena;
+  a->size = arenasize;
+  a->committed = arenacommitted;
+  a->nexteventid = nexteventid;
+  a->allocated_size = mem_allocated_size;
+  a->allocated_peak = mem_allocated_peak;
+  /* and bring in the other one */
+  a = arenas + n;
+  arena = a->base;
+  arenasize = a->size;
+  arenacommitted = a->committed;
+  nexteventid = a->nexteventid;
+  mem_allocated_size = a->allocated_size;
+  mem_allocated_peak = a->allocated_peak;
+  curarena = n;
+  if ((arena == NULL) && (arena_reserve() != 0)) {
+    mem_arena(prev);
+    return(-1);
+  }
+  return(prev);
+}
+#endif
+
+
 /* pull an xms memory block into *ptr */
 int mem_pull(long addr, void far *ptr, int sz) {
 #ifdef MSDOS
   if (mem_mode == MEM_XMS) {
     return(xms_pull(&xms, addr, ptr, sz));
   } else {
-#endif
     _fmemcpy(ptr, mempool[addr >> 16] + (addr & 0xffffl), sz);
     return(0);
-#ifdef MSDOS
   }
+#else
+  memcpy(ptr, arena + addr, sz);
+  return(0);
 #endif
 }
 
@@ -104,22 +206,47 @@ int mem_push(void far *ptr, long addr, int sz) {
   if (mem_mode == MEM_XMS) {
     return(xms_push(&xms, ptr, sz, addr));
   } else {
-#endif
     _fmemcpy(mempool[addr >> 16] + (addr & 0xffffl), ptr, sz);
     return(0);
-#ifdef MSDOS
   }
+#else
+  memcpy(arena + addr, ptr, sz);
+  return(0);
 #endif
 }
 
 
+/* returns a pointer to the memory at addr, or NULL if it cannot be accessed
+ * directly (XMS). the pointer stays valid until the memory it points to is
+ * released by mem_rewind() or mem_clear() */
+void far *mem_ptr(long addr) {
+  if (mem_direct == 0) return(NULL);
+#ifdef MSDOS
+  if (mem_mode == MEM_XMS) return(NULL);
+  return(mempool[addr >> 16] + (addr & 0xffffl));
+#else
+  return(arena + addr);
+#endif
+}
+
+
+/* writes event at addr, in place if memory can be accessed directly */
+static void storeevent(const struct midi_event *event, long addr) {
+  struct midi_event far *p = mem_ptr(addr);
+  if (p != NULL) {
+    *p = *event;
+  } else {
+    mem_push((void far *)event, addr, sizeof(struct midi_event));
+  }
+}
+
+
 /* pushes an event to memory, and link events as they come. take care to call
  * this with event == NULL to close the song. returns 0 on success, non-zero
  * otherwise */
 int pusheventqueue(const struct midi_event *event, long int *root) {
   static struct midi_event lastevent;
   static long lasteventid;
-  struct midi_event far *lasteventfarptr;
 
   if (root != NULL) {
     lasteventid = mem_alloc(sizeof(struct midi_event));
@@ -129,17 +256,15 @@ int pusheventqueue(const struct midi_event *event, long int *root) {
     return(0);
   }
 
-  lasteventfarptr = &lastevent;
-
   if (event == NULL) {
     lastevent.next = -1;
-    mem_push(lasteventfarptr, lasteventid, sizeof(struct midi_event));
+    storeevent(&lastevent, lasteventid);
     return(0);
   }
 
   lastevent.next = mem_alloc(sizeof(struct midi_event));
   if (lastevent.next < 0) return(-1);
-  mem_push(lasteventfarptr, lasteventid, sizeof(struct midi_event));
+  storeevent(&lastevent, lasteventid);
   lasteventid = lastevent.next;
   memcpy(&lastevent, event, sizeof(struct midi_event));
   return(0);
@@ -155,9 +280,9 @@ long mem_alloc(int sz) {
     if ((nexteventid + sz) > xms.memsize) return(-1);
     nexteventid += sz;
     mem_allocated_size += sz;
+    if (mem_allocated_size > mem_allocated_peak) mem_allocated_peak = mem_allocated_size;
     return(res);
   } else {
-#endif
     long seg, offset;
     seg = nexteventid >> 16;
     offset = nexteventid & 0xffffl;
@@ -168,16 +293,119 @@ long mem_alloc(int sz) {
       seg += 1;
       offset = 0;
       if (seg >= LOWMEMBUFCOUNT) return(-1);
-      mempool[seg] = _fmalloc(LOWMEMBUFSIZE); /* try to alloc the extra mem pool */
-      if (mempool[seg] == NULL) return(-1); /* abort if alloc failed */
-      mem_allocated_size += LOWMEMBUFSIZE;
+      /* the pool may have been allocated already by mem_reserve() */
+      if (mempool[seg] == NULL) {
+        mempool[seg] = _fmalloc(LOWMEMBUFSIZE); /* try to alloc the extra mem pool */
+        if (mempool[seg] == NULL) return(-1); /* abort if alloc failed */
+        mem_allocated_size += LOWMEMBUFSIZE;
+        if (mem_allocated_size > mem_allocated_peak) mem_allocated_peak = mem_allocated_size;
+      }
     }
     res = (seg << 16) | offset;
     /* */
     nexteventid = (seg << 16) | (offset + sz);
     return(res);
+  }
+#else
+  res = nexteventid;
+  if ((nexteventid + sz > arenacommitted) && (arena_commit(nexteventid + sz) != 0)) return(-1);
+  nexteventid += sz;
+  mem_allocated_size = nexteventid;
+  if (mem_allocated_size > mem_allocated_peak) mem_allocated_peak = mem_allocated_size;
+  return(res);
+#endif
+}
+
+
+/* makes sure that the next allocations, totalling bytes bytes and none of
+ * them being bigger than maxblock, will succeed. all the memory they need
+ * (pools, or arena pages) is allocated at once, so mem_alloc() has nothing
+ * left to do but to hand out addresses. returns 0 on success, -1 if there is not enough memory
+ * (nothing is reserved then). mem_rewind() gives back what was not used. */
+int mem_reserve(unsigned long bytes, int maxblock) {
+#ifdef MSDOS
+  if (mem_mode == MEM_XMS) {
+    if (nexteventid + bytes > xms.memsize) return(-1);
+    return(0);
+  } else {
+    unsigned long room;
+    int seg, last;
+    if (maxblock > LOWMEMBUFSIZE) return(-1);
+    /* every pool may end with up to maxblock - 1 unused bytes */
+    seg = nexteventid >> 16;
+    room = LOWMEMBUFSIZE - (nexteventid & 0xffffl);
+    room = (room >= (unsigned long)maxblock) ? room - maxblock + 1 : 0;
+    for (last = seg; room < bytes; last++) {
+      if (last + 1 >= LOWMEMBUFCOUNT) return(-1);
+      room += LOWMEMBUFSIZE - maxblock + 1;
+    }
+    for (seg++; seg <= last; seg++) {
+      if (mempool[seg] != NULL) continue;
+      mempool[seg] = _fmalloc(LOWMEMBUFSIZE);
+      if (mempool[seg] == NULL) { /* give back the pools allocated so far */
+        mem_rewind(nexteventid);
+        return(-1);
+      }
+      mem_allocated_size += LOWMEMBUFSIZE;
+    }
+    if (mem_allocated_size > mem_allocated_peak) mem_allocated_peak = mem_allocated_size;
+    return(0);
+  }
+#else
+  return(arena_commit(nexteventid + bytes));
+#endif
+}
+
+
+/* returns the address that mem_alloc(sz) would return if the previous
+ * allocation ended at addr. this allows to walk (or to reproduce) a sequence
+ * of blocks that were allocated one after another */
+long mem_next(long addr, int sz) {
+#ifdef MSDOS
+  if (mem_mode == MEM_XMS) return(addr);
+  if ((addr & 0xffffl) + sz > LOWMEMBUFSIZE) addr = (addr | 0xffffl) + 1;
+#endif
+  return(addr);
+}
+
+
+/* returns how many consecutive blocks of sz bytes starting at addr (up to
+ * max) can be fetched with a single mem_pull() call */
+int mem_run(long addr, int sz, int max) {
+  long res;
 #ifdef MSDOS
+  if (mem_mode == MEM_XMS) {
+    res = (xms.memsize - addr) / sz;
+  } else {
+    res = (LOWMEMBUFSIZE - (addr & 0xffffl)) / sz;
   }
+#else
+  res = (arenacommitted - addr) / sz;
+#endif
+  if (res > max) return(max);
+  if (res < 1) return(1);
+  return((int)res);
+}
+
+
+/* releases everything that has been allocated since addr, addr being an
+ * address previously returned by mem_alloc() */
+void mem_rewind(long addr) {
+  nexteventid = addr;
+#ifdef MSDOS
+  if (mem_mode == MEM_XMS) {
+    mem_allocated_size = addr;
+  } else {
+    int i;
+    for (i = (addr >> 16) + 1; i < LOWMEMBUFCOUNT; i++) {
+      if (mempool[i] == NULL) break;
+      _ffree(mempool[i]);
+      mempool[i] = NULL;
+    }
+    mem_allocated_size = ((addr >> 16) + 1) * LOWMEMBUFSIZE;
+  }
+#else
+  mem_allocated_size = addr; /* pages stay committed, for the next song */
 #endif
 }
 
@@ -188,7 +416,6 @@ void mem_clear(void) {
   /* if using low mem, then leave only one buffer */
 #ifdef MSDOS
   if (mem_mode != MEM_XMS) {
-#endif
     int i;
     for (i = 1; i < LOWMEMBUFCOUNT; i++) {
       if (mempool[i] == NULL) break;
@@ -196,9 +423,10 @@ void mem_clear(void) {
       mempool[i] = NULL;
     }
     mem_allocated_size = LOWMEMBUFSIZE;
-#ifdef MSDOS
   }
 #endif
+  /* the unix arena is simply reused from its start, its pages still warm */
+  mem_allocated_peak = mem_allocated_size;
 }
 
 
@@ -209,14 +437,22 @@ void mem_close(void) {
   if (mem_mode == MEM_XMS) {
     xms_close(&xms);
   } else {
-#endif
     int i;
     for (i = 0; i < LOWMEMBUFCOUNT; i++) {
       if (mempool[i] == NULL) break; /* stop at first NULL mempool */
       _ffree(mempool[i]);
       mempool[i] = NULL;
     }
-#ifdef MSDOS
   }
+#else
+  int i;
+  if (arena != NULL) munmap(arena, arenasize);
+  arena = NULL;
+  arenacommitted = 0;
+  for (i = 0; i < ARENAS; i++) {
+    if ((i != curarena) && (arenas[i].base != NULL)) munmap(arenas[i].base, arenas[i].size);
+    arenas[i].base = NULL;
+  }
+  curarena = 0;
 #endif
 }
@@ -38,9 +38,17 @@ struct midi_event;
 unsigned int mem_init(int mode);
 int mem_pull(long addr, void far *ptr, int sz);
 int mem_push(void far *ptr, long addr, int sz);
+void far *mem_ptr(long addr);
 int pusheventqueue(const struct midi_event *event, long int *root);
 long mem_alloc(int sz);
+int mem_reserve(unsigned long bytes, int maxblock);
+long mem_next(long addr, int sz);
+int mem_run(long addr, int sz, int max);
+void mem_rewind(long addr);
 void mem_close(void);
 void mem_clear(void);
+#ifndef MSDOS
+int mem_arena(int n);
+#endif
 
 #endif
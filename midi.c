@@ -28,6 +28,7 @@
  */
 
 #include "defines.h"
+#include <limits.h>  /* ULONG_MAX */
 #include <stddef.h>  /* NULL */
 #include <stdint.h>
 #include <string.h>  /* memcpy() */
@@ -66,8 +67,9 @@ static int midi_fetch_variablelen_fromfile(struct fiofile *f, unsigned long int
 }
 
 
-/* reads a MIDI file and computes a map of chunks (ie a list of offsets) */
-static int midi_gettrackmap(struct fiofile *f, unsigned long int *tracklist, int maxchunks) {
+/* reads a MIDI file and computes a map of chunks (ie a list of offsets and
+ * byte lengths) */
+static int midi_gettrackmap(struct fiofile *f, unsigned long int *tracklist, unsigned long int *tracklens, int maxchunks) {
   int i;
   union {
     uint32_t ui32;
@@ -83,8 +85,9 @@ static int midi_gettrackmap(struct fiofile *f, unsigned long int *tracklist, int
     offset =
       ((long int)buffer.ba[0] << 24) | ((long int)buffer.ba[1] << 16) |
         ((long int)buffer.ba[2] << 8) | buffer.ba[3];
-    /* remember chunk data offset */
+    /* remember chunk data offset and length */
     tracklist[i] = fio_seek(f, FIO_SEEK_CUR, 0);
+    tracklens[i] = offset;
     /* skip to next chunk */
     fio_seek(f, FIO_SEEK_CUR, offset);
   }
@@ -95,7 +98,7 @@ static int midi_gettrackmap(struct fiofile *f, unsigned long int *tracklist, int
 /* PUBLIC INTERFACE */
 
 
-int midi_readhdr(struct fiofile *f, int *format, unsigned short int *timeunitdiv, unsigned long int *tracklist, int maxtracks) {
+int midi_readhdr(struct fiofile *f, int *format, unsigned short int *timeunitdiv, unsigned long int *tracklist, unsigned long int *tracklens, int maxtracks) {
   const uint32_t *uint32_p = (const uint32_t *)wbuff;
   unsigned short tracks;
   /*
@@ -147,7 +150,7 @@ int midi_readhdr(struct fiofile *f, int *format, unsigned short int *timeunitdiv
   if (*format > 2) return(-2);
 
   /* read the tracks map and return number of tracks */
-  return(midi_gettrackmap(f, tracklist, maxtracks));
+  return(midi_gettrackmap(f, tracklist, tracklens, maxtracks));
 }
 
 
@@ -307,6 +310,379 @@ static int ld_meta(struct midi_event *event, struct fiofile *f, unsigned long in
 }
 
 
+/* writer of packed event streams */
+struct packwriter {
+  long start;        /* first chunk of the stream */
+  long chunk;        /* chunk being filled in buf */
+  unsigned int off;  /* write position within buf */
+  unsigned char buf[MIDI_PACKCHUNK];
+};
+
+static int packtracks = 0;          /* non-zero if tracks are to be packed */
+static struct packwriter trackout;  /* packed stream of the track being loaded */
+
+
+void midi_packtracks(int packed) {
+  packtracks = packed;
+}
+
+
+/* starts a new packed stream, returns 0 on success */
+static int pack_open(struct packwriter *w) {
+  long pad;
+  /* streams start on a MIDI_PACKCHUNK boundary, so the chunk holding any
+   * position can be computed (mem_alloc(0) returns the next free address) */
+  pad = mem_alloc(0);
+  if (pad < 0) return(-1);
+  pad = (MIDI_PACKCHUNK - (pad & (MIDI_PACKCHUNK - 1))) & (MIDI_PACKCHUNK - 1);
+  if ((pad != 0) && (mem_alloc(pad) < 0)) return(-1);
+  w->start = mem_alloc(MIDI_PACKCHUNK);
+  if (w->start < 0) return(-1);
+  w->chunk = w->start;
+  w->off = 0;
+  return(0);
+}
+
+
+static int pack_putbyte(struct packwriter *w, unsigned char b) {
+  if (w->off == MIDI_PACKCHUNK) { /* chunk full, store it and start a new one */
+    long next;
+    mem_push(w->buf, w->chunk, MIDI_PACKCHUNK);
+    next = mem_alloc(MIDI_PACKCHUNK);
+    if (next < 0) return(-1);
+    /* chunks must follow each other - nothing else may be allocated while
+     * a stream is being written */
+    if (next != mem_next(w->chunk + MIDI_PACKCHUNK, MIDI_PACKCHUNK)) return(-1);
+    w->chunk = next;
+    w->off = 0;
+  }
+  w->buf[w->off++] = b;
+  return(0);
+}
+
+
+static int pack_putvlq(struct packwriter *w, unsigned long v) {
+  unsigned char b[5];
+  int i = 0;
+  b[i++] = v & 127;
+  while ((v >>= 7) != 0) b[i++] = (v & 127) | 128;
+  while (i-- > 0) {
+    if (pack_putbyte(w, b[i]) != 0) return(-1);
+  }
+  return(0);
+}
+
+
+/* appends event to a packed stream. the string of sysex events is taken
+ * from sysex, which holds it prefixed with its 16-bit length */
+static int pack_event(struct packwriter *w, const struct midi_event *event, const unsigned char *sysex) {
+  unsigned char b[3];
+  const unsigned char *payload = b;
+  unsigned int i, len;
+  unsigned char tag = event->type << 4;
+  switch (event->type) {
+    case EVENT_NOTEOFF: /* velocity of note off events is never used */
+      tag |= event->data.note.chan;
+      b[0] = event->data.note.note;
+      len = 1;
+      break;
+    case EVENT_NOTEON:
+      tag |= event->data.note.chan;
+      b[0] = event->data.note.note;
+      b[1] = event->data.note.velocity;
+      len = 2;
+      break;
+    case EVENT_KEYPRESSURE:
+      tag |= event->data.keypressure.chan;
+      b[0] = event->data.keypressure.note;
+      b[1] = event->data.keypressure.pressure;
+      len = 2;
+      break;
+    case EVENT_CONTROL:
+      tag |= event->data.control.chan;
+      b[0] = event->data.control.id;
+      b[1] = event->data.control.val;
+      len = 2;
+      break;
+    case EVENT_PITCH:
+      tag |= event->data.pitch.chan;
+      b[0] = event->data.pitch.wheel & 0xff;
+      b[1] = event->data.pitch.wheel >> 8;
+      len = 2;
+      break;
+    case EVENT_PROGCHAN:
+      tag |= event->data.prog.chan;
+      b[0] = event->data.prog.prog;
+      len = 1;
+      break;
+    case EVENT_CHANPRESSURE:
+      tag |= event->data.chanpressure.chan;
+      b[0] = event->data.chanpressure.pressure;
+      len = 1;
+      break;
+    case EVENT_TEMPO:
+      b[0] = event->data.tempoval >> 16;
+      b[1] = event->data.tempoval >> 8;
+      b[2] = event->data.tempoval;
+      len = 3;
+      break;
+    case EVENT_SYSEX:
+      payload = sysex + 2;
+      len = ((uint16_t *)sysex)[0];
+      break;
+    default: /* no other event is ever stored */
+      return(0);
+  }
+  if (pack_putbyte(w, tag) != 0) return(-1);
+  if (pack_putvlq(w, event->deltatime) != 0) return(-1);
+  if ((event->type == EVENT_SYSEX) && (pack_putvlq(w, len) != 0)) return(-1);
+  for (i = 0; i < len; i++) {
+    if (pack_putbyte(w, payload[i]) != 0) return(-1);
+  }
+  return(0);
+}
+
+
+/* writes the chunk being filled to memory, so all events written so far
+ * can be read */
+static void pack_flush(struct packwriter *w) {
+  mem_push(w->buf, w->chunk, MIDI_PACKCHUNK);
+}
+
+
+/* terminates a packed stream and flushes it to memory */
+static int pack_close(struct packwriter *w) {
+  if (pack_putbyte(w, MIDI_PACK_END) != 0) return(-1);
+  pack_flush(w);
+  return(0);
+}
+
+
+/* returns the position of the next byte to be read by r */
+static long pack_tell(const struct midi_packreader *r) {
+  if (r->off < MIDI_PACKCHUNK) return(r->chunk + r->off);
+  return(mem_next(r->chunk + MIDI_PACKCHUNK, MIDI_PACKCHUNK));
+}
+
+
+static int pack_seek(struct midi_packreader *r, long pos) {
+  long chunk = pos & ~(long)(MIDI_PACKCHUNK - 1);
+  if (chunk != r->chunk) {
+    r->chunk = -1;
+    if (mem_pull(chunk, r->buf, MIDI_PACKCHUNK) != 0) return(-1);
+    r->chunk = chunk;
+  }
+  r->off = pos & (MIDI_PACKCHUNK - 1);
+  return(0);
+}
+
+
+/* returns the next byte of the stream, or -1 on error */
+static int pack_getbyte(struct midi_packreader *r) {
+  if (r->off == MIDI_PACKCHUNK) {
+    long next = mem_next(r->chunk + MIDI_PACKCHUNK, MIDI_PACKCHUNK);
+    r->chunk = -1;
+    if (mem_pull(next, r->buf, MIDI_PACKCHUNK) != 0) return(-1);
+    r->chunk = next;
+    r->off = 0;
+  }
+  return(r->buf[r->off++]);
+}
+
+
+static int pack_getvlq(struct midi_packreader *r, unsigned long *result) {
+  int i, b;
+  *result = 0;
+  for (i = 0; i < 5; i++) {
+    b = pack_getbyte(r);
+    if (b < 0) return(-1);
+    *result <<= 7;
+    *result |= (b & 127);
+    if ((b & 128) == 0) return(0);
+  }
+  return(-1);
+}
+
+
+int midi_packpull(struct midi_packreader *r, long pos, struct midi_event *event) {
+  unsigned char b[3];
+  unsigned long len;
+  int tag, i, n;
+  /* reposition the reader, unless the event is right where it stands */
+  if ((r->chunk < 0) || (pos != pack_tell(r))) {
+    if (pack_seek(r, pos) != 0) return(-1);
+  }
+  tag = pack_getbyte(r);
+  if ((tag < 0) || (tag == MIDI_PACK_END)) return(-1);
+  if (pack_getvlq(r, &(event->deltatime)) != 0) return(-1);
+  event->type = (enum midi_midievent)(tag >> 4);
+  switch (event->type) {
+    case EVENT_NOTEOFF:
+    case EVENT_PROGCHAN:
+    case EVENT_CHANPRESSURE:
+      n = 1;
+      break;
+    case EVENT_TEMPO:
+      n = 3;
+      break;
+    case EVENT_SYSEX:
+      n = 0;
+      break;
+    default:
+      n = 2;
+      break;
+  }
+  for (i = 0; i < n; i++) {
+    int c = pack_getbyte(r);
+    if (c < 0) return(-1);
+    b[i] = c;
+  }
+  tag &= 0x0F;
+  switch (event->type) {
+    case EVENT_NOTEOFF:
+      event->data.note.chan = tag;
+      event->data.note.note = b[0];
+      event->data.note.velocity = 0;
+      break;
+    case EVENT_NOTEON:
+      event->data.note.chan = tag;
+      event->data.note.note = b[0];
+      event->data.note.velocity = b[1];
+      break;
+    case EVENT_KEYPRESSURE:
+      event->data.keypressure.chan = tag;
+      event->data.keypressure.note = b[0];
+      event->data.keypressure.pressure = b[1];
+      break;
+    case EVENT_CONTROL:
+      event->data.control.chan = tag;
+      event->data.control.id = b[0];
+      event->data.control.val = b[1];
+      break;
+    case EVENT_PITCH:
+      event->data.pitch.chan = tag;
+      event->data.pitch.wheel = b[1];
+      event->data.pitch.wheel <<= 8;
+      event->data.pitch.wheel |= b[0];
+      break;
+    case EVENT_PROGCHAN:
+      event->data.prog.chan = tag;
+      event->data.prog.prog = b[0];
+      break;
+    case EVENT_CHANPRESSURE:
+      event->data.chanpressure.chan = tag;
+      event->data.chanpressure.pressure = b[0];
+      break;
+    case EVENT_TEMPO:
+      event->data.tempoval = ((unsigned long)b[0] << 16) | ((unsigned long)b[1] << 8) | b[2];
+      break;
+    case EVENT_SYSEX: /* remember where the string is, and skip it */
+      event->data.sysex.sysexptr = pack_tell(r);
+      if (pack_getvlq(r, &len) != 0) return(-1);
+      while (len-- > 0) {
+        if (pack_getbyte(r) < 0) return(-1);
+      }
+      break;
+    default:
+      return(-1);
+  }
+  /* peek at the next tag to know whether this event is the last one */
+  event->next = pack_tell(r);
+  tag = pack_getbyte(r);
+  if (tag < 0) return(-1);
+  r->off--;
+  if (tag == MIDI_PACK_END) event->next = -1;
+  return(0);
+}
+
+
+unsigned int midi_packsysex(long sysexptr, unsigned char *buff) {
+  struct midi_packreader r;
+  unsigned long len;
+  unsigned int i;
+  int c;
+  r.chunk = -1;
+  if (pack_seek(&r, sysexptr) != 0) return(0);
+  if ((pack_getvlq(&r, &len) != 0) || (len > 4096)) return(0);
+  for (i = 0; i < len; i++) {
+    c = pack_getbyte(&r);
+    if (c < 0) return(0);
+    buff[i + 2] = c;
+  }
+  ((uint16_t *)buff)[0] = len;
+  return(len);
+}
+
+
+/* packed streams are saved and loaded by blocks of that many bytes, going
+ * through wbuff */
+#define PACKIOBLOCK (MIDI_PACKCHUNK * 128)
+
+long midi_packsave(long start, struct fiofile *f) {
+  long end = mem_next(mem_alloc(0), MIDI_PACKCHUNK);
+  long res = 0;
+  unsigned int n;
+  while (start != end) {
+    for (n = 0; (n < PACKIOBLOCK) && (start != end); n += MIDI_PACKCHUNK) {
+      if (mem_pull(start, wbuff + n, MIDI_PACKCHUNK) != 0) return(-1);
+      start = mem_next(start + MIDI_PACKCHUNK, MIDI_PACKCHUNK);
+    }
+    if (fio_write(f, wbuff, n) != (int)n) return(-1);
+    res += n;
+  }
+  return(res);
+}
+
+
+long midi_packload(struct fiofile *f, unsigned long len) {
+  struct packwriter w;
+  unsigned long done = 0;
+  unsigned int i, n;
+  long next;
+  if ((len == 0) || ((len & (MIDI_PACKCHUNK - 1)) != 0)) return(MIDI_TRACKERROR);
+  if (pack_open(&w) != 0) return(MIDI_OUTOFMEM);
+  while (done < len) {
+    n = PACKIOBLOCK;
+    if (len - done < n) n = len - done;
+    if (fio_read(f, wbuff, n) != (int)n) {
+      mem_rewind(w.start);
+      return(MIDI_TRACKERROR);
+    }
+    for (i = 0; i < n; i += MIDI_PACKCHUNK) {
+      /* chunks must follow each other, just like when a stream is written */
+      if (done != 0) {
+        next = mem_alloc(MIDI_PACKCHUNK);
+        if (next != mem_next(w.chunk + MIDI_PACKCHUNK, MIDI_PACKCHUNK)) {
+          mem_rewind(w.start);
+          return(MIDI_OUTOFMEM);
+        }
+        w.chunk = next;
+      }
+      mem_push(wbuff + i, w.chunk, MIDI_PACKCHUNK);
+      done += MIDI_PACKCHUNK;
+    }
+  }
+  return(w.start);
+}
+
+
+/* stores the sysex string that has been prepared in wbuff (prefixed with its
+ * 16-bit length, sysexleneven bytes in total) for event. when tracks are
+ * packed, the string is left in wbuff for queue_event() to pick it up.
+ * returns 0 on success */
+static int store_sysex(struct midi_event *event, unsigned int sysexleneven) {
+  event->type = EVENT_SYSEX;
+  if (packtracks != 0) {
+    event->data.sysex.sysexptr = -1;
+    return(0);
+  }
+  event->data.sysex.sysexptr = mem_alloc(sysexleneven);
+  if (event->data.sysex.sysexptr < 0) return(MIDI_OUTOFMEM);
+  mem_push(wbuff, event->data.sysex.sysexptr, sysexleneven);
+  return(0);
+}
+
+
 /* returns a negative value on error, 0 on success, 1 on end of track */
 #ifdef DBGFILE
 static int ld_sysex(struct midi_event *event, struct fiofile *f, FILE *logf, unsigned char statusbyte, unsigned long int *tracklen) {
@@ -322,22 +698,18 @@ static int ld_sysex(struct midi_event *event, struct fiofile *f, unsigned char s
   if (logf) fprintf(logf, "%lu: SYSEX EVENT OF %ld BYTES ON CHAN #%d\n", *tracklen, sysexlen, statusbyte & 0x0F);
 #endif
   if (sysexlen > 4096) { /* skip SYSEX events that are more than 4K big */
-    fio_seek(f, FIO_SEEK_CUR, sysexlen);
+    fio_seek(f, FIO_SEEK_CUR, sysexlen - 1);
     return(0);
   }
   /* read the sysex string */
   sysexleneven = sysexlen + 2; /* add two bytes for the sysex length that I will add in front of the actual sysex string */
   if ((sysexleneven & 1) != 0) sysexleneven++; /* make sysexleneven an even number (XMS moves MUST occur on even numbers of bytes) */
   sysexbuff = wbuff;
-  event->type = EVENT_SYSEX;
 
   ((uint16_t *)sysexbuff)[0] = sysexlen;
   sysexbuff[2] = statusbyte; /* I store the entire sysex string in memory */
   fio_read(f, sysexbuff + 3, sysexlen - 1); /* read sysexlen-1 because I have already read the status byte */
-  event->data.sysex.sysexptr = mem_alloc(sysexleneven);
-  if (event->data.sysex.sysexptr >= 0) {
-    mem_push(sysexbuff, event->data.sysex.sysexptr, sysexleneven);
-  } else {
+  if (store_sysex(event, sysexleneven) != 0) {
     event->type = EVENT_NONE;
 #ifdef DBGFILE
     if (logf) fprintf(logf, "%lu: SYSEX MEM_ALLOC FAILED FOR %ld BYTES\n", *tracklen, sysexlen);
@@ -348,22 +720,18 @@ static int ld_sysex(struct midi_event *event, struct fiofile *f, unsigned char s
 }
 
 
-#ifdef DBGFILE
-static int ld_note(struct midi_event *event, struct fiofile *f, FILE *logf, unsigned char statusbyte, unsigned long int *tracklen, unsigned short int *channelsusage, void *reqpatches) {
-#else
-static int ld_note(struct midi_event *event, struct fiofile *f, unsigned char statusbyte, unsigned long int *tracklen, unsigned short int *channelsusage, void *reqpatches) {
-#endif
-  unsigned char ubuff[2]; /* micro buffer for loading data */
-  switch (statusbyte & 0xF0) { /* I care only about NoteOn/NoteOff events */
+/* decodes a channel message (status 0x80..0xEF) from its data bytes. the
+ * amount of data bytes is 1 for program changes and channel pressure, 2
+ * otherwise */
+static void decode_chanmsg(struct midi_event *event, unsigned char statusbyte, const unsigned char *ubuff, unsigned short int *channelsusage, void *reqpatches) {
+  switch (statusbyte & 0xF0) {
     case 0x80:  /* Note OFF */
-      fio_read(f, ubuff, 2);
       event->type = EVENT_NOTEOFF;
       event->data.note.chan = statusbyte & 0x0F;
       event->data.note.note = ubuff[0] & 127; /* a note must be in range 0..127 */
       event->data.note.velocity = ubuff[1];
       break;
     case 0x90:  /* Note ON */
-      fio_read(f, ubuff, 2);
       event->type = EVENT_NOTEON;
       event->data.note.chan = statusbyte & 0x0F;
       event->data.note.note = ubuff[0] & 127;
@@ -377,46 +745,140 @@ static int ld_note(struct midi_event *event, struct fiofile *f, unsigned char st
       if (event->data.note.chan == 9) BIT_SET(reqpatches, event->data.note.note | 128);
       break;
     case 0xA0:  /* key after-touch */
-      fio_read(f, ubuff, 2);
       event->type = EVENT_KEYPRESSURE;
       event->data.keypressure.chan = statusbyte & 0x0F;
       event->data.keypressure.note = ubuff[0];
       event->data.keypressure.pressure = ubuff[1];
       break;
     case 0xB0:  /* control change */
-      fio_read(f, ubuff, 2);
       event->type = EVENT_CONTROL;
       event->data.control.chan = statusbyte & 0x0F;
       event->data.control.id = ubuff[0];
       event->data.control.val = ubuff[1];
       break;
     case 0xC0:  /* program (patch) change */
-      fio_read(f, ubuff, 1);
       event->type = EVENT_PROGCHAN;
       event->data.prog.chan = statusbyte & 0x0F;
       event->data.prog.prog = ubuff[0] & 127;
       BIT_SET(reqpatches, event->data.prog.prog);
       break;
     case 0xD0:  /* channel after-touch (aka "channel pressure") */
-      fio_read(f, ubuff, 1);
       event->type = EVENT_CHANPRESSURE;
       event->data.chanpressure.chan = statusbyte & 0x0F;
       event->data.chanpressure.pressure = ubuff[0];
       break;
     case 0xE0:  /* pitch wheel change */
-      fio_read(f, ubuff, 2);
       event->type = EVENT_PITCH;
       event->data.pitch.chan = statusbyte & 0x0F;
       event->data.pitch.wheel = ubuff[1];
       event->data.pitch.wheel <<= 7;
       event->data.pitch.wheel |= ubuff[0];
       break;
-    default:
+  }
+}
+
+
+static void ld_note(struct midi_event *event, struct fiofile *f, unsigned char statusbyte, unsigned short int *channelsusage, void *reqpatches) {
+  unsigned char ubuff[2]; /* micro buffer for loading data */
+  /* program changes and channel pressure have a single data byte */
+  fio_read(f, ubuff, ((statusbyte & 0xE0) == 0xC0) ? 1 : 2);
+  decode_chanmsg(event, statusbyte, ubuff, channelsusage, reqpatches);
+}
+
+
+/* pushes a decoded event to the track's queue, ignored events (EVENT_NONE)
+ * have their deltatime carried over to the next one. returns 0 on success,
+ * non-zero if out of memory */
+static int queue_event(struct midi_event *event, long *result, unsigned long *ignoreddeltas) {
+  if (event->type == EVENT_NONE) {
+    *ignoreddeltas += event->deltatime;
+    return(0);
+  }
+  event->deltatime += *ignoreddeltas; /* add any previously ignored delta times */
+  *ignoreddeltas = 0;
+  if (packtracks != 0) {
+    if (*result == MIDI_EMPTYTRACK) { /* first event, start a new stream */
+      if (pack_open(&trackout) != 0) return(-1);
+      *result = trackout.start;
+    }
+    return(pack_event(&trackout, event, wbuff));
+  }
+  if (*result == MIDI_EMPTYTRACK) { /* this is the first event in the queue */
+    return(pusheventqueue(event, result));
+  }
+  return(pusheventqueue(event, NULL));
+}
+
+
+/* terminates the track's queue once its last event has been queued. returns
+ * 0 on success, non-zero if out of memory */
+static int close_queue(void) {
+  if (packtracks != 0) return(pack_close(&trackout));
+  return(pusheventqueue(NULL, NULL)); /* flush last event in buffer to memory */
+}
+
+
+/* strings to be filled with the meta events of a track being parsed (any of
+ * them can be NULL) */
+struct trackstrings {
+  char *title;
+  int titlemaxlen;
+  char *copyright;
+  int copyrightmaxlen;
+  char *text;
+  int textmaxlen;
+};
+
+
+/* parses the next event of a track read through f into event (its type is
+ * EVENT_NONE if the event is not to be kept). statusbyte holds the running
+ * status of the track. returns 0 on success, 1 at the end of the track,
+ * MIDI_TRACKERROR or MIDI_OUTOFMEM on error */
 #ifdef DBGFILE
-      if (logf) fprintf(logf, "%lu: Unknown note data\n", *tracklen);
+static int fio_nextevent(struct fiofile *f, unsigned char *statusbyte, struct midi_event *event, const struct trackstrings *s, unsigned short int *channelsusage, FILE *logf, unsigned long int *tracklen, void *reqpatches) {
+#else
+static int fio_nextevent(struct fiofile *f, unsigned char *statusbyte, struct midi_event *event, const struct trackstrings *s, unsigned short int *channelsusage, unsigned long int *tracklen, void *reqpatches) {
 #endif
-      return(-1);
-      break;
+  unsigned long deltatime;
+  unsigned char bytebuff;
+  int r;
+  /* read the delta time first - variable length */
+  midi_fetch_variablelen_fromfile(f, &deltatime);
+  *tracklen += deltatime;
+  /* check the type of the event */
+  /* if it's a byte with MSB set, we are dealing with running status (so it's same status as last time */
+  if (fio_read(f, &bytebuff, 1) == 0) return(MIDI_TRACKERROR);
+  if ((bytebuff & 128) != 0) {
+    *statusbyte = bytebuff;
+  } else { /* get back one byte */
+    fio_seek(f, FIO_SEEK_CUR, -1);
+  }
+  event->type = EVENT_NONE;
+  event->deltatime = deltatime;
+  event->next = -1;
+  if (*statusbyte == 0xFF) { /* META event */
+#ifdef DBGFILE
+    r = ld_meta(event, f, logf, tracklen, s->title, s->titlemaxlen, s->copyright, s->copyrightmaxlen, s->text, s->textmaxlen);
+#else
+    r = ld_meta(event, f, tracklen, s->title, s->titlemaxlen, s->copyright, s->copyrightmaxlen, s->text, s->textmaxlen);
+#endif
+    if (r < 0) return(MIDI_TRACKERROR);
+    return(r); /* 1 on end of track */
+  } else if ((*statusbyte >= 0xF0) && (*statusbyte <= 0xF7)) { /* SYSEX event */
+#ifdef DBGFILE
+    r = ld_sysex(event, f, logf, *statusbyte, tracklen);
+#else
+    r = ld_sysex(event, f, *statusbyte, tracklen);
+#endif
+    if (r == MIDI_OUTOFMEM) return(MIDI_OUTOFMEM);
+    if (r != 0) return(MIDI_TRACKERROR);
+  } else if ((*statusbyte >= 0x80) && (*statusbyte <= 0xEF)) { /* else it's a note-related command */
+    ld_note(event, f, *statusbyte, channelsusage, reqpatches);
+  } else { /* else it's an error */
+#ifdef DBGFILE
+    if (logf) fprintf(logf, "Err. at offset %04lX (bytebuff = 0x%02X)\n", fio_seek(f, FIO_SEEK_CUR, 0), *statusbyte);
+#endif
+    return(MIDI_TRACKERROR);
   }
   return(0);
 }
@@ -434,87 +896,364 @@ long int midi_track2events(struct fiofile *f, char *title, int titlemaxlen, char
 #else
 long int midi_track2events(struct fiofile *f, char *title, int titlemaxlen, char *copyright, int copyrightmaxlen, char *text, int textmaxlen, unsigned short int *channelsusage, unsigned long int *tracklen, void *reqpatches) {
 #endif
-  unsigned long deltatime;
   unsigned char statusbyte = 0;
   struct midi_event event;
+  struct trackstrings s;
   long result = MIDI_EMPTYTRACK;
   unsigned long ignoreddeltas = 0;
+  int r;
 
   /* zero out title and copyright strings, if provided */
   if (titlemaxlen > 0) title[0] = 0;
   if (copyrightmaxlen > 0) copyright[0] = 0;
   if (textmaxlen > 0) text[0] = 0;
+  s.title = title;
+  s.titlemaxlen = titlemaxlen;
+  s.copyright = copyright;
+  s.copyrightmaxlen = copyrightmaxlen;
+  s.text = text;
+  s.textmaxlen = textmaxlen;
 
   *tracklen = 0;
 
   for (;;) {
-    int r;
-    unsigned char bytebuff;
-    /* read the delta time first - variable length */
-    midi_fetch_variablelen_fromfile(f, &deltatime);
-    *tracklen += deltatime;
-    /* check the type of the event */
-    /* if it's a byte with MSB set, we are dealing with running status (so it's same status as last time */
+#ifdef DBGFILE
+    r = fio_nextevent(f, &statusbyte, &event, &s, channelsusage, logf, tracklen, reqpatches);
+#else
+    r = fio_nextevent(f, &statusbyte, &event, &s, channelsusage, tracklen, reqpatches);
+#endif
+    if (r == 1) break; /* end of track */
+    if (r != 0) return(r);
+    /* add the event to the queue */
+    if (queue_event(&event, &result, &ignoreddeltas) != 0) return(MIDI_OUTOFMEM);
+  }
+  if (result >= 0) {
+    if (close_queue() != 0) return(MIDI_OUTOFMEM);
+  }
+  return(result);
+}
+
+
+/* returns how many bytes v takes once stored as a variable length quantity */
+static unsigned int vlqlen(unsigned long v) {
+  unsigned int n = 1;
+  while ((v >>= 7) != 0) n++;
+  return(n);
+}
+
+
+/* goes through the track found at the current position of f (tracklen bytes
+ * long) and adds to sz what it will take in memory once loaded. payloads are
+ * skipped, only status bytes and lengths are looked at. returns 0 on
+ * success, MIDI_TRACKERROR if the track is corrupted */
+int midi_tracksize(struct fiofile *f, unsigned long tracklen, struct midi_songsize *sz) {
+  unsigned long end, delta, len, carried = 0, packed = 0;
+  unsigned int payload;
+  unsigned char statusbyte = 0, bytebuff;
+
+  end = fio_seek(f, FIO_SEEK_CUR, 0) + tracklen;
+  while ((unsigned long)fio_seek(f, FIO_SEEK_CUR, 0) < end) {
+    midi_fetch_variablelen_fromfile(f, &delta);
+    carried += delta; /* deltas of ignored events are carried over */
     if (fio_read(f, &bytebuff, 1) == 0) return(MIDI_TRACKERROR);
     if ((bytebuff & 128) != 0) {
       statusbyte = bytebuff;
-    } else { /* get back one byte */
+    } else { /* running status */
       fio_seek(f, FIO_SEEK_CUR, -1);
     }
-    event.type = EVENT_NONE;
-    event.deltatime = deltatime;
-    event.next = -1;
-    if (statusbyte == 0xFF) { /* META event */
+    if (statusbyte == 0xFF) { /* META event, only tempo changes are kept */
+      if (fio_read(f, &bytebuff, 1) == 0) return(MIDI_TRACKERROR);
+      midi_fetch_variablelen_fromfile(f, &len);
+      if (bytebuff == 0x2F) break; /* end of track */
+      fio_seek(f, FIO_SEEK_CUR, len);
+      if (bytebuff != 0x51) continue;
+      payload = 3;
+    } else if ((statusbyte >= 0xF0) && (statusbyte <= 0xF7)) { /* SYSEX */
+      midi_fetch_variablelen_fromfile(f, &len);
+      fio_seek(f, FIO_SEEK_CUR, len);
+      len += 1; /* the status byte is stored too, see ld_sysex() */
+      if (len > 4096) continue;
+      payload = vlqlen(len) + len;
+      len += 2; /* prefixed with its length, padded to an even size */
+      if ((len & 1) != 0) len++;
+      sz->sysexbytes += len;
+      if (len > sz->maxsysex) sz->maxsysex = len;
+    } else if ((statusbyte >= 0x80) && (statusbyte <= 0xEF)) {
+      len = ((statusbyte & 0xE0) == 0xC0) ? 1 : 2;
+      fio_seek(f, FIO_SEEK_CUR, len);
+      /* the velocity of note off events is not stored */
+      payload = ((statusbyte & 0xF0) == 0x80) ? 1 : len;
+    } else {
+      return(MIDI_TRACKERROR);
+    }
+    sz->events++;
+    packed += 1 + vlqlen(carried) + payload;
+    carried = 0;
+  }
+  /* packed streams are closed by an end tag, and start on a chunk boundary
+   * (up to MIDI_PACKCHUNK - 1 bytes of padding) */
+  if (packed != 0) {
+    packed = (packed + MIDI_PACKCHUNK) / MIDI_PACKCHUNK + 1;
+    sz->packedbytes += packed * MIDI_PACKCHUNK;
+  }
+  return(0);
+}
+
+
+/* reserves the memory needed to load a song of sz, and to merge its tracks
+ * with midi_mergetracks() using flags. packed songs are estimated to take a
+ * byte more per event than their tracks, as deltas in microseconds take
+ * more room than in MIDI ticks. returns the amount of bytes reserved, or
+ * MIDI_OUTOFMEM if the song cannot fit in memory */
+long midi_reserve(const struct midi_songsize *sz, int flags) {
+  unsigned long bytes, listbytes;
+  int maxblock = sizeof(struct midi_event);
+
+  if (sz->maxsysex > (unsigned int)maxblock) maxblock = sz->maxsysex;
+  listbytes = sz->events * sizeof(struct midi_event) + sz->sysexbytes;
+  if (flags & MIDI_MERGE_PACKED) {
+    bytes = sz->packedbytes;
+  } else {
+    bytes = listbytes;
+  }
+  /* arrays and packed songs are written after their tracks */
+  if (flags & MIDI_MERGE_ARRAY) {
+    bytes += listbytes;
+  } else if (flags & MIDI_MERGE_PACKED) {
+    bytes += sz->packedbytes + sz->events;
+    maxblock = MIDI_PACKCHUNK;
+  }
+  if (mem_reserve(bytes, maxblock) != 0) return(MIDI_OUTOFMEM);
+  return(bytes);
+}
+
+
+#ifndef MSDOS
+/* fetch a variable length quantity value from a buffer. returns the number
+ * of bytes read, or 0 if the buffer ends before the value does */
+static unsigned int midi_fetch_variablelen_frombuf(const unsigned char *buf, unsigned long int buflen, unsigned long int *result) {
+  unsigned int i = 0;
+  *result = 0;
+  while (i < buflen) {
+    *result <<= 7;
+    *result |= (buf[i] & 127);
+    if ((buf[i++] & 128) == 0) return(i);
+  }
+  return(0);
+}
+
+
+/* copies a meta string into dst, up to maxlen bytes (incl. the NULL
+ * terminator). returns the amount of characters copied */
+static unsigned long copymetastr(char *dst, int maxlen, const unsigned char *src, unsigned long int len) {
+  unsigned long i;
+  for (i = 0; (i < len) && (i + 1 < (unsigned long)maxlen); i++) dst[i] = src[i];
+  dst[i] = 0;
+  return(i);
+}
+
+
+/* same as fio_nextevent(), but for a track that is resident in memory: the
+ * event is parsed at *pos in buf (buflen bytes long), every read being
+ * checked against buflen, and *pos is moved past it. A track that ends
+ * without an 'end of track' meta event is considered complete. */
 #ifdef DBGFILE
-      r = ld_meta(&event, f, logf, tracklen, title, titlemaxlen, copyright, copyrightmaxlen, text, textmaxlen);
+static int buf_nextevent(const unsigned char *buf, unsigned long int buflen, unsigned long int *pos, unsigned char *statusbyte, struct midi_event *event, const struct trackstrings *s, unsigned short int *channelsusage, FILE *logf, unsigned long int *tracklen, void *reqpatches) {
 #else
-      r = ld_meta(&event, f, tracklen, title, titlemaxlen, copyright, copyrightmaxlen, text, textmaxlen);
+static int buf_nextevent(const unsigned char *buf, unsigned long int buflen, unsigned long int *pos, unsigned char *statusbyte, struct midi_event *event, const struct trackstrings *s, unsigned short int *channelsusage, unsigned long int *tracklen, void *reqpatches) {
 #endif
-      if (r < 0) return(MIDI_TRACKERROR);
-      if (r == 1) break; /* end of track */
-    } else if ((statusbyte >= 0xF0) && (statusbyte <= 0xF7)) { /* SYSEX event */
+  unsigned long p = *pos, deltatime, len;
+  unsigned int n;
+
+  if (p >= buflen) return(1);
+  /* read the delta time first - variable length */
+  n = midi_fetch_variablelen_frombuf(buf + p, buflen - p, &deltatime);
+  if (n == 0) return(MIDI_TRACKERROR);
+  p += n;
+  *tracklen += deltatime;
+  if (p >= buflen) return(MIDI_TRACKERROR);
+  /* a byte without MSB set means running status (same status as last time) */
+  if ((buf[p] & 128) != 0) *statusbyte = buf[p++];
+  event->type = EVENT_NONE;
+  event->deltatime = deltatime;
+  event->next = -1;
+  if (*statusbyte == 0xFF) { /* META event */
+    unsigned char subtype;
+    if (p >= buflen) return(MIDI_TRACKERROR);
+    subtype = buf[p++];
+    n = midi_fetch_variablelen_frombuf(buf + p, buflen - p, &len);
+    if (n == 0) return(MIDI_TRACKERROR);
+    p += n;
+    if (len > buflen - p) return(MIDI_TRACKERROR);
+    switch (subtype) {
+      case 1: /* text */
+      case 6: /* marker */
+        if ((s->text != NULL) && (s->text[0] == 0) && (s->textmaxlen > 3)) {
+          n = copymetastr(s->text, s->textmaxlen, buf + p, len);
+          /* add a LF trailer, just in case we'd like to append more data */
+          if (s->textmaxlen - (int)n > 2) {
+            s->text[n++] = '\n';
+            s->text[n] = 0;
+          }
+        }
+        break;
+      case 2: /* copyright notice */
+        if ((s->copyright != NULL) && (s->copyright[0] == 0)) copymetastr(s->copyright, s->copyrightmaxlen, buf + p, len);
+        break;
+      case 3: /* track name */
+        if (s->title != NULL) copymetastr(s->title, s->titlemaxlen, buf + p, len);
+        break;
+      case 0x2F: /* end of track */
 #ifdef DBGFILE
-      r = ld_sysex(&event, f, logf, statusbyte, tracklen);
-#else
-      r = ld_sysex(&event, f, statusbyte, tracklen);
+        if (logf) fprintf(logf, "%lu: END OF TRACK\n", *tracklen);
 #endif
-      if (r != 0) return(MIDI_TRACKERROR);
-    } else if ((statusbyte >= 0x80) && (statusbyte <= 0xEF)) { /* else it's a note-related command */
+        *pos = buflen;
+        return(1);
+      case 0x51: /* set tempo */
+        if (len != 3) return(MIDI_TRACKERROR);
+        event->type = EVENT_TEMPO;
+        event->data.tempoval = ((unsigned long)buf[p] << 16) | ((unsigned long)buf[p + 1] << 8) | buf[p + 2];
 #ifdef DBGFILE
-      r = ld_note(&event, f, logf, statusbyte, tracklen, channelsusage, reqpatches);
-#else
-      r = ld_note(&event, f, statusbyte, tracklen, channelsusage, reqpatches);
+        if (logf) fprintf(logf, "%lu: TEMPO -> %lu\n", *tracklen, event->data.tempoval);
 #endif
-      if (r != 0) return(MIDI_TRACKERROR);
-    } else { /* else it's an error - free memory we allocated and return NULL */
+        break;
+      case 0x58: /* time signature */
+        if (len != 4) return(MIDI_TRACKERROR);
+        break;
+      case 0x59: /* key signature */
+        if (len != 2) return(MIDI_TRACKERROR);
+        break;
+      default: /* anything else is ignored */
 #ifdef DBGFILE
-      if (logf) fprintf(logf, "Err. at offset %04lX (bytebuff = 0x%02X)\n", fio_seek(f, FIO_SEEK_CUR, 0), statusbyte);
+        if (logf) fprintf(logf, "%lu: META EVENT [0x%02Xh] (ignored)\n", *tracklen, subtype);
 #endif
-      return(MIDI_TRACKERROR);
+        break;
     }
-    /* add the event to the queue */
-    if (event.type == EVENT_NONE) {
-      ignoreddeltas += event.deltatime;
-    } else {
-      int pusheventres;
-      event.deltatime += ignoreddeltas; /* add any previously ignored delta times */
-      ignoreddeltas = 0;
-      /* add the event to the queue */
-      if (result == MIDI_EMPTYTRACK) { /* this is the first event in the queue */
-        pusheventres = pusheventqueue(&event, &result);
-      } else {
-        pusheventres = pusheventqueue(&event, NULL);
-      }
-      if (pusheventres != 0) {
-        return(MIDI_OUTOFMEM);
-      }
+    p += len;
+  } else if ((*statusbyte >= 0xF0) && (*statusbyte <= 0xF7)) { /* SYSEX event */
+    n = midi_fetch_variablelen_frombuf(buf + p, buflen - p, &len);
+    if (n == 0) return(MIDI_TRACKERROR);
+    p += n;
+    if (len > buflen - p) return(MIDI_TRACKERROR);
+#ifdef DBGFILE
+    if (logf) fprintf(logf, "%lu: SYSEX EVENT OF %ld BYTES ON CHAN #%d\n", *tracklen, len + 1, *statusbyte & 0x0F);
+#endif
+    /* SYSEX events that are more than 4K big are skipped, others are stored
+     * prefixed with their length and status byte, see ld_sysex() */
+    if (len + 1 <= 4096) {
+      unsigned int sysexleneven = len + 3;
+      if ((sysexleneven & 1) != 0) sysexleneven++;
+      ((uint16_t *)wbuff)[0] = len + 1;
+      wbuff[2] = *statusbyte;
+      memcpy(wbuff + 3, buf + p, len);
+      if (store_sysex(event, sysexleneven) != 0) return(MIDI_OUTOFMEM);
     }
+    p += len;
+  } else if ((*statusbyte >= 0x80) && (*statusbyte <= 0xEF)) { /* else it's a note-related command */
+    n = ((*statusbyte & 0xE0) == 0xC0) ? 1 : 2;
+    if (n > buflen - p) return(MIDI_TRACKERROR);
+    decode_chanmsg(event, *statusbyte, buf + p, channelsusage, reqpatches);
+    p += n;
+  } else { /* else it's an error */
+#ifdef DBGFILE
+    if (logf) fprintf(logf, "Err. at track offset %04lX (bytebuff = 0x%02X)\n", p, *statusbyte);
+#endif
+    return(MIDI_TRACKERROR);
+  }
+  *pos = p;
+  return(0);
+}
+
+
+/* same as midi_track2events(), but decodes a track that is entirely
+ * resident in memory: buf points to the MTrk chunk data (right after the
+ * chunk's length) and buflen is the chunk's length. The track is parsed in
+ * a single forward pass (see buf_nextevent()). */
+#ifdef DBGFILE
+long int midi_trackbuf2events(const unsigned char *buf, unsigned long int buflen, char *title, int titlemaxlen, char *copyright, int copyrightmaxlen, char *text, int textmaxlen, unsigned short int *channelsusage, FILE *logf, unsigned long int *tracklen, void *reqpatches) {
+#else
+long int midi_trackbuf2events(const unsigned char *buf, unsigned long int buflen, char *title, int titlemaxlen, char *copyright, int copyrightmaxlen, char *text, int textmaxlen, unsigned short int *channelsusage, unsigned long int *tracklen, void *reqpatches) {
+#endif
+  unsigned long pos = 0;
+  unsigned char statusbyte = 0;
+  struct midi_event event;
+  struct trackstrings s;
+  long result = MIDI_EMPTYTRACK;
+  unsigned long ignoreddeltas = 0;
+  int r;
+
+  /* zero out title and copyright strings, if provided */
+  if (titlemaxlen > 0) title[0] = 0;
+  if (copyrightmaxlen > 0) copyright[0] = 0;
+  if (textmaxlen > 0) text[0] = 0;
+  s.title = title;
+  s.titlemaxlen = titlemaxlen;
+  s.copyright = copyright;
+  s.copyrightmaxlen = copyrightmaxlen;
+  s.text = text;
+  s.textmaxlen = textmaxlen;
+
+  *tracklen = 0;
+
+  for (;;) {
+#ifdef DBGFILE
+    r = buf_nextevent(buf, buflen, &pos, &statusbyte, &event, &s, channelsusage, logf, tracklen, reqpatches);
+#else
+    r = buf_nextevent(buf, buflen, &pos, &statusbyte, &event, &s, channelsusage, tracklen, reqpatches);
+#endif
+    if (r == 1) break; /* end of track */
+    if (r != 0) return(r);
+    /* add the event to the queue */
+    if (queue_event(&event, &result, &ignoreddeltas) != 0) return(MIDI_OUTOFMEM);
   }
   if (result >= 0) {
-    if (pusheventqueue(NULL, NULL) != 0) return(MIDI_OUTOFMEM); /* flush last event in buffer to memory */
+    if (close_queue() != 0) return(MIDI_OUTOFMEM);
   }
   return(result);
 }
+#endif
+
+
+/* same as midi_mergetrack(), for events that can be accessed in place (see
+ * mem_ptr()): nothing is copied, deltatimes and links are updated directly */
+static long mergetrack_inplace(long t0, long t1, unsigned long *totlen, unsigned short timeunitdiv) {
+  struct midi_event far *event[2];
+  struct midi_event far *last = NULL;
+  long id[2], res = -1;
+  int selected;
+  unsigned long curtempo = 500000l, utotlen = 0;
+
+  id[0] = t0;
+  id[1] = t1;
+  event[0] = (t0 >= 0) ? mem_ptr(t0) : NULL;
+  event[1] = (t1 >= 0) ? mem_ptr(t1) : NULL;
+  while ((event[0] != NULL) || (event[1] != NULL)) {
+    /* select the soonest event of both tracks */
+    selected = 0;
+    if ((event[0] == NULL) || ((event[1] != NULL) && (event[1]->deltatime < event[0]->deltatime))) selected = 1;
+    /* attach it to the last one (or make it the first one) */
+    if (last == NULL) {
+      res = id[selected];
+    } else if (last->next != id[selected]) {
+      last->next = id[selected];
+    }
+    last = event[selected];
+    /* increment timer */
+    if ((totlen != NULL) && (last->deltatime != 0)) {
+      utotlen += DELTATIME2US(last->deltatime, curtempo, timeunitdiv);
+      while (utotlen >= 1000000lu) {
+        utotlen -= 1000000lu;
+        *totlen += 1;
+      }
+    }
+    if (last->type == EVENT_TEMPO) curtempo = last->data.tempoval;
+    /* decrement timer on the non-selected track, and move along */
+    if (event[selected ^ 1] != NULL) event[selected ^ 1]->deltatime -= last->deltatime;
+    id[selected] = last->next;
+    event[selected] = (last->next >= 0) ? mem_ptr(last->next) : NULL;
+  }
+  return(res);
+}
 
 
 /* merge two MIDI tracks into a single (serialized) one. returns a "pointer"
@@ -528,6 +1267,10 @@ long midi_mergetrack(long t0, long t1, unsigned long *totlen, unsigned short tim
   struct midi_event event[2], lastevent;
 
   if (totlen != NULL) *totlen = 0;
+  /* events that can be accessed in place need not be copied back and forth */
+  if (((t0 >= 0) || (t1 >= 0)) && (mem_ptr((t0 >= 0) ? t0 : t1) != NULL)) {
+    return(mergetrack_inplace(t0, t1, totlen, timeunitdiv));
+  }
   /* fetch first events for both tracks */
   if (t0 >= 0) mem_pull(t0, event, sizeof(struct midi_event));
   if (t1 >= 0) mem_pull(t1, event + 1, sizeof(struct midi_event));
@@ -585,3 +1328,554 @@ long midi_mergetrack(long t0, long t1, unsigned long *totlen, unsigned short tim
   }
   return(res);
 }
+
+
+/* state of the tracks being merged, shared by midi_mergetracks() and the
+ * progressive loader (only one merge is ever in progress) */
+static struct midi_event heads[MIDI_MERGEMAX];  /* current event of each track */
+static unsigned long headtick[MIDI_MERGEMAX];   /* and its absolute time */
+static unsigned char heap[MIDI_MERGEMAX];
+
+
+/* returns non-zero if the head of track a must be played before the one of
+ * track b. on equal times, the lowest track goes first, just like it would
+ * when merging tracks one by one with midi_mergetrack() */
+#define HEAD_BEFORE(a, b) ((headtick[a] < headtick[b]) || ((headtick[a] == headtick[b]) && (a < b)))
+
+/* restores the heap property of heap[] (n items), starting at node i */
+static void heap_siftdown(unsigned char *heap, int n, int i, const unsigned long *headtick) {
+  unsigned char t = heap[i];
+  for (;;) {
+    int c = i * 2 + 1;
+    if (c >= n) break;
+    if ((c + 1 < n) && HEAD_BEFORE(heap[c + 1], heap[c])) c++;
+    if (!HEAD_BEFORE(heap[c], t)) break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = t;
+}
+
+
+/* fetches the event id of a track being merged into head, returns 0 on
+ * success */
+static int merge_pull(struct midi_packreader *r, long id, struct midi_event *head, int flags) {
+  struct midi_event far *p;
+  if (flags & MIDI_MERGE_PACKED) return(midi_packpull(r, id, head));
+  p = mem_ptr(id);
+  if (p == NULL) return(mem_pull(id, head, sizeof(struct midi_event)));
+  *head = *p;
+  return(0);
+}
+
+
+/* writes event at id, in place if memory can be accessed directly */
+static void merge_push(const struct midi_event *event, long id) {
+  struct midi_event far *p = mem_ptr(id);
+  if (p != NULL) {
+    *p = *event;
+  } else {
+    mem_push((void far *)event, id, sizeof(struct midi_event));
+  }
+}
+
+
+/* moves the chunks of a packed stream (first to last) down to dst, and
+ * gives back all the memory that follows. returns the new stream's start */
+static long pack_movedown(long first, long last, long dst) {
+  unsigned char buf[MIDI_PACKCHUNK];
+  long res = dst;
+  for (;;) {
+    mem_pull(first, buf, MIDI_PACKCHUNK);
+    mem_push(buf, dst, MIDI_PACKCHUNK);
+    if (first == last) break;
+    first = mem_next(first + MIDI_PACKCHUNK, MIDI_PACKCHUNK);
+    dst = mem_next(dst + MIDI_PACKCHUNK, MIDI_PACKCHUNK);
+  }
+  mem_rewind(dst + MIDI_PACKCHUNK);
+  return(res);
+}
+
+
+/* copies the sysex string of an event (16-bit length followed by the string,
+ * or its packed form if packed is set) to a newly allocated block. returns
+ * the address of the copy, or MIDI_OUTOFMEM */
+static long copy_sysex(long sysexptr, int packed) {
+  unsigned int len;
+  long res;
+  if (packed) {
+    len = midi_packsysex(sysexptr, wbuff);
+  } else {
+    mem_pull(sysexptr, wbuff, 2);
+    len = ((uint16_t *)wbuff)[0];
+    mem_pull(sysexptr, wbuff, (len + 3) & ~1u);
+  }
+  len = (len + 3) & ~1u; /* XMS moves must be even */
+  res = mem_alloc(len);
+  if (res < 0) return(MIDI_OUTOFMEM);
+  mem_push(wbuff, res, len);
+  return(res);
+}
+
+
+/* moves an array of events written by midi_mergetracks() (along with the
+ * sysex strings that follow their events) down to dst, and gives back all the
+ * memory that follows. returns the new address of the first event */
+static long array_movedown(long first, long dst) {
+  struct midi_event event;
+  unsigned int len = 0;
+  long res = dst, end;
+  for (;;) {
+    mem_pull(first, &event, sizeof(struct midi_event));
+    end = dst + sizeof(struct midi_event);
+    if (event.type == EVENT_SYSEX) {
+      mem_pull(event.data.sysex.sysexptr, wbuff, 2);
+      len = (((uint16_t *)wbuff)[0] + 3) & ~1u;
+      mem_pull(event.data.sysex.sysexptr, wbuff, len);
+      event.data.sysex.sysexptr = mem_next(end, len);
+      end = event.data.sysex.sysexptr + len;
+    }
+    /* blocks are laid out exactly like mem_alloc() would have done */
+    first = event.next;
+    if (first >= 0) event.next = mem_next(end, sizeof(struct midi_event));
+    mem_push(&event, dst, sizeof(struct midi_event));
+    if (event.type == EVENT_SYSEX) mem_push(wbuff, event.data.sysex.sysexptr, len);
+    if (first < 0) break;
+    dst = event.next;
+  }
+  mem_rewind(end);
+  return(res);
+}
+
+
+/* merge count MIDI tracks at once into a single (serialized) one, and returns
+ * a "pointer" to it. tracks[] holds the first event of every track (negative
+ * values are empty tracks). Tracks are merged in a single pass, selecting the
+ * next event through a min-heap ordered by absolute time, and events are
+ * relinked in place: every event is pulled once and pushed at most once.
+ * Packed tracks, or arrays, are instead written to a new song that is moved
+ * over the tracks once complete.
+ * totlen is filled with the total time of the song (in seconds). If flags
+ * contains MIDI_MERGE_USDELTA, the deltatime of every merged event is
+ * converted to microseconds using the tempo map of the song. */
+long midi_mergetracks(const long *tracks, int count, unsigned long *totlen, unsigned short timeunitdiv, int flags) {
+  static long headid[MIDI_MERGEMAX];              /* id of the current events */
+  static struct midi_packreader readers[MIDI_MERGEMAX]; /* packed tracks only */
+  struct packwriter out;
+  struct midi_event lastevent;
+  long res = -1, lasteventid = -1, base = -1;
+  unsigned long lasttick = 0, curtempo = 500000l, utotlen = 0;
+  int heapsize = 0, i, lastdirty = 0;
+  int packout = ((flags & (MIDI_MERGE_PACKED | MIDI_MERGE_ARRAY)) == MIDI_MERGE_PACKED);
+
+  if (totlen != NULL) *totlen = 0;
+  if (count > MIDI_MERGEMAX) return(-1);
+  /* fetch the first event of every track, and heapify them */
+  for (i = 0; i < count; i++) {
+    if (tracks[i] < 0) continue;
+    headid[i] = tracks[i];
+    readers[i].chunk = -1;
+    if (merge_pull(readers + i, headid[i], heads + i, flags) != 0) return(-1);
+    headtick[i] = heads[i].deltatime;
+    heap[heapsize++] = i;
+    if ((base < 0) || (tracks[i] < base)) base = tracks[i];
+  }
+  for (i = heapsize / 2 - 1; i >= 0; i--) heap_siftdown(heap, heapsize, i, headtick);
+  if (packout && (heapsize > 0)) {
+    if (pack_open(&out) != 0) return(MIDI_OUTOFMEM);
+    res = out.start;
+  }
+
+  while (heapsize > 0) {
+    unsigned char t = heap[0];
+    unsigned long delta = headtick[t] - lasttick;
+    unsigned long usdelta = 0;
+    long id = headid[t];
+    if (delta != 0) usdelta = DELTATIME2US(delta, curtempo, timeunitdiv);
+    /* arrays get a copy of the event, appended to them */
+    if (flags & MIDI_MERGE_ARRAY) {
+      id = mem_alloc(sizeof(struct midi_event));
+      if (id < 0) return(MIDI_OUTOFMEM);
+    }
+    /* attach the selected event to the last one, write the last one back to
+     * memory only if it changed (packed songs need no links) */
+    if (packout) {
+      /* events are written one after another below */
+    } else if (lasteventid < 0) {
+      res = id;
+    } else if ((lastevent.next != id) || (lastdirty != 0) || (flags & MIDI_MERGE_ARRAY)) {
+      lastevent.next = id;
+      merge_push(&lastevent, lasteventid);
+    }
+    memcpy(&lastevent, heads + t, sizeof(struct midi_event));
+    lasteventid = id;
+    if (flags & MIDI_MERGE_USDELTA) delta = usdelta;
+    lastdirty = (lastevent.deltatime != delta);
+    lastevent.deltatime = delta;
+    lasttick = headtick[t];
+    if (packout) {
+      if (lastevent.type == EVENT_SYSEX) midi_packsysex(lastevent.data.sysex.sysexptr, wbuff);
+      if (pack_event(&out, &lastevent, wbuff) != 0) return(MIDI_OUTOFMEM);
+    } else if ((flags & MIDI_MERGE_ARRAY) && (lastevent.type == EVENT_SYSEX)) {
+      lastevent.data.sysex.sysexptr = copy_sysex(lastevent.data.sysex.sysexptr, flags & MIDI_MERGE_PACKED);
+      if (lastevent.data.sysex.sysexptr < 0) return(MIDI_OUTOFMEM);
+    }
+    /* increment timer */
+    if ((totlen != NULL) && (usdelta != 0)) {
+      utotlen += usdelta;
+      while (utotlen >= 1000000lu) {
+        utotlen -= 1000000lu;
+        *totlen += 1;
+      }
+    }
+    if (lastevent.type == EVENT_TEMPO) curtempo = lastevent.data.tempoval;
+    /* move along on the selected track, or drop it from the heap if over */
+    if (heads[t].next >= 0) {
+      headid[t] = heads[t].next;
+      if (merge_pull(readers + t, headid[t], heads + t, flags) != 0) return(-1);
+      headtick[t] += heads[t].deltatime;
+    } else {
+      heap[0] = heap[--heapsize];
+    }
+    heap_siftdown(heap, heapsize, 0, headtick);
+  }
+  /* terminate the song */
+  if (packout) {
+    if (res < 0) return(res);
+    if (pack_close(&out) != 0) return(MIDI_OUTOFMEM);
+    /* tracks are not needed anymore, move the song over them */
+    res = pack_movedown(out.start, out.chunk, base);
+  } else if (lasteventid >= 0) {
+    lastevent.next = -1;
+    merge_push(&lastevent, lasteventid);
+    /* tracks are not needed anymore, move the array over them */
+    if (flags & MIDI_MERGE_ARRAY) res = array_movedown(res, base);
+  }
+  return(res);
+}
+
+
+/* PROGRESSIVE LOADING AND STREAMING */
+
+/* a track being parsed and merged on the fly */
+struct progtrack {
+  const unsigned char *buf;  /* chunk data if resident, NULL if read from file */
+  struct fiofile f;          /* otherwise the file, with a cache of its own */
+  unsigned long len;         /* length of the chunk */
+  unsigned long fileoff;     /* where the chunk starts in the file */
+  unsigned long start;       /* where the chunk starts (within buf, or file) */
+  unsigned long pos;         /* where the next event starts */
+  unsigned long tick;        /* absolute time of the last event parsed */
+  unsigned long headpos;     /* where the event held in heads[] starts */
+  unsigned char headstatus;  /* and the running status before it */
+  unsigned char status;      /* running status */
+};
+
+static struct progtrack progtracks[MIDI_MERGEMAX];
+
+static struct {
+  struct fiofile *f;
+  struct packwriter out;
+  int packing;               /* non-zero if events are packed into out */
+  unsigned short timeunitdiv;
+  unsigned short *channelsusage;
+  void *reqpatches;
+#ifdef DBGFILE
+  FILE *logf;
+#endif
+  int count;                 /* tracks added so far */
+  int heapsize;              /* tracks still being merged */
+  int heapready;             /* non-zero once heap[] is in order */
+  unsigned long lasttick;
+  unsigned long curtempo;
+  unsigned long utotlen;     /* microseconds not accounted in p.totlen yet */
+  struct midi_progress p;
+  struct midi_progress song; /* the whole song, once scanned for streaming */
+} prog;
+
+static const struct trackstrings nostrings = {NULL, 0, NULL, 0, NULL, 0};
+
+
+/* parses the event of track t located at pos (running status being status)
+ * into event. returns 0 on success, 1 at the end of the track, or an error */
+static int prog_parse(struct progtrack *c, unsigned long *pos, unsigned char *status, struct midi_event *event, const struct trackstrings *s, unsigned long *tick) {
+  int r;
+#ifndef MSDOS
+  if (c->buf != NULL) {
+#ifdef DBGFILE
+    return(buf_nextevent(c->buf, c->len, pos, status, event, s, prog.channelsusage, prog.logf, tick, prog.reqpatches));
+#else
+    return(buf_nextevent(c->buf, c->len, pos, status, event, s, prog.channelsusage, tick, prog.reqpatches));
+#endif
+  }
+#endif
+  /* every track reads the file through its own copy of the fiofile struct,
+   * so tracks do not keep evicting each other from the cache */
+  fio_seek(&(c->f), FIO_SEEK_START, *pos);
+#ifdef DBGFILE
+  r = fio_nextevent(&(c->f), status, event, s, prog.channelsusage, prog.logf, tick, prog.reqpatches);
+#else
+  r = fio_nextevent(&(c->f), status, event, s, prog.channelsusage, tick, prog.reqpatches);
+#endif
+  *pos = fio_seek(&(c->f), FIO_SEEK_CUR, 0);
+  return(r);
+}
+
+
+/* parses the next event of track t that is worth keeping into heads[t].
+ * returns 0 on success, 1 at the end of the track, or an error */
+static int prog_pull(int t, const struct trackstrings *s) {
+  struct progtrack *c = progtracks + t;
+  int r;
+  do {
+    c->headpos = c->pos;
+    c->headstatus = c->status;
+    r = prog_parse(c, &(c->pos), &(c->status), heads + t, s, &(c->tick));
+    if (r != 0) return(r);
+  } while (heads[t].type == EVENT_NONE);
+  headtick[t] = c->tick;
+  return(0);
+}
+
+
+/* converts the delta of the event held as head of track t to microseconds,
+ * and accounts for it in the length of the song */
+static void prog_time(int t) {
+  struct midi_event *event = heads + t;
+  unsigned long delta = headtick[t] - prog.lasttick;
+  unsigned long usdelta = 0;
+  if (delta != 0) usdelta = DELTATIME2US(delta, prog.curtempo, prog.timeunitdiv);
+  prog.lasttick = headtick[t];
+  event->deltatime = usdelta;
+  if (event->type == EVENT_TEMPO) prog.curtempo = event->data.tempoval;
+  prog.utotlen += usdelta;
+  while (prog.utotlen >= 1000000lu) {
+    prog.utotlen -= 1000000lu;
+    prog.p.totlen += 1;
+  }
+  prog.p.events += 1;
+}
+
+
+/* appends the event held as head of track t to the song (if it is being
+ * packed at all, otherwise the event is only accounted for) */
+static int prog_emit(int t) {
+  struct midi_event *event = heads + t;
+  prog_time(t);
+  if (prog.packing == 0) return(0);
+  /* the sysex string is not kept along with the head, parse it again so it
+   * lands in wbuff */
+  if (event->type == EVENT_SYSEX) {
+    struct midi_event sysex;
+    unsigned long pos = progtracks[t].headpos, tick = 0;
+    unsigned char status = progtracks[t].headstatus;
+    if (prog_parse(progtracks + t, &pos, &status, &sysex, &nostrings, &tick) != 0) return(MIDI_TRACKERROR);
+  }
+  if (pack_event(&(prog.out), event, wbuff) != 0) return(MIDI_OUTOFMEM);
+  return(0);
+}
+
+
+#ifdef DBGFILE
+static void prog_init(struct fiofile *f, unsigned short timeunitdiv, unsigned short *channelsusage, FILE *logf, void *reqpatches) {
+#else
+static void prog_init(struct fiofile *f, unsigned short timeunitdiv, unsigned short *channelsusage, void *reqpatches) {
+#endif
+  memset(&prog, 0, sizeof(prog));
+  prog.f = f;
+  prog.timeunitdiv = timeunitdiv;
+  prog.channelsusage = channelsusage;
+  prog.reqpatches = reqpatches;
+#ifdef DBGFILE
+  prog.logf = logf;
+#endif
+  prog.curtempo = 500000l;
+  /* sysex strings must be left in wbuff by the parsers */
+  packtracks = 1;
+}
+
+
+#ifdef DBGFILE
+long midi_progopen(struct fiofile *f, unsigned short timeunitdiv, unsigned short *channelsusage, FILE *logf, void *reqpatches) {
+  prog_init(f, timeunitdiv, channelsusage, logf, reqpatches);
+#else
+long midi_progopen(struct fiofile *f, unsigned short timeunitdiv, unsigned short *channelsusage, void *reqpatches) {
+  prog_init(f, timeunitdiv, channelsusage, reqpatches);
+#endif
+  prog.packing = 1;
+  if (pack_open(&(prog.out)) != 0) return(MIDI_OUTOFMEM);
+  return(prog.out.start);
+}
+
+
+int midi_progtrack(const unsigned char *buf, unsigned long buflen, char *title, int titlemaxlen, char *copyright, int copyrightmaxlen, char *text, int textmaxlen, unsigned long *tracklen) {
+  int t = prog.count, r;
+  struct progtrack *c = progtracks + t;
+  struct trackstrings s;
+
+  if (t >= MIDI_MERGEMAX) return(MIDI_TRACKERROR);
+  prog.count++;
+  /* zero out title and copyright strings, if provided */
+  if (titlemaxlen > 0) title[0] = 0;
+  if (copyrightmaxlen > 0) copyright[0] = 0;
+  if (textmaxlen > 0) text[0] = 0;
+  s.title = title;
+  s.titlemaxlen = titlemaxlen;
+  s.copyright = copyright;
+  s.copyrightmaxlen = copyrightmaxlen;
+  s.text = text;
+  s.textmaxlen = textmaxlen;
+
+  c->buf = buf;
+  c->f = *(prog.f);
+  c->len = buflen;
+  c->fileoff = fio_seek(prog.f, FIO_SEEK_CUR, 0);
+  c->start = 0;
+  if (buf == NULL) c->start = c->fileoff;
+  c->pos = c->start;
+  c->tick = 0;
+  c->status = 0;
+  prog.p.total += buflen;
+
+  /* events at the very start of the track are merged right away: on equal
+   * times lower tracks go first, so nothing may come in between */
+  for (;;) {
+    r = prog_pull(t, &s);
+    if (r < 0) return(r);
+    if (r == 1) break; /* the track is over already */
+    if (headtick[t] != 0) { /* leave the rest to midi_progstep() */
+      heap[prog.heapsize++] = t;
+      break;
+    }
+    r = prog_emit(t);
+    if (r != 0) return(r);
+  }
+  *tracklen = c->tick;
+  return(0);
+}
+
+
+int midi_progstep(unsigned long untilsec, unsigned int maxevents, struct midi_progress *p) {
+  unsigned int n = 0;
+  int i, r;
+
+  if (prog.p.done != 0) {
+    *p = prog.p;
+    return(1);
+  }
+  /* tracks are put in order the first time */
+  if (prog.heapready == 0) {
+    for (i = prog.heapsize / 2 - 1; i >= 0; i--) heap_siftdown(heap, prog.heapsize, i, headtick);
+    prog.heapready = 1;
+  }
+  while ((prog.heapsize > 0) && (prog.p.totlen < untilsec)) {
+    unsigned char t = heap[0];
+    if ((maxevents != 0) && (n == maxevents)) break;
+    r = prog_emit(t);
+    if (r != 0) return(r);
+    n++;
+    /* move along on the selected track, or drop it from the heap if over */
+    r = prog_pull(t, &nostrings);
+    if (r < 0) return(r);
+    if (r == 1) heap[0] = heap[--prog.heapsize];
+    heap_siftdown(heap, prog.heapsize, 0, headtick);
+  }
+  /* compute how much of the tracks has been parsed */
+  prog.p.parsed = 0;
+  for (i = 0; i < prog.count; i++) prog.p.parsed += progtracks[i].pos - progtracks[i].start;
+  if (prog.heapsize == 0) {
+    if ((prog.packing != 0) && (pack_close(&(prog.out)) != 0)) return(MIDI_OUTOFMEM);
+    prog.p.parsed = prog.p.total;
+    prog.p.done = 1;
+  } else if (prog.packing != 0) {
+    pack_flush(&(prog.out));
+  }
+  *p = prog.p;
+  return(prog.p.done);
+}
+
+
+#ifdef DBGFILE
+void midi_streamopen(struct fiofile *f, unsigned short timeunitdiv, unsigned short *channelsusage, FILE *logf, void *reqpatches) {
+  prog_init(f, timeunitdiv, channelsusage, logf, reqpatches);
+}
+#else
+void midi_streamopen(struct fiofile *f, unsigned short timeunitdiv, unsigned short *channelsusage, void *reqpatches) {
+  prog_init(f, timeunitdiv, channelsusage, reqpatches);
+}
+#endif
+
+
+int midi_streamstart(struct midi_progress *p) {
+  int t, r;
+
+  /* go through the whole song once, without keeping anything */
+  if (prog.p.done == 0) {
+    r = midi_progstep(ULONG_MAX, 0, &(prog.song));
+    if (r < 0) return(r);
+  }
+  *p = prog.song;
+  /* then get back to the start of every track, the very start of tracks
+   * being simply merged along with the rest this time */
+#ifdef DBGFILE
+  prog.logf = NULL; /* events were logged during the first pass already */
+#endif
+  prog.heapsize = 0;
+  prog.heapready = 0;
+  prog.lasttick = 0;
+  prog.curtempo = 500000l;
+  prog.utotlen = 0;
+  prog.p.events = 0;
+  prog.p.totlen = 0;
+  for (t = 0; t < prog.count; t++) {
+    progtracks[t].pos = progtracks[t].start;
+    progtracks[t].tick = 0;
+    progtracks[t].status = 0;
+    r = prog_pull(t, &nostrings);
+    if (r < 0) return(r);
+    if (r == 0) heap[prog.heapsize++] = t;
+  }
+  for (t = prog.heapsize / 2 - 1; t >= 0; t--) heap_siftdown(heap, prog.heapsize, t, headtick);
+  return(0);
+}
+
+
+int midi_streampull(struct midi_event *events, int max) {
+  int n, r;
+  for (n = 0; (n < max) && (prog.heapsize > 0); n++) {
+    unsigned char t = heap[0];
+    struct progtrack *c = progtracks + t;
+    prog_time(t);
+    events[n] = heads[t];
+    /* sysex strings are fetched again from the file when needed */
+    if (events[n].type == EVENT_SYSEX) events[n].data.sysex.sysexptr = c->fileoff + (c->headpos - c->start);
+    /* move along on the selected track, or drop it from the heap if over */
+    r = prog_pull(t, &nostrings);
+    if (r < 0) return(r);
+    if (r == 1) heap[0] = heap[--prog.heapsize];
+    heap_siftdown(heap, prog.heapsize, 0, headtick);
+    /* events are numbered in the order they are played */
+    events[n].next = (prog.heapsize > 0) ? (long)prog.p.events : -1;
+  }
+  return(n);
+}
+
+
+unsigned int midi_streamsysex(long sysexptr, unsigned char *buff) {
+  struct midi_event event;
+  unsigned long pos, tick = 0;
+  unsigned char status = 0xF0; /* sysex events hardly ever rely on running status */
+  unsigned int len;
+  int t;
+  for (t = 0; t < prog.count; t++) {
+    struct progtrack *c = progtracks + t;
+    if (((unsigned long)sysexptr < c->fileoff) || ((unsigned long)sysexptr - c->fileoff >= c->len)) continue;
+    pos = c->start + ((unsigned long)sysexptr - c->fileoff);
+    if ((prog_parse(c, &pos, &status, &event, &nostrings, &tick) != 0) || (event.type != EVENT_SYSEX)) break;
+    len = ((uint16_t *)wbuff)[0];
+    if (buff != wbuff) memcpy(buff, wbuff, len + 2);
+    return(len);
+  }
+  ((uint16_t *)buff)[0] = 0;
+  return(0);
+}
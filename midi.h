@@ -138,8 +138,10 @@ struct midi_event {
 
 void midi_init_static_ident(void);
 
-/* returns number of tracks in midi file on success, neg val otherwise */
-int midi_readhdr(struct fiofile *f, int *format, unsigned short int *timeunitdiv, unsigned long int *tracklist, int maxtracks);
+/* returns number of tracks in midi file on success, neg val otherwise.
+ * tracklist and tracklens are filled with the offset and byte length of each
+ * track chunk */
+int midi_readhdr(struct fiofile *f, int *format, unsigned short int *timeunitdiv, unsigned long int *tracklist, unsigned long int *tracklens, int maxtracks);
 
 /* parse a track object and returns the id of the first events in the linked list */
 long int midi_track2events(struct fiofile *f, char *title, int titlemaxlen,
@@ -150,10 +152,209 @@ long int midi_track2events(struct fiofile *f, char *title, int titlemaxlen,
 #endif
                            unsigned long int *tracklen, void *reqpatches);
 
+#ifndef MSDOS
+/* same as midi_track2events(), but parses a track chunk that is resident in
+ * memory (buf points to the chunk's data, buflen is the chunk's length) */
+long int midi_trackbuf2events(const unsigned char *buf, unsigned long int buflen,
+                              char *title, int titlemaxlen,
+                              char *copyright, int copyrightmaxlen, char *text,
+                              int textmaxlen, unsigned short int *channelsusage,
+#ifdef DBGFILE
+                              FILE *logf,
+#endif
+                              unsigned long int *tracklen, void *reqpatches);
+#endif
+
 /* merge two MIDI tracks into a single (serialized) one. returns a "pointer"
  * to the unique track. I take care not to allocate/free memory here.
  * All notes are already in RAM after all. totlen is filled with the total
  * time of the merged tracks (in miliseconds). */
 long midi_mergetrack(long t0, long t1, unsigned long *totlen, unsigned short timeunitdiv);
 
+/* maximum amount of tracks midi_mergetracks() is able to merge */
+#define MIDI_MERGEMAX 64
+
+/* flag for midi_mergetracks(): store deltatimes in microseconds instead of
+ * MIDI ticks, so the player does not have to care about tempo changes */
+#define MIDI_MERGE_USDELTA 1
+
+/* flag for midi_mergetracks(): tracks are packed streams (see below), and so
+ * will be the merged song unless MIDI_MERGE_ARRAY is set too */
+#define MIDI_MERGE_PACKED 2
+
+/* flag for midi_mergetracks(): instead of relinking the events of tracks,
+ * copy them into a new array of events, in playback order. tracks may be
+ * linked lists or packed streams (MIDI_MERGE_PACKED). events are still
+ * linked, the next field of each pointing to the event that follows it in
+ * memory, and sysex strings are stored right after their event */
+#define MIDI_MERGE_ARRAY 4
+
+/* merge count MIDI tracks (tracks[] holding the first event of each) into a
+ * single (serialized) one in one pass. returns a "pointer" to the unique
+ * track. totlen is filled with the total time of the merged tracks (in
+ * seconds). flags is a combination of MIDI_MERGE_USDELTA, MIDI_MERGE_PACKED
+ * and MIDI_MERGE_ARRAY. with MIDI_MERGE_PACKED or
+ * MIDI_MERGE_ARRAY, tracks must be the last things allocated in memory: once
+ * merged, the song is moved over them and the memory they used is given
+ * back. */
+long midi_mergetracks(const long *tracks, int count, unsigned long *totlen, unsigned short timeunitdiv, int flags);
+
+/* memory needed by a song once loaded, as computed by midi_tracksize() */
+struct midi_songsize {
+  unsigned long events;      /* events to be stored */
+  unsigned long sysexbytes;  /* bytes taken by their sysex strings */
+  unsigned long packedbytes; /* bytes taken by the tracks as packed streams */
+  unsigned int maxsysex;     /* biggest sysex string, as stored */
+};
+
+/* goes through the track found at the current position of f (tracklen bytes
+ * long) without decoding it, and adds what it will take in memory to sz
+ * (to be zeroed before the first track). returns 0 on success,
+ * MIDI_TRACKERROR if the track is corrupted */
+int midi_tracksize(struct fiofile *f, unsigned long tracklen, struct midi_songsize *sz);
+
+/* reserves at once all the memory needed to load a song of sz, and to merge
+ * its tracks with midi_mergetracks() called with flags (MIDI_MERGE_PACKED
+ * also meaning that tracks are packed), so nothing needs to be allocated
+ * while loading it. returns the amount of bytes reserved, MIDI_OUTOFMEM if
+ * the song cannot fit in memory */
+long midi_reserve(const struct midi_songsize *sz, int flags);
+
+/* PACKED EVENT STREAMS
+ *
+ * Instead of linked midi_event structs, tracks and songs can be stored as a
+ * sequence of variable-size packed events, each being made of:
+ *   - a tag byte: event type in the high nibble, MIDI channel in the low one
+ *   - the deltatime, as a MIDI variable length quantity
+ *   - 0 to 3 bytes of payload, depending on the event type (sysex events
+ *     have a variable length quantity length followed by the sysex string)
+ * The stream is terminated by a MIDI_PACK_END tag. It is written to memory
+ * in MIDI_PACKCHUNK-sized blocks allocated one after another, so a "pointer"
+ * to any event of the stream is simply its byte address in memory. */
+
+#define MIDI_PACKCHUNK 32
+#define MIDI_PACK_END 0xF0
+
+/* possible memory layouts of a song (or track) */
+#define MIDI_LAYOUT_LIST 0    /* midi_event structs linked in any order */
+#define MIDI_LAYOUT_ARRAY 1   /* midi_event structs one after the other */
+#define MIDI_LAYOUT_PACKED 2  /* packed event stream */
+#define MIDI_LAYOUT_STREAM 3  /* events merged from the file as they are read */
+
+/* sequential reader of packed streams */
+struct midi_packreader {
+  long chunk;        /* address of the chunk in buf (-1 if none) */
+  unsigned int off;  /* read position within buf */
+  unsigned char buf[MIDI_PACKCHUNK];
+};
+
+/* makes midi_track2events() and midi_trackbuf2events() store tracks as
+ * packed streams (packed != 0) or as linked lists of events (packed = 0) */
+void midi_packtracks(int packed);
+
+/* decodes the packed event located at pos into event, and sets its next
+ * field to the position of the following event (-1 if none). sysex events
+ * have their sysexptr set to a position to be used with midi_packsysex().
+ * r must be initialized with its chunk set to -1 before the first call.
+ * returns 0 on success, non-zero on error. */
+int midi_packpull(struct midi_packreader *r, long pos, struct midi_event *event);
+
+/* copies the sysex string of a packed sysex event into buff, prefixed with
+ * its 16-bit length (like sysex strings of non-packed events are stored in
+ * memory). buff must be able to hold 4098 bytes. returns the length of the
+ * sysex string. */
+unsigned int midi_packsysex(long sysexptr, unsigned char *buff);
+
+/* writes the packed song starting at start to the current position of file
+ * f, as is. the song must be the last thing allocated in memory (which it
+ * is once loaded). returns the amount of bytes written, or -1 on error. */
+long midi_packsave(long start, struct fiofile *f);
+
+/* reads a packed song of len bytes saved by midi_packsave() from the
+ * current position of file f. returns the position of its first event, or
+ * MIDI_TRACKERROR / MIDI_OUTOFMEM. */
+long midi_packload(struct fiofile *f, unsigned long len);
+
+/* PROGRESSIVE LOADING
+ *
+ * Instead of being parsed entirely before being merged, tracks can be parsed
+ * and merged on the fly, a few events at a time, into a packed song: this
+ * way playback may start as soon as the first seconds of the song are
+ * loaded, the rest being loaded during playback. Tracks are never stored on
+ * their own, so the song is all the memory needed. */
+
+struct midi_progress {
+  unsigned long events;  /* events merged into the song so far */
+  unsigned long totlen;  /* length of the song loaded so far, in seconds */
+  unsigned long parsed;  /* bytes of tracks parsed so far */
+  unsigned long total;   /* bytes of tracks to be parsed */
+  int done;              /* non-zero once the whole song is loaded */
+};
+
+/* starts the progressive loading of a song from file f, that must be kept
+ * open until the loading is done. tracks are then added with
+ * midi_progtrack(). returns the position of the first event of the song, or
+ * MIDI_OUTOFMEM. */
+long midi_progopen(struct fiofile *f, unsigned short timeunitdiv,
+                   unsigned short *channelsusage,
+#ifdef DBGFILE
+                   FILE *logf,
+#endif
+                   void *reqpatches);
+
+/* adds the track located at the current position of the file to the song
+ * being loaded (or streamed). buf points to the track's chunk if it is
+ * resident in memory, otherwise it is NULL and the track is read through the
+ * file, each track with a small cache of its own. the events at the very
+ * start of the track are parsed and merged right away, along with its title,
+ * copyright and text strings. tracklen is set to 0 if the whole track is done
+ * with already. returns 0 on success, MIDI_TRACKERROR or MIDI_OUTOFMEM. */
+int midi_progtrack(const unsigned char *buf, unsigned long buflen,
+                   char *title, int titlemaxlen,
+                   char *copyright, int copyrightmaxlen,
+                   char *text, int textmaxlen, unsigned long *tracklen);
+
+/* merges further events into the song being loaded, until untilsec seconds
+ * of it are loaded or maxevents events are merged (0 = no limit). events
+ * merged so far can be read as soon as this returns. p is filled with the
+ * progress of the loading. returns 0 if the song is not fully loaded yet, 1
+ * if it is, MIDI_TRACKERROR or MIDI_OUTOFMEM on error. */
+int midi_progstep(unsigned long untilsec, unsigned int maxevents, struct midi_progress *p);
+
+/* STREAMING
+ *
+ * Songs can also be played straight from their file, without being loaded
+ * at all: one cursor is kept per track, and events are merged from the
+ * earliest one while playing. Memory needs depend on the amount of tracks
+ * only, so songs of any size can be played. The song is read twice, though:
+ * once up front to know its length and the channels and patches it uses,
+ * then while playing. */
+
+/* starts the streaming of a song from file f, that must be kept open until
+ * the song is over. tracks are then added with midi_progtrack(), and the
+ * streaming starts with midi_streamstart(). */
+void midi_streamopen(struct fiofile *f, unsigned short timeunitdiv,
+                     unsigned short *channelsusage,
+#ifdef DBGFILE
+                     FILE *logf,
+#endif
+                     void *reqpatches);
+
+/* goes through the whole song, filling p with its length and events count,
+ * then gets back to its start. may be called again later to start over.
+ * returns 0 on success, MIDI_TRACKERROR on error. */
+int midi_streamstart(struct midi_progress *p);
+
+/* fetches up to max further events of the song into events, with their
+ * deltas in microseconds. the next field of the last event of the song is
+ * -1, other events have a non-negative one. sysex events have their
+ * sysexptr set to a position to be used with midi_streamsysex(). returns
+ * the amount of events fetched (0 once the song is over), or
+ * MIDI_TRACKERROR. */
+int midi_streampull(struct midi_event *events, int max);
+
+/* copies the sysex string of a streamed sysex event into buff, just like
+ * midi_packsysex() does. returns the length of the sysex string. */
+unsigned int midi_streamsysex(long sysexptr, unsigned char *buff);
+
 #endif
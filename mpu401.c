@@ -65,12 +65,12 @@ void mpu401_waitwrite(int mpuport) {
 static int mpu401_waitwrite_timeout(int mpuport, long timeout) {
   int buff;
   unsigned long curtime, notafter;
-  timer_read(&notafter);
+  timer_readreal(&notafter);
   notafter += timeout;
   for (;;) {
     buff = inp(MPU_STAT);
     if ((buff & 0x40) == 0) return(0);
-    timer_read(&curtime);
+    timer_readreal(&curtime);
     if (curtime >= notafter) return(-1);
   }
 }
@@ -97,14 +97,14 @@ int mpu401_rst(int mpuport) {
   if (mpu401_waitwrite_timeout(mpuport, 2000000l) != 0) return(-1);  /* wait for the MPU to accept bytes from us */
   outp(MPU_STAT, 0xFF); /* Send MPU-401 RESET Command */
   /* note that some cards do not ACK on 0xFF ! that's why I should wait for a timeout here, and skip waiting if no answer after 1 or 2s */
-  timer_read(&timeout);
+  timer_readreal(&timeout);
   timeout += 2000000l; /* timeout is 2s */
   for (;;) {
     /* wait for the MPU to hand a byte to us (we are waiting for an ACK) */
     if (mpu401_poll(mpuport) != 0) {
       if (inp(MPU_DATA) == 0xFE) break; /* if we got the ACK, continue */
     }
-    timer_read(&curtime);
+    timer_readreal(&curtime);
     if (curtime >= timeout) break;
   }
   mpu401_flush(mpuport);
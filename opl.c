@@ -32,6 +32,7 @@
 #include "defines.h"
 #ifdef MSDOS
 #include <conio.h> /* inp(), out() */
+#include <malloc.h> /* _fmalloc(), _ffree() */
 #else
 #include "unixpio.h"
 #endif
@@ -39,6 +40,7 @@
 #include <stdlib.h> /* calloc() */
 #include <string.h> /* strdup() */
 #include "opl.h"
+#include "bitfield.h"
 #include "fio.h"
 #include "opl-gm.h"
 #include "timer.h"
@@ -46,20 +48,59 @@
 #include "lpt.h"
 #endif
 
+/* the voices are kept in circular doubly-linked lists, so they can be
+ * allocated and released without scanning them all. every voice is either
+ * in the list of idle voices or in the list of voices sounding on its
+ * channel (LIST_MAIN), and an idle voice is also in the list of the idle
+ * voices holding its timbre, if any (LIST_TIMBRE). lists are ordered from
+ * their oldest member to the newest. */
+#define LIST_MAIN   0
+#define LIST_TIMBRE 1
+
 struct voicealloc {
-  unsigned short priority;
   signed short timbreid;
   signed char channel;
   signed char note;
+  unsigned char velocity;
+  signed char prev[2]; /* neighbours in the lists, as voice numbers */
+  signed char next[2];
+};
+
+/* the 128 notes play 19 frequencies: those of the 19 first notes, then the
+ * 12 last of them again, an octave higher each time (see freqtable) */
+#define FREQROWS 19
+
+/* register writes queued until opl_flush() */
+#define OPL_QUEUE 128
+#define OPL_NOREG 0xffff /* marks a queued write superseded by a later one */
+
+struct oplwrite {
+  unsigned short reg;
+  unsigned char data;
 };
 
 struct oplstate {
   signed char notes2voices[16][128];    /* keeps the map of channel:notes -> voice allocations */
-  unsigned short channelpitch[16];      /* per-channel pitch level */
+  signed short channelpitch[16];        /* per-channel pitch wheel (-128..127) */
   unsigned short channelvol[16];        /* per-channel pitch level */
   struct voicealloc voices2notes[18]; /* keeps the map of what voice is playing what note/channel currently */
+  signed char idlevoices;               /* idle voices, released the longest ago first */
+  signed char chanvoices[16];           /* voices sounding on each channel, oldest note first */
+  signed char timbrevoices[256];        /* idle voices holding each timbre */
+  unsigned long steals;                 /* notes cut to free a voice for another one */
   unsigned char channelprog[16];        /* programs (patches) assigned to channels */
   unsigned char *channelenable;
+  unsigned short far *fnums;            /* F-number of each frequency row at each pitch, with the octave carry in bit 10 */
+  unsigned char far *levels;            /* carrier attenuation for each base attenuation at each volume */
+  unsigned char freqrows[128];          /* frequency row of each note */
+  unsigned char regs[512];              /* last values written to the OPL registers */
+  unsigned char regknown[64];           /* bit field of registers written at least once */
+  struct oplwrite queue[OPL_QUEUE];     /* register writes waiting for opl_flush() */
+  unsigned short queuepos[512];         /* position+1 of each register in queue, 0 if none */
+  int queuelen;
+  unsigned long writes;                 /* register writes sent to the chip */
+  unsigned long skipped;                /* register writes skipped for being redundant */
+  unsigned long bursts;                 /* opl_flush() calls that had anything to write */
 #if !defined MSDOS && defined OPLLPT
   int fd;
 #endif
@@ -148,6 +189,13 @@ static int voicescount = 9;
 #define pdelay(port, ncycles) abort()
 #endif
 
+#ifndef MSDOS
+/* real time at the end of the last write_opl(), and the time the chip needs
+ * after it before it can take the next write */
+static unsigned long lastwrite;
+static unsigned int lastwritedelay;
+#endif
+
 /* function used to write into a register 'reg' of the OPL chip located at
  * port 'port', writing byte 'data' into it. this function supports also OPL3.
  * to write into the secondary address of an OPL3, just OR your register with
@@ -162,6 +210,15 @@ static void write_opl(
  int is_opllpt,
 #endif
  unsigned short int reg, unsigned char data) {
+#ifndef MSDOS
+  if(fd != 1) {
+    /* wait for whatever is left of the time the chip needs after the
+     * previous write - often nothing, when writes are far apart */
+    unsigned long now;
+    timer_readreal(&now);
+    if(now - lastwrite < lastwritedelay) udelay(lastwritedelay - (now - lastwrite));
+  }
+#endif
 #ifdef OPLLPT
   if(is_opllpt) {
 #ifndef MSDOS
@@ -199,8 +256,10 @@ static void write_opl(
   /* OPL2 requires 23us to pass before writing to the data port. AdLib
    * recommends reading 35 times from the index register to make time pass. */
 #ifndef MSDOS
-  if(fd != 1) udelay(is_opl3 ? 4 : 23);
-  else
+  if(fd != 1) {
+    timer_readreal(&lastwrite);
+    lastwritedelay = is_opl3 ? 4 : 23;
+  } else
 #endif
   pdelay(port, is_opl3 ? 6 : 35);
 }
@@ -217,28 +276,116 @@ static void write_opl(
 #define WRITE_OPL_PROBE(PORT,REG,VALUE) write_opl((PORT), 0, (REG), (VALUE))
 #endif
 
-/* 'volume' is in range 0..127 - take care to change only the 'attenuation'
- * part of the register, and never touch the KSL bits */
-static void calc_vol(unsigned char *regbyte, int volume) {
-  int level;
-  /* invert bits and strip out the KSL header */
-  level = ~(*regbyte);
-  level &= 0x3f;
+/* queues the write of 'data' into register 'reg' of the OPL, for the next
+ * opl_flush(). a register written twice before that gets only the second
+ * value, and writes of the value the register holds already are skipped:
+ * every write costs tens of microseconds (and several ioctl calls on an
+ * OPL2LPT), while many of them rewrite the same value. */
+static void opl_write(unsigned short int reg, unsigned char data) {
+  struct oplwrite *w;
+  if (oplmem->queuepos[reg] != 0) {
+    w = oplmem->queue + oplmem->queuepos[reg] - 1;
+    /* a key-on and a key-off of the same voice must both reach the chip:
+     * otherwise a note would not restart, or a note as short as nothing
+     * would not be heard at all. send the pending one first */
+    if (((reg & 0xff) >= 0xB0) && ((reg & 0xff) <= 0xB8) && (((data ^ w->data) & 0x20) != 0)) {
+      opl_flush();
+    } else {
+      /* the queued write is superseded, the register moves to the end of
+       * the queue so it still comes after the writes queued meanwhile */
+      w->reg = OPL_NOREG;
+      oplmem->queuepos[reg] = 0;
+      oplmem->skipped++;
+    }
+  }
+  if (oplmem->queuelen == OPL_QUEUE) opl_flush();
+  w = oplmem->queue + oplmem->queuelen;
+  w->reg = reg;
+  w->data = data;
+  oplmem->queuelen++;
+  oplmem->queuepos[reg] = oplmem->queuelen;
+}
+
+/* computes the tables that turn notes and pitches into OPL frequencies, and
+ * volumes into attenuations, so playing a note takes no multiplication nor
+ * division (costly on 8086 and 286 CPUs). returns 0 on success. */
+static int buildtables(void) {
+  unsigned long freq;
+  int row, pitch, level, volume;
+#ifdef MSDOS
+  oplmem->fnums = _fmalloc(FREQROWS * 256 * sizeof(unsigned short));
+  oplmem->levels = _fmalloc(64 * 128);
+#else
+  oplmem->fnums = malloc(FREQROWS * 256 * sizeof(unsigned short));
+  oplmem->levels = malloc(64 * 128);
+#endif
+  if ((oplmem->fnums == NULL) || (oplmem->levels == NULL)) return(-1);
+
+  for (row = 0; row < 128; row++) {
+    oplmem->freqrows[row] = (row < FREQROWS) ? row : 7 + (row - FREQROWS) % 12;
+  }
+
+  /* the pitch (-128..127) multiplies the frequency, which may then need the
+   * next octave */
+  for (row = 0; row < FREQROWS; row++) {
+    for (pitch = 0; pitch < 256; pitch++) {
+      freq = ((unsigned long)freqtable[row] * pitchtable[pitch]) >> 15;
+      if (freq >= 1024) freq = (freq >> 1) | 1024;
+      oplmem->fnums[(row << 8) | pitch] = freq;
+    }
+  }
+
+  /* 'volume' (0..127) scales the level of the carrier, that is the inverse
+   * of its attenuation (0..63) */
+  for (level = 0; level < 64; level++) {
+    for (volume = 0; volume < 128; volume++) {
+      oplmem->levels[(level << 7) | volume] = ((((~level) & 0x3f) * volume) / 127) ^ 0x3f;
+    }
+  }
+  return(0);
+}
+
+
+/* frees the tables allocated by buildtables() */
+static void freetables(void) {
+#ifdef MSDOS
+  if (oplmem->fnums != NULL) _ffree(oplmem->fnums);
+  if (oplmem->levels != NULL) _ffree(oplmem->levels);
+#else
+  free(oplmem->fnums);
+  free(oplmem->levels);
+#endif
+}
 
-  /* adjust volume */
-  level = (level * volume) / 127;
 
-  /* boundaries check */
-  if (level > 0x3f) level = 0x3f;
-  if (level < 0) level = 0;
+/* appends voice at the end of a list, whose first voice is *head (-1 if
+ * the list is empty) */
+static void voice_append(signed char *head, int voice, int list) {
+  struct voicealloc *v = oplmem->voices2notes;
+  if (*head < 0) {
+    v[voice].prev[list] = voice;
+    v[voice].next[list] = voice;
+    *head = voice;
+  } else {
+    int last = v[(int)*head].prev[list];
+    v[voice].prev[list] = last;
+    v[voice].next[list] = *head;
+    v[last].next[list] = voice;
+    v[(int)*head].prev[list] = voice;
+  }
+}
 
-  /* invert the bits, as expected by the OPL registers */
-  level = ~level;
-  level &= 0x3f;
 
-  /* final result computation */
-  *regbyte &= 0xC0;  /* zero out all attentuation bits */
-  *regbyte |= level; /* fill in the new attentuation value */
+/* removes voice from a list, whose first voice is *head */
+static void voice_unlink(signed char *head, int voice, int list) {
+  struct voicealloc *v = oplmem->voices2notes;
+  if (v[voice].next[list] == voice) {
+    *head = -1;
+    return;
+  }
+  v[(int)v[voice].prev[list]].next[list] = v[voice].next[list];
+  v[(int)v[voice].next[list]].prev[list] = v[voice].prev[list];
+  if (*head == voice) *head = v[voice].next[list];
 }
 
 
@@ -338,6 +485,12 @@ int opl_init(unsigned int port, int *gen, int flags) {
   /* init memory */
   oplmem = calloc(1, sizeof(struct oplstate));
   if (oplmem == NULL) return(-3);
+  if (buildtables() != 0) {
+    freetables();
+    free(oplmem);
+    oplmem = NULL;
+    return(-3);
+  }
 
 #if !defined MSDOS && defined OPLLPT
   if(flags & OPL_ON_LPT) {
@@ -360,29 +513,29 @@ int opl_init(unsigned int port, int *gen, int flags) {
 
   /* enable OPL3 (if detected) and put it into 36 operators mode */
   if (oplmem->opl3 != 0) {
-    WRITE_OPL(oplmem, 0x105, 1);  /* enable OPL3 mode (36 operators) */
-    WRITE_OPL(oplmem, 0x104, 0);  /* disable four-operator voices */
+    opl_write(0x105, 1);  /* enable OPL3 mode (36 operators) */
+    opl_write(0x104, 0);  /* disable four-operator voices */
     voicescount = 18;          /* OPL3 provides 18 melodic channels */
 
     /* Init the secondary OPL chip
      * NOTE: this I don't do anymore, it turns my Aztech Waverider mute! */
-    /* WRITE_OPL(oplmem, 0x101, 0x20); */ /* enable Waveform Select */
-    /* WRITE_OPL(oplmem, 0x108, 0x40); */ /* turn off CSW mode and activate FM synth mode */
-    /* WRITE_OPL(oplmem, 0x1BD, 0x00); */ /* set vibrato/tremolo depth to low, set melodic mode */
+    /* opl_write(0x101, 0x20); */ /* enable Waveform Select */
+    /* opl_write(0x108, 0x40); */ /* turn off CSW mode and activate FM synth mode */
+    /* opl_write(0x1BD, 0x00); */ /* set vibrato/tremolo depth to low, set melodic mode */
 
     oplmem->channelenable = malloc(16);
   }
 
-  WRITE_OPL(oplmem, 0x01, 0x20);  /* enable Waveform Select */
-  WRITE_OPL(oplmem, 0x04, 0x00);  /* turn off timers IRQs */
-  WRITE_OPL(oplmem, 0x08, 0x40);  /* turn off CSW mode and activate FM synth mode */
-  WRITE_OPL(oplmem, 0xBD, 0x00);  /* set vibrato/tremolo depth to low, set melodic mode */
+  opl_write(0x01, 0x20);  /* enable Waveform Select */
+  opl_write(0x04, 0x00);  /* turn off timers IRQs */
+  opl_write(0x08, 0x40);  /* turn off CSW mode and activate FM synth mode */
+  opl_write(0xBD, 0x00);  /* set vibrato/tremolo depth to low, set melodic mode */
 
   for (x = 0; x < voicescount; x++) {
-    WRITE_OPL(oplmem, 0x20 + op1offsets[x], 0x1);     /* set the modulator's multiple to 1 */
-    WRITE_OPL(oplmem, 0x20 + op2offsets[x], 0x1);     /* set the modulator's multiple to 1 */
-    WRITE_OPL(oplmem, 0x40 + op1offsets[x], 0x10);    /* set volume of all channels to about 40 dB */
-    WRITE_OPL(oplmem, 0x40 + op2offsets[x], 0x10);    /* set volume of all channels to about 40 dB */
+    opl_write(0x20 + op1offsets[x], 0x1);     /* set the modulator's multiple to 1 */
+    opl_write(0x20 + op2offsets[x], 0x1);     /* set the modulator's multiple to 1 */
+    opl_write(0x40 + op1offsets[x], 0x10);    /* set volume of all channels to about 40 dB */
+    opl_write(0x40 + op2offsets[x], 0x10);    /* set volume of all channels to about 40 dB */
   }
 
   opl_clear();
@@ -401,33 +554,71 @@ void opl_close() {
 
   /* set volume to lowest level on all voices */
   for (x = 0; x < voicescount; x++) {
-    WRITE_OPL(oplmem, 0x40 + op1offsets[x], 0x1f);
-    WRITE_OPL(oplmem, 0x40 + op2offsets[x], 0x1f);
+    opl_write(0x40 + op1offsets[x], 0x1f);
+    opl_write(0x40 + op2offsets[x], 0x1f);
   }
 
   /* if OPL3, switch the chip back into its default OPL2 mode */
-  if (oplmem->opl3 != 0) WRITE_OPL(oplmem, 0x105, 0);
+  if (oplmem->opl3 != 0) opl_write(0x105, 0);
+  opl_flush();
 
   /* free state memory */
+  freetables();
   free(oplmem->channelenable);
   free(oplmem);
   oplmem = NULL;
 }
 
 
+void opl_flush(void) {
+  struct oplwrite *w;
+  int i, n = 0;
+  for (i = 0; i < oplmem->queuelen; i++) {
+    w = oplmem->queue + i;
+    if (w->reg == OPL_NOREG) continue;
+    oplmem->queuepos[w->reg] = 0;
+    if (BIT_GET(oplmem->regknown, w->reg) && (oplmem->regs[w->reg] == w->data)) {
+      oplmem->skipped++;
+      continue;
+    }
+    oplmem->regs[w->reg] = w->data;
+    BIT_SET(oplmem->regknown, w->reg);
+    WRITE_OPL(oplmem, w->reg, w->data);
+    n++;
+  }
+  oplmem->queuelen = 0;
+  if (n != 0) {
+    oplmem->writes += n;
+    oplmem->bursts++;
+  }
+}
+
+
+void opl_getstats(struct oplstats *s) {
+  s->issued = oplmem->writes;
+  s->skipped = oplmem->skipped;
+  s->bursts = oplmem->bursts;
+  s->steals = oplmem->steals;
+}
+
+
 /* turns off all notes */
 void opl_clear() {
   int x, y;
   for (x = 0; x < voicescount; x++) opl_noteoff(x);
 
   /* reset the percussion bits at the 0xBD register */
-  WRITE_OPL(oplmem, 0xBD, 0);
+  opl_write(0xBD, 0);
 
   /* mark all voices as unused */
+  oplmem->idlevoices = -1;
+  memset(oplmem->chanvoices, -1, sizeof(oplmem->chanvoices));
+  memset(oplmem->timbrevoices, -1, sizeof(oplmem->timbrevoices));
   for (x = 0; x < voicescount; x++) {
     oplmem->voices2notes[x].channel = -1;
     oplmem->voices2notes[x].note = -1;
     oplmem->voices2notes[x].timbreid = -1;
+    voice_append(&oplmem->idlevoices, x, LIST_MAIN);
   }
 
   /* mark all notes as unallocated */
@@ -439,38 +630,36 @@ void opl_clear() {
    * per-channel volumes */
   for (x = 0; x < 16; x++) {
     opl_midi_changeprog(x, x);
+    oplmem->channelpitch[x] = 0;
     oplmem->channelvol[x] = 127;
     if(oplmem->channelenable) oplmem->channelenable[x] = 0x30;
   }
+
+  opl_flush();
 }
 
 
 void opl_noteoff(unsigned short int voice) {
   /* if voice is one of the OPL3 set, adjust it and route over secondary OPL port */
   if (voice >= 9) {
-    WRITE_OPL(oplmem, 0x1B0 + voice - 9, 0);
+    opl_write(0x1B0 + voice - 9, 0);
   } else {
-    WRITE_OPL(oplmem, 0xB0 + voice, 0);
+    opl_write(0xB0 + voice, 0);
   }
 }
 
 
 void opl_noteon(unsigned short int voice, unsigned int note, int pitch) {
-  unsigned int freq = freqtable[note];
-  unsigned int octave = octavetable[note];
-
-  if (pitch != 0) {
-    if (pitch > 127) {
-      pitch = 127;
-    } else if (pitch < -128) {
-      pitch = -128;
-    }
-    freq = ((unsigned long)freq * pitchtable[pitch + 128]) >> 15;
-    if (freq >= 1024) {
-      freq >>= 1;
-      octave++;
-    }
+  unsigned int freq, octave;
+
+  if (pitch > 127) {
+    pitch = 127;
+  } else if (pitch < -128) {
+    pitch = -128;
   }
+  freq = oplmem->fnums[(oplmem->freqrows[note] << 8) | (pitch + 128)];
+  octave = octavetable[note] + (freq >> 10);
+  freq &= 1023;
   if (octave > 7) octave = 7;
 
   /* if voice is one of the OPL3 set, adjust it and route over secondary OPL port */
@@ -479,21 +668,53 @@ void opl_noteon(unsigned short int voice, unsigned int note, int pitch) {
     voice |= 0x100;
   }
 
-  WRITE_OPL(oplmem, 0xA0 + voice, freq & 0xff); /* set lowfreq */
-  WRITE_OPL(oplmem, 0xB0 + voice, (freq >> 8) | (octave << 2) | 32); /* KEY ON + hifreq + octave */
+  opl_write(0xA0 + voice, freq & 0xff); /* set lowfreq */
+  opl_write(0xB0 + voice, (freq >> 8) | (octave << 2) | 32); /* KEY ON + hifreq + octave */
+}
+
+
+/* adjust the volume of the voice (in the usual MIDI range of 0..127) */
+static void voicevolume(unsigned short voice, int program, int volume) {
+  unsigned char carrierval = gmtimbres[program].carrier_40;
+  if (volume > 127) volume = 127;
+  /* change only the attenuation part of the register, never the KSL bits */
+  carrierval = (carrierval & 0xC0) | oplmem->levels[((carrierval & 0x3f) << 7) | volume];
+  opl_write(0x40 + op2offsets[voice], carrierval);
+}
+
+
+/* returns the voice that follows 'voice' among those sounding on channel,
+ * or -1 if it was the last one */
+static int chan_nextvoice(int channel, int voice) {
+  voice = oplmem->voices2notes[voice].next[LIST_MAIN];
+  if (voice == oplmem->chanvoices[channel]) return(-1);
+  return(voice);
+}
+
+
+/* tunes a sounding voice to its note, with the pitch wheel of its channel,
+ * and the 'finetune' pitch correction of its timbre */
+static void voicetune(int voice) {
+  struct voicealloc *v = oplmem->voices2notes + voice;
+  if (v->channel == 9) { /* percussion channel doesn't provide a real note, so I */
+                         /* use a static one (MUSPLAYER uses C-5 (60), why not.  */
+    opl_noteon(voice, 60, oplmem->channelpitch[9] + gmtimbres[v->timbreid].finetune);
+  } else {
+    opl_noteon(voice, v->note, oplmem->channelpitch[(int)v->channel] + gmtimbres[v->timbreid].finetune);
+  }
 }
 
 
 void opl_midi_pitchwheel(int channel, int pitchwheel) {
-  /*int x;*/
-  /* update the new pitch value for channel (used by newly played notes) */
-  oplmem->channelpitch[channel] = pitchwheel;
-  /* check all active voices to see who is playing on given channel now, and
-   * recompute all playing notes for this channel with the new pitch TODO */
-  /*for (x = 0; x < voicescount; x++) {
-    if (oplmem->voices2notes[x].channel != channel) continue;
-    opl_noteon(x, oplmem->voices2notes[x].note, pitchwheel + gmtimbres[oplmem->voices2notes[x].timbreid].finetune);
-  }*/
+  int voice;
+  /* update the new pitch value for channel: the wheel goes from 0 to 16383
+   * (centered on 8192), the OPL pitch table covers the usual range of +/- 2
+   * semitones in 256 steps */
+  oplmem->channelpitch[channel] = (pitchwheel >> 6) - 128;
+  /* retune the notes playing on the channel */
+  for (voice = oplmem->chanvoices[channel]; voice >= 0; voice = chan_nextvoice(channel, voice)) {
+    voicetune(voice);
+  }
 }
 
 
@@ -504,6 +725,10 @@ void opl_midi_controller(int channel, int id, int value) {
     case 7:
     case 11: /* "Expression" (meaning "channel volume") */
       oplmem->channelvol[channel] = value;
+      /* apply the new volume to the notes playing on the channel */
+      for (x = oplmem->chanvoices[channel]; x >= 0; x = chan_nextvoice(channel, x)) {
+        voicevolume(x, oplmem->voices2notes[x].timbreid, oplmem->voices2notes[x].velocity * value / 127);
+      }
       break;
     case 10: /* Pan */
       if(!oplmem->opl3) break;
@@ -521,9 +746,8 @@ void opl_midi_controller(int channel, int id, int value) {
       break;
     case 123: /* 'all notes off' */
     case 120: /* 'all sound off' - I map it to 'all notes off' for now, not perfect but better than not handling it at all */
-      for (x = 0; x < voicescount; x++) {
-        if (oplmem->voices2notes[x].channel != channel) continue;
-        opl_midi_noteoff(x, oplmem->voices2notes[x].note);
+      while (oplmem->chanvoices[channel] >= 0) {
+        opl_midi_noteoff(channel, oplmem->voices2notes[oplmem->chanvoices[channel]].note);
       }
       break;
   }
@@ -539,49 +763,36 @@ void opl_midi_changeprog(int channel, int program) {
 
 static void opl_loadinstrument(unsigned short int voice, const struct timbre *timbre, unsigned char channelenable) {
   /* KSL (key level scaling) / attenuation */
-  WRITE_OPL(oplmem, 0x40 + op1offsets[voice], timbre->modulator_40);
-  WRITE_OPL(oplmem, 0x40 + op2offsets[voice], timbre->carrier_40 | 0x3f); /* force volume to 0, it will be reajusted during 'note on' */
+  opl_write(0x40 + op1offsets[voice], timbre->modulator_40);
+  opl_write(0x40 + op2offsets[voice], timbre->carrier_40 | 0x3f); /* force volume to 0, it will be reajusted during 'note on' */
 
   /* select waveform on both operators */
-  WRITE_OPL(oplmem, 0xE0 + op1offsets[voice], timbre->modulator_E862 >> 24);
-  WRITE_OPL(oplmem, 0xE0 + op2offsets[voice], timbre->carrier_E862 >> 24);
+  opl_write(0xE0 + op1offsets[voice], timbre->modulator_E862 >> 24);
+  opl_write(0xE0 + op2offsets[voice], timbre->carrier_E862 >> 24);
 
   /* sustain / release */
-  WRITE_OPL(oplmem, 0x80 + op1offsets[voice], (timbre->modulator_E862 >> 16) & 0xff);
-  WRITE_OPL(oplmem, 0x80 + op2offsets[voice], (timbre->carrier_E862 >> 16) & 0xff);
+  opl_write(0x80 + op1offsets[voice], (timbre->modulator_E862 >> 16) & 0xff);
+  opl_write(0x80 + op2offsets[voice], (timbre->carrier_E862 >> 16) & 0xff);
 
   /* attack rate / decay */
-  WRITE_OPL(oplmem, 0x60 + op1offsets[voice], (timbre->modulator_E862 >> 8) & 0xff);
-  WRITE_OPL(oplmem, 0x60 + op2offsets[voice], (timbre->carrier_E862 >> 8) & 0xff);
+  opl_write(0x60 + op1offsets[voice], (timbre->modulator_E862 >> 8) & 0xff);
+  opl_write(0x60 + op2offsets[voice], (timbre->carrier_E862 >> 8) & 0xff);
 
   /* AM / vibrato / envelope */
-  WRITE_OPL(oplmem, 0x20 + op1offsets[voice], timbre->modulator_E862 & 0xff);
-  WRITE_OPL(oplmem, 0x20 + op2offsets[voice], timbre->carrier_E862 & 0xff);
+  opl_write(0x20 + op1offsets[voice], timbre->modulator_E862 & 0xff);
+  opl_write(0x20 + op2offsets[voice], timbre->carrier_E862 & 0xff);
 
   /* feedback / connection */
   if (voice >= 9) {
     voice -= 9;
     voice |= 0x100;
   }
-  WRITE_OPL(oplmem, 0xC0 + voice, timbre->feedconn | channelenable);
-}
-
-
-/* adjust the volume of the voice (in the usual MIDI range of 0..127) */
-static void voicevolume(unsigned short voice, int program, int volume) {
-  unsigned char carrierval = gmtimbres[program].carrier_40;
-  if (volume == 0) {
-    carrierval |= 0x3f;
-  } else {
-    calc_vol(&carrierval, volume);
-  }
-  WRITE_OPL(oplmem, 0x40 + op2offsets[voice], carrierval);
+  opl_write(0xC0 + voice, timbre->feedconn | channelenable);
 }
 
 
 void opl_midi_noteon(int channel, int note, int velocity) {
-  int x, voice = -1;
-  int lowestpriorityvoice = 0;
+  int x, voice;
   int instrument;
 
   /* get the instrument to play */
@@ -591,22 +802,23 @@ void opl_midi_noteon(int channel, int note, int velocity) {
   /* if note already playing, then reuse its voice to avoid leaving a stuck voice */
   if (oplmem->notes2voices[channel][note] >= 0) {
     voice = oplmem->notes2voices[channel][note];
+    voice_unlink(&oplmem->chanvoices[channel], voice, LIST_MAIN);
   } else {
-    /* else find a free voice, possibly with the right timbre, or at least locate the oldest note */
-    for (x = 0; x < voicescount; x++) {
-      if (oplmem->voices2notes[x].channel < 0) {
-        voice = x; /* preselect this voice, but continue looking */
-        /* if the instrument is right, do not look further */
-        if (oplmem->voices2notes[x].timbreid == instrument) {
-          break;
-        }
-      }
-      if (oplmem->voices2notes[x].priority < oplmem->voices2notes[lowestpriorityvoice].priority) lowestpriorityvoice = x;
-    }
-    /* if no free voice available, then abort the oldest one */
+    /* else take the idle voice released the longest ago, preferably one
+     * that holds the right timbre already */
+    voice = oplmem->timbrevoices[instrument];
+    if (voice < 0) voice = oplmem->idlevoices;
+    /* if no voice is idle, cut the oldest note of the least important
+     * channel (lower channels have priority) */
     if (voice < 0) {
-      voice = lowestpriorityvoice;
-      opl_midi_noteoff(oplmem->voices2notes[voice].channel, oplmem->voices2notes[voice].note);
+      for (x = 15; oplmem->chanvoices[x] < 0; x--);
+      voice = oplmem->chanvoices[x];
+      opl_midi_noteoff(x, oplmem->voices2notes[voice].note);
+      oplmem->steals++;
+    }
+    voice_unlink(&oplmem->idlevoices, voice, LIST_MAIN);
+    if (oplmem->voices2notes[voice].timbreid >= 0) {
+      voice_unlink(&oplmem->timbrevoices[oplmem->voices2notes[voice].timbreid], voice, LIST_TIMBRE);
     }
   }
 
@@ -621,24 +833,15 @@ void opl_midi_noteon(int channel, int note, int velocity) {
   /* update states */
   oplmem->voices2notes[voice].channel = channel;
   oplmem->voices2notes[voice].note = note;
-  oplmem->voices2notes[voice].priority = ((16 - channel) << 8) | 0xff; /* lower channels must have priority */
+  oplmem->voices2notes[voice].velocity = velocity;
   oplmem->notes2voices[channel][note] = voice;
+  voice_append(&oplmem->chanvoices[channel], voice, LIST_MAIN);
 
   /* set the requested velocity on the voice */
   voicevolume(voice, oplmem->voices2notes[voice].timbreid, velocity * oplmem->channelvol[channel] / 127);
 
-  /* trigger NOTE_ON on the OPL, take care to apply the 'finetune' pitch correction, too */
-  if (channel == 9) { /* percussion channel doesn't provide a real note, so I */
-                      /* use a static one (MUSPLAYER uses C-5 (60), why not.  */
-    opl_noteon(voice, 60, oplmem->channelpitch[channel] + gmtimbres[instrument].finetune);
-  } else {
-    opl_noteon(voice, note, oplmem->channelpitch[channel] + gmtimbres[instrument].finetune);
-  }
-
-  /* reajust all priorities */
-  for (x = 0; x < voicescount; x++) {
-    if (oplmem->voices2notes[x].priority > 0) oplmem->voices2notes[x].priority -= 1;
-  }
+  /* trigger NOTE_ON on the OPL */
+  voicetune(voice);
 }
 
 
@@ -649,8 +852,13 @@ void opl_midi_noteoff(int channel, int note) {
       opl_noteoff(voice);
       oplmem->voices2notes[voice].channel = -1;
       oplmem->voices2notes[voice].note = -1;
-      oplmem->voices2notes[voice].priority = -1;
       oplmem->notes2voices[channel][note] = -1;
+      /* the voice is idle now, the newest of the idle ones */
+      voice_unlink(&oplmem->chanvoices[channel], voice, LIST_MAIN);
+      voice_append(&oplmem->idlevoices, voice, LIST_MAIN);
+      if (oplmem->voices2notes[voice].timbreid >= 0) {
+        voice_append(&oplmem->timbrevoices[oplmem->voices2notes[voice].timbreid], voice, LIST_TIMBRE);
+      }
     }
   }
 }
@@ -72,6 +72,24 @@ void opl_close(void);
 /* turns off all notes */
 void opl_clear(void);
 
+/* sends to the chip the register writes queued by the other functions. the
+ * opl_midi_* functions only queue their writes, so this must be called
+ * once they are done with the events due at a given time */
+void opl_flush(void);
+
+/* counters of the OPL activity since opl_init() */
+struct oplstats {
+  unsigned long issued;  /* register writes sent to the chip */
+  unsigned long skipped; /* register writes skipped because the register held
+                            the value already, or got another one before
+                            opl_flush() */
+  unsigned long bursts;  /* opl_flush() calls that had anything to send */
+  unsigned long steals;  /* notes cut short to free a voice for another one */
+};
+
+/* fills 's' with the counters of the OPL activity since opl_init() */
+void opl_getstats(struct oplstats *s);
+
 /* turn note 'on', on emulated MIDI channel */
 void opl_midi_noteon(int channel, int note, int velocity);
 
@@ -79,6 +79,43 @@ static unsigned short int outport = 0;
 static int outport_is_lpt = 0;
 #ifndef MSDOS
 static int out_fd = -1;
+
+/* between dev_hold() and dev_flush(), bytes sent to out_fd are collected in
+ * outbuf, so a whole chord goes out with a single write() */
+#define OUTBUFSIZE 1024
+static unsigned char outbuf[OUTBUFSIZE];
+static unsigned int outbuflen = 0;
+static int outhold = 0;
+
+/* writes len bytes of buf to out_fd, even if it takes several write() */
+static void out_writefd(const unsigned char *buf, unsigned int len) {
+  ssize_t n;
+  while (len > 0) {
+    n = write(out_fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+/* sends len bytes of buf to out_fd, or keeps them in outbuf if held */
+static void out_write(const unsigned char *buf, unsigned int len) {
+  if (outhold != 0) {
+    if (outbuflen + len > OUTBUFSIZE) {
+      out_writefd(outbuf, outbuflen);
+      outbuflen = 0;
+    }
+    if (len <= OUTBUFSIZE) {
+      memcpy(outbuf + outbuflen, buf, len);
+      outbuflen += len;
+      return;
+    }
+  }
+  out_writefd(buf, len);
+}
 #endif
 
 /* loads a SBK sound font to AWE hardware */
@@ -327,6 +364,7 @@ enum outdev_type dev_getcurdev(void) {
 
 /* close/deinitializes the out device */
 void dev_close(void) {
+  dev_flush();
   switch (outdev) {
 #ifdef HAVE_PORT_IO
     case DEV_MPU401:
@@ -395,6 +433,7 @@ void dev_close(void) {
  * often (typically: after each song) */
 void dev_clear(int flags) {
   int i;
+  dev_flush(); /* the reset must not wait behind held messages */
   /* iterate on MIDI channels and send 'off' messages */
   for (i = 0; i < 16; i++) {
     dev_controller(i, 123, 0);   /* "all notes off" */
@@ -480,7 +519,7 @@ void dev_noteon(int channel, int note, int velocity) {
       buffer[0] = 0x90 | channel;
       buffer[1] = note;
       buffer[2] = velocity;
-      write(out_fd, buffer, 3);
+      out_write(buffer, 3);
 #endif
       break;
 #ifdef HAVE_PORT_IO
@@ -548,7 +587,7 @@ void dev_noteoff(int channel, int note) {
       buffer[0] = 0x80 | channel;
       buffer[1] = note;
       buffer[2] = 64;
-      write(out_fd, buffer, 3);
+      out_write(buffer, 3);
 #endif
       break;
 #ifdef HAVE_PORT_IO
@@ -616,7 +655,7 @@ void dev_pitchwheel(int channel, int wheelvalue) {
       buffer[0] = 0xE0 | channel;
       buffer[1] = wheelvalue & 127;
       buffer[2] = wheelvalue >> 7;
-      write(out_fd, buffer, 3);
+      out_write(buffer, 3);
 #endif
       break;
 #ifdef HAVE_PORT_IO
@@ -684,7 +723,7 @@ void dev_controller(int channel, int id, int val) {
       buffer[0] = 0xB0 | channel;
       buffer[1] = id;
       buffer[2] = val;
-      write(out_fd, buffer, 3);
+      out_write(buffer, 3);
 #endif
       break;
 #ifdef HAVE_PORT_IO
@@ -742,7 +781,7 @@ void dev_chanpressure(int channel, int pressure) {
 #else
       buffer[0] = 0xD0 | channel;
       buffer[1] = pressure;
-      write(out_fd, buffer, 2);
+      out_write(buffer, 2);
 #endif
       break;
 #ifdef HAVE_PORT_IO
@@ -801,7 +840,7 @@ void dev_keypressure(int channel, int note, int pressure) {
       buffer[0] = 0xA0 | channel;
       buffer[1] = note;
       buffer[2] = pressure;
-      write(out_fd, buffer, 3);
+      out_write(buffer, 3);
 #endif
       break;
 #ifdef HAVE_PORT_IO
@@ -870,6 +909,29 @@ void dev_tick(void) {
 }
 
 
+/* holds back messages of devices that can send several at once */
+void dev_hold(void) {
+#ifndef MSDOS
+  outhold = 1;
+#endif
+}
+
+
+/* sends the messages held back since dev_hold(), and the queued OPL writes */
+void dev_flush(void) {
+#ifdef OPL
+  if ((outdev == DEV_OPL) || (outdev == DEV_OPL2) || (outdev == DEV_OPL3)) opl_flush();
+#endif
+#ifndef MSDOS
+  if (outbuflen != 0) {
+    out_writefd(outbuf, outbuflen);
+    outbuflen = 0;
+  }
+  outhold = 0;
+#endif
+}
+
+
 /* sets a "program" (meaning an instrument) on a channel */
 void dev_setprog(int channel, int program) {
   switch (outdev) {
@@ -903,7 +965,7 @@ void dev_setprog(int channel, int program) {
 #else
       buffer[0] = 0xC0 | channel;
       buffer[1] = program;
-      write(out_fd, buffer, 2);
+      out_write(buffer, 2);
 #endif
       break;
 #ifdef HAVE_PORT_IO
@@ -959,7 +1021,7 @@ void dev_sysex(int channel, unsigned char *buff, int bufflen) {
         rs232_write(outport, buff[x]);      /* Send sysex data byte */
       }
 #else
-      write(out_fd, buff, bufflen);
+      out_write(buff, bufflen);
 #endif
       break;
 #ifdef HAVE_PORT_IO
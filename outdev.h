@@ -108,6 +108,16 @@ void dev_keypressure(int channel, int note, int pressure);
 /* should be called by the application from time to time */
 void dev_tick(void);
 
+/* from now on, holds back the messages sent to devices that can send many
+ * at once (so far, serial ports on unix), until dev_flush() is called. this
+ * is meant for all the events due at the same time. */
+void dev_hold(void);
+
+/* sends at once the messages held back since dev_hold(), and the register
+ * writes queued by OPL devices. to be called once the events due at a given
+ * time are sent */
+void dev_flush(void);
+
 /* sets a "program" (meaning an instrument) on a channel */
 void dev_setprog(int channel, int program);
 
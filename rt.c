@@ -0,0 +1,95 @@
+/*
+ * Real-time helpers for the unix version of DOSMid: lock-free rings to pass
+ * messages between two threads, and scheduling of the playback thread
+ * This file is part of the DOSMid project.
+ *
+ * The rings rely on the __atomic builtins of gcc and clang: the writer
+ * publishes an item by storing the head with release semantics once the
+ * item is written, and the reader frees a slot by storing the tail the same
+ * way once the item is read. Head and tail only ever grow (wrapping around
+ * UINT_MAX), so the ring is full when they are mask + 1 apart.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* CPU_SET(), sched_setaffinity() */
+#endif
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>  /* malloc(), free() */
+#include <string.h>  /* memcpy() */
+#include <unistd.h>  /* sysconf() */
+
+#include "rt.h" /* include self for control */
+
+
+int ring_init(struct ring *r, unsigned int itemsize, unsigned int count) {
+  r->head = 0;
+  r->tail = 0;
+  r->mask = count - 1;
+  r->itemsize = itemsize;
+  r->items = malloc((size_t)itemsize * count);
+  if (r->items == NULL) return(-1);
+  return(0);
+}
+
+
+int ring_put(struct ring *r, const void *item) {
+  unsigned int head = r->head;
+  if (head - __atomic_load_n(&(r->tail), __ATOMIC_ACQUIRE) > r->mask) return(-1);
+  memcpy(r->items + (size_t)(head & r->mask) * r->itemsize, item, r->itemsize);
+  __atomic_store_n(&(r->head), head + 1, __ATOMIC_RELEASE);
+  return(0);
+}
+
+
+int ring_get(struct ring *r, void *item) {
+  unsigned int tail = r->tail;
+  if (__atomic_load_n(&(r->head), __ATOMIC_ACQUIRE) == tail) return(-1);
+  memcpy(item, r->items + (size_t)(tail & r->mask) * r->itemsize, r->itemsize);
+  __atomic_store_n(&(r->tail), tail + 1, __ATOMIC_RELEASE);
+  return(0);
+}
+
+
+void ring_free(struct ring *r) {
+  free(r->items);
+  r->items = NULL;
+}
+
+
+int rt_setsched(int prio, int cpu) {
+  int res = 0;
+  if (prio > 0) {
+    struct sched_param sp;
+    memset(&sp, 0, sizeof(sp));
+    sp.sched_priority = prio;
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) != 0) res = -1;
+  }
+#ifdef __linux__
+  if (cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) res = -1;
+  }
+#endif
+  return(res);
+}
+
+
+void rt_unsetsched(int cpu) {
+  struct sched_param sp;
+  memset(&sp, 0, sizeof(sp));
+  pthread_setschedparam(pthread_self(), SCHED_OTHER, &sp);
+#ifdef __linux__
+  if (cpu >= 0) {
+    cpu_set_t set;
+    long i, n = sysconf(_SC_NPROCESSORS_ONLN);
+    CPU_ZERO(&set);
+    for (i = 0; (i < n) && (i < CPU_SETSIZE); i++) {
+      if ((i != cpu) || (n == 1)) CPU_SET(i, &set);
+    }
+    sched_setaffinity(0, sizeof(set), &set);
+  }
+#endif
+}
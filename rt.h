@@ -0,0 +1,44 @@
+/*
+ * Real-time helpers for the unix version of DOSMid: lock-free rings to pass
+ * messages between two threads, and scheduling of the playback thread
+ * This file is part of the DOSMid project.
+ */
+
+#ifndef RT_H_SENTINEL
+#define RT_H_SENTINEL
+
+/* a ring of fixed-size items, written by a single thread and read by a
+ * single other thread, without any lock */
+struct ring {
+  unsigned int head;      /* where the next item is written (writer only) */
+  unsigned int tail;      /* where the next item is read (reader only) */
+  unsigned int mask;      /* number of items - 1 */
+  unsigned int itemsize;
+  unsigned char *items;
+};
+
+/* allocates a ring of count items of itemsize bytes each, count being a
+ * power of 2. returns 0 on success, non-zero otherwise. */
+int ring_init(struct ring *r, unsigned int itemsize, unsigned int count);
+
+/* copies item at the head of the ring. returns 0 on success, non-zero if
+ * the ring is full. */
+int ring_put(struct ring *r, const void *item);
+
+/* copies the item at the tail of the ring into item, and removes it from the
+ * ring. returns 0 on success, non-zero if the ring is empty. */
+int ring_get(struct ring *r, void *item);
+
+/* frees the memory of the ring */
+void ring_free(struct ring *r);
+
+/* gives the calling thread the real-time priority prio (SCHED_FIFO, if prio
+ * is not 0) and binds it to cpu (if cpu is not negative, linux only).
+ * returns 0 on success, non-zero otherwise. */
+int rt_setsched(int prio, int cpu);
+
+/* undoes rt_setsched() for a thread started by the thread it was applied
+ * to, so it runs as a normal thread on any cpu but cpu */
+void rt_unsetsched(int cpu);
+
+#endif
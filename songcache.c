@@ -0,0 +1,313 @@
+/*
+ * On-disk cache of pre-parsed songs, for instant reloads of MIDI files
+ * This file is part of the DOSMid project.
+ *
+ * Every song is cached in a file of its own, named after a hash of the
+ * song's path (so names fit in 8.3). It is made of a 64-bytes header:
+ *   offset 0: "DMC" and the version of the format (1)
+ *   offset 4: size of the song file
+ *   offset 8: time of the last modification of the song file
+ *   offset 12: length of the song, in seconds
+ *   offset 16: length of the packed event stream
+ *   offset 20: channels usage (2 bytes)
+ *   offset 22: time unit divisor (2 bytes)
+ *   offset 24: tracks count (2 bytes)
+ *   offset 26: MIDI format (1 byte)
+ *   offset 28: titles count (1 byte)
+ *   offset 29: length of the path of the song file (2 bytes)
+ *   offset 32: bit field of the patches used by the song (32 bytes)
+ * all values being little-endian and 4 bytes long unless noted otherwise.
+ * The header is followed by the path of the song file, its titles, and its
+ * packed event stream.
+ *
+ * On unix, the last songs played are also kept in memory (see
+ * songcache_recall()).
+ */
+
+#include "defines.h"
+#include <stdio.h>   /* sprintf() */
+#ifndef MSDOS
+#include <stdlib.h>  /* malloc(), free() */
+#endif
+#include <string.h>  /* memcpy(), strlen() */
+
+#include "fio.h"
+#include "mem.h"
+#include "midi.h"
+#include "ui.h"
+#include "songcache.h" /* include self for control */
+
+#define HDRLEN 64
+#define MAXPATH 1024 /* songs with longer paths are never cached */
+
+extern unsigned char wbuff[];
+
+
+static void putle(unsigned char *buff, unsigned long v, int bytes) {
+  while (bytes-- > 0) {
+    *(buff++) = v & 0xff;
+    v >>= 8;
+  }
+}
+
+
+static unsigned long getle(const unsigned char *buff, int bytes) {
+  unsigned long res = 0;
+  while (bytes-- > 0) res = (res << 8) | buff[bytes];
+  return(res);
+}
+
+
+/* computes the name of the cache file of songfile into fname (of fnamelen
+ * bytes). returns 0 on success, non-zero if it does not fit. */
+static int cachefname(char *fname, int fnamelen, const char *dir, const char *songfile) {
+  unsigned long hash = 2166136261lu; /* 32-bit FNV-1a */
+  int len = strlen(dir);
+  if (len + 14 > fnamelen) return(-1);
+  for (; *songfile != 0; songfile++) {
+    hash ^= (unsigned char)*songfile;
+    hash *= 16777619lu;
+    hash &= 0xfffffffflu;
+  }
+  memcpy(fname, dir, len);
+#ifdef MSDOS
+  if ((len > 0) && (fname[len - 1] != '\\') && (fname[len - 1] != ':')) fname[len++] = '\\';
+#else
+  if ((len > 0) && (fname[len - 1] != '/')) fname[len++] = '/';
+#endif
+  sprintf(fname + len, "%08lX.DMC", hash);
+  return(0);
+}
+
+
+long songcache_load(const char *dir, const char *songfile, struct fiofile *f, struct trackinfodata *trackinfo, struct songkey *key) {
+  char fname[160];
+  unsigned char hdr[HDRLEN];
+  struct fiofile c;
+  unsigned int pathlen, titlescount, i;
+  long res;
+
+  key->size = f->flen;
+  key->mtime = fio_mtime(f);
+  key->hit = 0;
+  key->kept = 0;
+  if (cachefname(fname, sizeof(fname), dir, songfile) != 0) return(-1);
+  if (fio_open(fname, FIO_OPEN_RD, &c) != 0) return(-1);
+  /* validate the header against the song file */
+  pathlen = strlen(songfile);
+  if ((fio_read(&c, hdr, HDRLEN) != HDRLEN) || (memcmp(hdr, "DMC\1", 4) != 0)
+   || (getle(hdr + 4, 4) != key->size) || (getle(hdr + 8, 4) != key->mtime)
+   || (getle(hdr + 29, 2) != pathlen) || (hdr[28] > UI_TITLENODES)) {
+    fio_close(&c);
+    return(-1);
+  }
+  titlescount = hdr[28];
+  /* path and titles go through wbuff before being accepted */
+  i = pathlen + titlescount * UI_TITLEMAXLEN;
+  if ((pathlen > MAXPATH) || (fio_read(&c, wbuff, i) != (int)i) || (memcmp(wbuff, songfile, pathlen) != 0)) {
+    fio_close(&c);
+    return(-1);
+  }
+  memcpy(trackinfo->title, wbuff + pathlen, titlescount * UI_TITLEMAXLEN);
+  res = midi_packload(&c, getle(hdr + 16, 4));
+  fio_close(&c);
+  if (res < 0) return(-1);
+  trackinfo->titlescount = titlescount;
+  trackinfo->totlen = getle(hdr + 12, 4);
+  trackinfo->channelsusage = getle(hdr + 20, 2);
+  trackinfo->miditimeunitdiv = getle(hdr + 22, 2);
+  trackinfo->trackscount = getle(hdr + 24, 2);
+  trackinfo->midiformat = hdr[26];
+  memcpy(trackinfo->reqpatches, hdr + 32, 32);
+  trackinfo->usdeltas = 1;
+  trackinfo->layout = MIDI_LAYOUT_PACKED;
+  key->hit = 1;
+  return(res);
+}
+
+
+int songcache_save(const char *dir, const char *songfile, const struct songkey *key, const struct trackinfodata *trackinfo, long trackpos) {
+  char fname[160];
+  unsigned char hdr[HDRLEN];
+  struct fiofile c;
+  unsigned int pathlen = strlen(songfile);
+  unsigned int titleslen = trackinfo->titlescount * UI_TITLEMAXLEN;
+  long songlen;
+
+  if ((trackpos < 0) || (pathlen > MAXPATH)) return(-1);
+  if (cachefname(fname, sizeof(fname), dir, songfile) != 0) return(-1);
+  memset(hdr, 0, HDRLEN);
+  memcpy(hdr, "DMC\1", 4);
+  putle(hdr + 4, key->size, 4);
+  putle(hdr + 8, key->mtime, 4);
+  putle(hdr + 12, trackinfo->totlen, 4);
+  /* the stream length is left to 0 until the whole file is written, so an
+   * interrupted write never leaves a valid-looking cache file */
+  putle(hdr + 20, trackinfo->channelsusage, 2);
+  putle(hdr + 22, trackinfo->miditimeunitdiv, 2);
+  putle(hdr + 24, trackinfo->trackscount, 2);
+  hdr[26] = trackinfo->midiformat;
+  hdr[28] = trackinfo->titlescount;
+  putle(hdr + 29, pathlen, 2);
+  memcpy(hdr + 32, trackinfo->reqpatches, 32);
+  if (fio_create(fname, &c) != 0) return(-1);
+  if ((fio_write(&c, hdr, HDRLEN) != HDRLEN)
+   || (fio_write(&c, songfile, pathlen) != (int)pathlen)
+   || (fio_write(&c, trackinfo->title, titleslen) != (int)titleslen)) {
+    fio_close(&c);
+    return(-1);
+  }
+  songlen = midi_packsave(trackpos, &c);
+  if (songlen > 0) {
+    putle(hdr + 16, songlen, 4);
+    fio_seek(&c, FIO_SEEK_START, 0);
+    if (fio_write(&c, hdr, HDRLEN) != HDRLEN) songlen = -1;
+  }
+  fio_close(&c);
+  return((songlen > 0) ? 0 : -1);
+}
+
+
+#ifndef MSDOS
+
+/* SONGS KEPT IN MEMORY
+ *
+ * Every song kept is a copy of the whole memory it was loaded in, along with
+ * its trackinfo. It is restored at the very same addresses, so it does not
+ * matter how its events are laid out. */
+
+#define MEMSONGS 16     /* how many songs can be kept at most */
+#define MEMCOPYLEN 32768 /* songs are copied by blocks of that many bytes */
+
+struct memsong {
+  char *path;          /* path of the song file, NULL if the slot is free */
+  struct songkey key;
+  long trackpos;       /* first event of the song */
+  unsigned long len;   /* how much memory the song was loaded in */
+  unsigned char *data; /* copy of that memory */
+  unsigned long lastuse;
+  struct trackinfodata trackinfo;
+};
+
+static struct memsong memsongs[MEMSONGS];
+static unsigned long membudget = 0;  /* bytes songs may take altogether */
+static unsigned long memtaken = 0;   /* bytes taken by the songs kept */
+static unsigned long memclock = 0;   /* incremented on every use of a song */
+unsigned long songcache_hits = 0;
+unsigned long songcache_misses = 0;
+
+
+static void memsong_free(struct memsong *s) {
+  if (s->path == NULL) return;
+  memtaken -= s->len + sizeof(struct memsong);
+  free(s->path);
+  free(s->data);
+  s->path = NULL;
+}
+
+
+static struct memsong *memsong_find(const char *songfile) {
+  int i;
+  for (i = 0; i < MEMSONGS; i++) {
+    if ((memsongs[i].path != NULL) && (strcmp(memsongs[i].path, songfile) == 0)) return(memsongs + i);
+  }
+  return(NULL);
+}
+
+
+void songcache_setbudget(unsigned long kb) {
+  int i;
+  membudget = kb << 10;
+  if (membudget == 0) {
+    for (i = 0; i < MEMSONGS; i++) memsong_free(memsongs + i);
+  }
+}
+
+
+long songcache_recall(const char *songfile, struct fiofile *f, struct trackinfodata *trackinfo, struct songkey *key) {
+  struct memsong *s;
+  unsigned long off, n;
+
+  key->size = f->flen;
+  key->mtime = fio_mtime(f);
+  key->hit = 0;
+  key->kept = 0;
+  if (membudget == 0) return(-1);
+  s = memsong_find(songfile);
+  if ((s == NULL) || (s->key.size != key->size) || (s->key.mtime != key->mtime)) {
+    songcache_misses++;
+    return(-1);
+  }
+  /* memory must be empty, for the song to land where it was */
+  if (mem_alloc(s->len) != 0) {
+    mem_clear();
+    songcache_misses++;
+    return(-1);
+  }
+  for (off = 0; off < s->len; off += n) {
+    n = s->len - off;
+    if (n > MEMCOPYLEN) n = MEMCOPYLEN;
+    mem_push(s->data + off, off, n);
+  }
+  memcpy(trackinfo, &(s->trackinfo), sizeof(struct trackinfodata));
+  s->lastuse = ++memclock;
+  key->kept = 1;
+  songcache_hits++;
+  return(s->trackpos);
+}
+
+
+int songcache_keep(const char *songfile, const struct songkey *key, const struct trackinfodata *trackinfo, long trackpos) {
+  struct memsong *s;
+  unsigned long len = mem_alloc(0), need, off, n;
+  int i;
+
+  need = len + sizeof(struct memsong);
+  if ((trackpos < 0) || (key->size == 0) || (need > membudget)) return(-1);
+  /* an older version of the song is replaced */
+  s = memsong_find(songfile);
+  if (s != NULL) memsong_free(s);
+  /* make room by forgetting the least recently used songs */
+  for (;;) {
+    struct memsong *lru = NULL;
+    s = NULL;
+    for (i = 0; i < MEMSONGS; i++) {
+      if (memsongs[i].path == NULL) {
+        s = memsongs + i;
+      } else if ((lru == NULL) || (memsongs[i].lastuse < lru->lastuse)) {
+        lru = memsongs + i;
+      }
+    }
+    if ((s != NULL) && (memtaken + need <= membudget)) break;
+    memsong_free(lru);
+  }
+  s->path = malloc(strlen(songfile) + 1);
+  s->data = malloc(len);
+  if ((s->path == NULL) || (s->data == NULL)) {
+    free(s->path);
+    free(s->data);
+    s->path = NULL;
+    return(-1);
+  }
+  strcpy(s->path, songfile);
+  for (off = 0; off < len; off += n) {
+    n = len - off;
+    if (n > MEMCOPYLEN) n = MEMCOPYLEN;
+    mem_pull(off, s->data + off, n);
+  }
+  memcpy(&(s->key), key, sizeof(struct songkey));
+  s->trackpos = trackpos;
+  s->len = len;
+  s->lastuse = ++memclock;
+  /* only what was found while loading the song is kept */
+  memcpy(&(s->trackinfo), trackinfo, sizeof(struct trackinfodata));
+  s->trackinfo.tempo = 500000l;
+  s->trackinfo.elapsedsec = 0;
+  s->trackinfo.nextready = 0;
+  memset(s->trackinfo.notestates, 0, sizeof(s->trackinfo.notestates));
+  memset(s->trackinfo.chanprogs, 0, sizeof(s->trackinfo.chanprogs));
+  memtaken += need;
+  return(0);
+}
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * On-disk cache of pre-parsed songs, for instant reloads of MIDI files
+ * This file is part of the DOSMid project.
+ */
+
+#ifndef SONGCACHE_H_SENTINEL
+#define SONGCACHE_H_SENTINEL
+
+struct fiofile;
+struct trackinfodata;
+
+/* what identifies a version of a song file */
+struct songkey {
+  unsigned long size;   /* size of the file, 0 if the key is not known */
+  unsigned long mtime;  /* time of its last modification (see fio_mtime()) */
+  unsigned char hit;    /* non-zero if the song was loaded from the cache */
+  unsigned char kept;   /* non-zero if the song was restored from memory */
+};
+
+/* looks into directory dir for a pre-parsed copy of the song songfile, open
+ * as f, and sets key to what identifies the song file. if a copy is found,
+ * and the song file did not change since it was made, the packed song is
+ * loaded into memory and trackinfo is filled just like loadfile_midi()
+ * would. returns the position of the first event of the song then, or -1 if
+ * there is no valid copy of the song (key->hit is set accordingly). */
+long songcache_load(const char *dir, const char *songfile, struct fiofile *f, struct trackinfodata *trackinfo, struct songkey *key);
+
+/* writes a pre-parsed copy of the packed song starting at trackpos into
+ * directory dir, for songcache_load() to find it later. returns 0 on
+ * success, non-zero otherwise. */
+int songcache_save(const char *dir, const char *songfile, const struct songkey *key, const struct trackinfodata *trackinfo, long trackpos);
+
+#ifndef MSDOS
+/* how many songs were restored from memory so far, and how many could not */
+extern unsigned long songcache_hits;
+extern unsigned long songcache_misses;
+
+/* sets how much memory (in KB) the songs kept in memory may take altogether.
+ * 0 disables keeping songs in memory, and forgets all of them. */
+void songcache_setbudget(unsigned long kb);
+
+/* looks for a copy of the song songfile, open as f, that was kept in memory
+ * and sets key to what identifies the song file. if the song file did not
+ * change since, the song is restored in memory (which must be empty) at the
+ * same addresses it was loaded at, and trackinfo is restored as it was after
+ * loading the song. returns the position of the first event of the song
+ * then, or -1 if there is no valid copy of the song (key->kept is set
+ * accordingly). */
+long songcache_recall(const char *songfile, struct fiofile *f, struct trackinfodata *trackinfo, struct songkey *key);
+
+/* keeps a copy of the song that starts at trackpos in memory (along with
+ * everything else in memory), and of the song-related data of trackinfo.
+ * the least recently used songs are forgotten to make room if needed.
+ * returns 0 on success, non-zero if the song cannot be kept. */
+int songcache_keep(const char *songfile, const struct songkey *key, const struct trackinfodata *trackinfo, long trackpos);
+#endif
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * Playback statistics: how late events are played, and how long sending
+ * them to the output device takes
+ * This file is part of the DOSMid project.
+ */
+
+#include <stdio.h>  /* sprintf() */
+#include <string.h> /* memset() */
+
+#include "stats.h" /* include self for control */
+
+
+void stats_clear(struct playstats *s) {
+  memset(s, 0, sizeof(struct playstats));
+}
+
+
+/* returns the bucket of the lateness histogram that late falls into */
+static int stats_bucket(unsigned long late) {
+  int e;
+  if (late < 16) return((int)late);
+  if (late >= (1lu << 24)) return(STATS_BUCKETS - 1);
+  /* e is the position of the highest bit set, and the 3 bits below it
+   * tell the bucket within this power of two */
+  for (e = 4; (late >> (e + 1)) != 0; e++);
+  return(16 + ((e - 4) << 3) + (int)((late >> (e - 3)) & 7));
+}
+
+
+void stats_add(struct playstats *s, unsigned long late) {
+  s->hist[stats_bucket(late)]++;
+  s->events++;
+  if (late > s->maxlate) s->maxlate = late;
+}
+
+
+unsigned long stats_bucketmax(int b) {
+  int e;
+  if (b < 16) return(b);
+  e = ((b - 16) >> 3) + 4;
+  return(((unsigned long)(9 + ((b - 16) & 7)) << (e - 3)) - 1);
+}
+
+
+unsigned long stats_percentile(const struct playstats *s, unsigned int pertenthousand) {
+  unsigned long above, n = 0, res;
+  int b;
+  if (s->events == 0) return(0);
+  /* how many events are above the percentile, computed in two parts so
+   * that it does not overflow */
+  above = (s->events / 10000) * (10000 - pertenthousand);
+  above += (s->events % 10000) * (10000 - pertenthousand) / 10000;
+  for (b = 0; b < STATS_BUCKETS - 1; b++) {
+    n += s->hist[b];
+    if (n + above >= s->events) break;
+  }
+  /* the bucket may be larger than what was actually seen */
+  res = stats_bucketmax(b);
+  if (res > s->maxlate) res = s->maxlate;
+  return(res);
+}
+
+
+char *stats_fmtus(char *buf, unsigned long us) {
+  if (us < 1000) {
+    sprintf(buf, "%luus", us);
+  } else if (us < 10000) {
+    sprintf(buf, "%lu.%lums", us / 1000, (us / 100) % 10);
+  } else if (us < 1000000lu) {
+    sprintf(buf, "%lums", us / 1000);
+  } else if (us < 10000000lu) {
+    sprintf(buf, "%lu.%lus", us / 1000000lu, (us / 100000lu) % 10);
+  } else {
+    sprintf(buf, "%lus", us / 1000000lu);
+  }
+  return(buf);
+}
@@ -0,0 +1,38 @@
+/*
+ * Playback statistics: how late events are played, and how long sending
+ * them to the output device takes
+ * This file is part of the DOSMid project.
+ */
+
+#ifndef STATS_H_SENTINEL
+#define STATS_H_SENTINEL
+
+/* lateness values under 16 us have a bucket each, then every power of two
+ * is split in 8 buckets (so values are known within 12.5%), up to 16 s */
+#define STATS_BUCKETS 176
+
+struct playstats {
+  unsigned long hist[STATS_BUCKETS]; /* how many events were how late */
+  unsigned long events;  /* how many events were played */
+  unsigned long maxlate; /* lateness of the latest event (us) */
+  unsigned long devtime; /* time spent sending events to the device (us) */
+};
+
+/* resets all statistics of s */
+void stats_clear(struct playstats *s);
+
+/* records an event played late microseconds after it was due */
+void stats_add(struct playstats *s, unsigned long late);
+
+/* returns the lateness (us) that pertenthousand / 10000 of the events did
+ * not exceed, ie. 9990 gives the 99.9th percentile */
+unsigned long stats_percentile(const struct playstats *s, unsigned int pertenthousand);
+
+/* returns the highest lateness (us) that falls into bucket b */
+unsigned long stats_bucketmax(int b);
+
+/* writes a duration of us microseconds into buf (at least 8 bytes long) in
+ * a short human form, like "12us", "1.2ms" or "3.4s". returns buf. */
+char *stats_fmtus(char *buf, unsigned long us);
+
+#endif
@@ -0,0 +1,574 @@
+/*
+ * benchmark of the MIDI loading path (fio + midi + mem), unix only
+ *
+ * usage: loadbench [file.mid ...]
+ * without any file, a synthetic corpus is generated in the current directory
+ * and deleted afterwards. Every file is loaded the same way loadfile_midi()
+ * does, once per load mode, and the time spent is reported along with a
+ * checksum of the merged song so all modes can be compared for correctness
+ * (including timing: deltas are compared once converted to microseconds).
+ */
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../fio.h"
+#include "../mem.h"
+#include "../midi.h"
+#include "../songcache.h"
+#include "../ui.h"
+
+#define MAXTRACKS 64
+#define CORPUSSIZE 200
+#define ROUNDS 5
+
+#define LOAD_TRACKBUF 0x1000 /* parse resident chunks with midi_trackbuf2events() */
+#define LOAD_PAIRWISE 0x2000 /* merge tracks one by one with midi_mergetrack() */
+#define LOAD_USDELTA  0x4000 /* let midi_mergetracks() store deltas in us */
+#define LOAD_PACKED   0x8000 /* load tracks and song as packed event streams */
+#define LOAD_ARRAY   0x10000 /* merge packed tracks into an array of events */
+#define LOAD_PROG    0x20000 /* parse and merge tracks on the fly (packed song) */
+#define LOAD_STREAM  0x40000 /* nothing loaded, events merged from the file */
+#define LOAD_CACHE   0x80000 /* save a pre-parsed copy of songs once loaded */
+#define LOAD_CACHED 0x100000 /* load songs from their pre-parsed copies */
+#define LOAD_PRESCAN 0x200000 /* size songs first and reserve their memory */
+#define LOAD_COPY   0x400000 /* copy events with mem_pull()/mem_push() only */
+#define LOAD_KEEP   0x800000 /* keep songs in memory and restore them from there */
+#define LOAD_ARENA2 0x1000000 /* load songs into the second memory arena */
+
+#define PROGWINDOW 3 /* seconds of song loaded before playback would start */
+#define CACHEDIR "lbcache"
+
+unsigned char wbuff[8192];
+
+struct loadmode {
+  const char *name;
+  int fioflags;
+};
+
+static const struct loadmode modes[] = {
+  {"read() cache", FIO_OPEN_RD | FIO_OPEN_NOMMAP | LOAD_PAIRWISE},
+  {"mmap()", FIO_OPEN_RD | LOAD_PAIRWISE},
+  {"mmap()+trackbuf", FIO_OPEN_RD | LOAD_TRACKBUF | LOAD_PAIRWISE},
+  {"  w/o mem_ptr()", FIO_OPEN_RD | LOAD_TRACKBUF | LOAD_PAIRWISE | LOAD_COPY},
+  {"+heap merge", FIO_OPEN_RD | LOAD_TRACKBUF},
+  {"  w/o mem_ptr()", FIO_OPEN_RD | LOAD_TRACKBUF | LOAD_COPY},
+  {"+us deltas", FIO_OPEN_RD | LOAD_TRACKBUF | LOAD_USDELTA},
+  {"+packed", FIO_OPEN_RD | LOAD_TRACKBUF | LOAD_USDELTA | LOAD_PACKED},
+  {"+array", FIO_OPEN_RD | LOAD_TRACKBUF | LOAD_USDELTA | LOAD_PACKED | LOAD_ARRAY},
+  {"  w/o mem_ptr()", FIO_OPEN_RD | LOAD_TRACKBUF | LOAD_USDELTA | LOAD_PACKED | LOAD_ARRAY | LOAD_COPY},
+  {"packed+prescan", FIO_OPEN_RD | LOAD_TRACKBUF | LOAD_USDELTA | LOAD_PACKED | LOAD_PRESCAN},
+  {"array+prescan", FIO_OPEN_RD | LOAD_TRACKBUF | LOAD_USDELTA | LOAD_PACKED | LOAD_ARRAY | LOAD_PRESCAN},
+  {"progressive", FIO_OPEN_RD | LOAD_USDELTA | LOAD_PACKED | LOAD_PROG},
+  {"+read() cache", FIO_OPEN_RD | FIO_OPEN_NOMMAP | LOAD_USDELTA | LOAD_PACKED | LOAD_PROG},
+  {"cache cold", FIO_OPEN_RD | LOAD_TRACKBUF | LOAD_USDELTA | LOAD_PACKED | LOAD_CACHE},
+  {"cache warm", FIO_OPEN_RD | LOAD_USDELTA | LOAD_PACKED | LOAD_CACHED},
+  {"memory cache", FIO_OPEN_RD | LOAD_TRACKBUF | LOAD_USDELTA | LOAD_PACKED | LOAD_KEEP},
+  {"second arena", FIO_OPEN_RD | LOAD_TRACKBUF | LOAD_USDELTA | LOAD_PACKED | LOAD_ARENA2},
+  {"stream", FIO_OPEN_RD | LOAD_USDELTA | LOAD_STREAM},
+  {"+read() cache", FIO_OPEN_RD | FIO_OPEN_NOMMAP | LOAD_USDELTA | LOAD_STREAM},
+  {NULL, 0}
+};
+
+static unsigned long rndstate = 1;
+static unsigned long peakmem; /* memory used by the last loadmidi() at its peak */
+static double startdelay;     /* time the last loadmidi() took to load PROGWINDOW */
+static struct fiofile streamfile; /* file of the song being streamed */
+static int streaming;             /* non-zero if streamfile is open */
+static long reserved;             /* memory reserved by the last loadmidi() */
+static volatile unsigned long walksink; /* keeps songwalk() from being optimized out */
+
+extern int mem_direct;
+
+static unsigned int rnd(unsigned int max) {
+  rndstate = rndstate * 1103515245lu + 12345;
+  return((rndstate >> 16) % max);
+}
+
+static void putvlq(FILE *fd, unsigned long v) {
+  unsigned char b[5];
+  int i = 0;
+  b[i++] = v & 127;
+  while ((v >>= 7) != 0) b[i++] = (v & 127) | 128;
+  while (i-- > 0) fputc(b[i], fd);
+}
+
+static void putbe(FILE *fd, unsigned long v, int bytes) {
+  while (bytes-- > 0) fputc((v >> (bytes * 8)) & 0xff, fd);
+}
+
+/* writes a format 1 file with 'tracks' MTrk chunks of roughly 'events'
+ * channel events each, using running status, text, tempo and sysex events */
+static int gensong(const char *fname, int tracks, int events) {
+  FILE *fd;
+  int t, i;
+  fd = fopen(fname, "wb");
+  if (fd == NULL) return(-1);
+  fwrite("MThd\0\0\0\6\0\1", 1, 10, fd);
+  putbe(fd, tracks, 2);
+  putbe(fd, 480, 2);
+  for (t = 0; t < tracks; t++) {
+    long lenpos, endpos;
+    unsigned char chan = t & 15;
+    fwrite("MTrk\0\0\0\0", 1, 8, fd);
+    lenpos = ftell(fd);
+    putvlq(fd, 0);
+    fwrite("\xFF\x03\x0Bsynthetic 1", 1, 14, fd);
+    if (t == 0) {
+      putvlq(fd, 0);
+      fwrite("\xFF\x51\x03\x07\xA1\x20", 1, 6, fd);
+      putvlq(fd, 0);
+      fwrite("\xF0\x05\x7E\x7F\x09\x01\xF7", 1, 7, fd);
+    }
+    putvlq(fd, 0);
+    fputc(0xC0 | chan, fd);
+    fputc(rnd(128), fd);
+    for (i = 0; i < events; i += 4) {
+      unsigned char note = 36 + rnd(60);
+      putvlq(fd, rnd(4) == 0 ? 0 : rnd(400));
+      fputc(0x90 | chan, fd);
+      fputc(note, fd);
+      fputc(1 + rnd(126), fd);
+      putvlq(fd, rnd(200));
+      fputc(note, fd); /* running status */
+      fputc(0, fd);
+      putvlq(fd, rnd(50));
+      fputc(0xB0 | chan, fd);
+      fputc(7, fd);
+      fputc(rnd(128), fd);
+      putvlq(fd, rnd(50));
+      fputc(0xE0 | chan, fd);
+      fputc(rnd(128), fd);
+      fputc(rnd(128), fd);
+      if (t == 0 && rnd(64) == 0) {
+        putvlq(fd, 0);
+        fwrite("\xFF\x51\x03", 1, 3, fd);
+        putbe(fd, 300000 + rnd(400000), 3);
+      }
+    }
+    putvlq(fd, 0);
+    fwrite("\xFF\x2F\x00", 1, 3, fd);
+    endpos = ftell(fd);
+    fseek(fd, lenpos - 4, SEEK_SET);
+    putbe(fd, endpos - lenpos, 4);
+    fseek(fd, endpos, SEEK_SET);
+  }
+  fclose(fd);
+  return(0);
+}
+
+/* returns the amount of bytes allocated so far in mem (unix addresses are
+ * plain offsets within its arena) */
+static unsigned long memused(void) {
+  return(mem_alloc(0));
+}
+
+
+/* loads a MIDI file the way loadfile_midi() does, returns the id of the first
+ * event of the merged song or a negative value on error */
+static double now(void);
+
+static long loadmidi(const char *fname, int fioflags, unsigned long *totlen, unsigned short *timeunitdiv) {
+  static unsigned long trackmap[MAXTRACKS];
+  static unsigned long tracklens[MAXTRACKS];
+  static long trackheads[MAXTRACKS];
+  static unsigned char reqpatches[32];
+  struct fiofile f;
+  static unsigned short channelsusage; /* updated while a song is streamed */
+  unsigned long tracklen;
+  char title[64], copyright[64], text[256];
+  int format, tracks, i;
+  long trackpos = -1, newtrack;
+  const unsigned char *trackbuf;
+
+  *totlen = 0;
+  channelsusage = 0;
+  if (fio_open(fname, fioflags & ~(LOAD_TRACKBUF | LOAD_PAIRWISE | LOAD_USDELTA | LOAD_PACKED | LOAD_ARRAY | LOAD_PROG | LOAD_STREAM | LOAD_CACHE | LOAD_CACHED | LOAD_PRESCAN | LOAD_COPY | LOAD_KEEP | LOAD_ARENA2), &f) != 0) return(-1);
+  if (fioflags & LOAD_CACHED) {
+    static struct trackinfodata trackinfo;
+    struct songkey key;
+    trackpos = songcache_load(CACHEDIR, fname, &f, &trackinfo, &key);
+    fio_close(&f);
+    if (key.hit == 0) return(MIDI_TRACKERROR);
+    *totlen = trackinfo.totlen;
+    peakmem = memused();
+    return(trackpos);
+  }
+  if (fioflags & LOAD_KEEP) {
+    static struct trackinfodata trackinfo;
+    struct songkey key;
+    trackpos = songcache_recall(fname, &f, &trackinfo, &key);
+    if (key.kept != 0) {
+      fio_close(&f);
+      *totlen = trackinfo.totlen;
+      peakmem = memused();
+      return(trackpos);
+    }
+  }
+  midi_packtracks(fioflags & LOAD_PACKED);
+  tracks = midi_readhdr(&f, &format, timeunitdiv, trackmap, tracklens, MAXTRACKS);
+  if (fioflags & LOAD_STREAM) {
+    struct midi_progress progress;
+    int r = 0;
+    /* the file stays open for the song to be read, until the next load */
+    if (streaming) fio_close(&streamfile);
+    streamfile = f;
+    streaming = 1;
+    midi_streamopen(&streamfile, *timeunitdiv, &channelsusage, reqpatches);
+    for (i = 0; (i < tracks) && (r == 0); i++) {
+      fio_seek(&streamfile, FIO_SEEK_START, trackmap[i]);
+      r = midi_progtrack(fio_getptr(&streamfile, tracklens[i]), tracklens[i], title, sizeof(title), (i == 0) ? copyright : NULL, (i == 0) ? sizeof(copyright) : 0, (i == 0) ? text : NULL, (i == 0) ? sizeof(text) : 0, &tracklen);
+    }
+    if (r == 0) r = midi_streamstart(&progress);
+    if (r != 0) return(r);
+    *totlen = progress.totlen;
+    peakmem = memused();
+    return((progress.events == 0) ? -1 : 0);
+  }
+  if (fioflags & LOAD_PROG) {
+    struct midi_progress progress;
+    double t0 = now();
+    int r;
+    trackpos = midi_progopen(&f, *timeunitdiv, &channelsusage, reqpatches);
+    for (i = 0; (i < tracks) && (trackpos >= 0); i++) {
+      fio_seek(&f, FIO_SEEK_START, trackmap[i]);
+      r = midi_progtrack(fio_getptr(&f, tracklens[i]), tracklens[i], title, sizeof(title), (i == 0) ? copyright : NULL, (i == 0) ? sizeof(copyright) : 0, (i == 0) ? text : NULL, (i == 0) ? sizeof(text) : 0, &tracklen);
+      if (r != 0) trackpos = r;
+    }
+    /* first the window playback would wait for, then the rest by batches */
+    r = (trackpos < 0) ? (int)trackpos : midi_progstep(PROGWINDOW, 0, &progress);
+    startdelay = now() - t0;
+    while (r == 0) r = midi_progstep(ULONG_MAX, 64, &progress);
+    if (r < 0) trackpos = r;
+    if ((r == 1) && (progress.events == 0)) trackpos = -1;
+    *totlen = progress.totlen;
+    peakmem = memused();
+    fio_close(&f);
+    return(trackpos);
+  }
+  if (fioflags & LOAD_PRESCAN) {
+    struct midi_songsize songsize;
+    int flags = (fioflags & LOAD_ARRAY) ? (MIDI_MERGE_PACKED | MIDI_MERGE_ARRAY) : MIDI_MERGE_PACKED;
+    memset(&songsize, 0, sizeof(songsize));
+    for (i = 0; i < tracks; i++) {
+      fio_seek(&f, FIO_SEEK_START, trackmap[i]);
+      if (midi_tracksize(&f, tracklens[i], &songsize) != 0) {
+        fio_close(&f);
+        return(MIDI_TRACKERROR);
+      }
+    }
+    reserved = midi_reserve(&songsize, flags);
+    if (reserved < 0) {
+      fio_close(&f);
+      return(MIDI_OUTOFMEM);
+    }
+  }
+  for (i = 0; i < tracks; i++) {
+    fio_seek(&f, FIO_SEEK_START, trackmap[i]);
+    trackbuf = (fioflags & LOAD_TRACKBUF) ? fio_getptr(&f, tracklens[i]) : NULL;
+    if (trackbuf != NULL) {
+      newtrack = midi_trackbuf2events(trackbuf, tracklens[i], title, sizeof(title), (i == 0) ? copyright : NULL, (i == 0) ? sizeof(copyright) : 0, (i == 0) ? text : NULL, (i == 0) ? sizeof(text) : 0, &channelsusage, &tracklen, reqpatches);
+    } else if (i == 0) {
+      newtrack = midi_track2events(&f, title, sizeof(title), copyright, sizeof(copyright), text, sizeof(text), &channelsusage, &tracklen, reqpatches);
+    } else {
+      newtrack = midi_track2events(&f, title, sizeof(title), NULL, 0, NULL, 0, &channelsusage, &tracklen, reqpatches);
+    }
+    if ((newtrack == MIDI_OUTOFMEM) || (newtrack == MIDI_TRACKERROR)) {
+      fio_close(&f);
+      return(newtrack);
+    }
+    if (fioflags & LOAD_PAIRWISE) {
+      if (newtrack >= 0) trackpos = midi_mergetrack(trackpos, newtrack, totlen, *timeunitdiv);
+    } else {
+      trackheads[i] = newtrack;
+    }
+  }
+  peakmem = memused();
+  if ((fioflags & LOAD_PAIRWISE) == 0) {
+    int flags = 0;
+    if (fioflags & LOAD_USDELTA) flags |= MIDI_MERGE_USDELTA;
+    if (fioflags & LOAD_PACKED) flags |= MIDI_MERGE_PACKED;
+    if (fioflags & LOAD_ARRAY) flags |= MIDI_MERGE_ARRAY;
+    trackpos = midi_mergetracks(trackheads, tracks, totlen, *timeunitdiv, flags);
+  }
+  /* packed and array songs are written after their tracks before being moved */
+  if (fioflags & (LOAD_PACKED | LOAD_ARRAY)) peakmem += memused();
+  if ((fioflags & (LOAD_CACHE | LOAD_KEEP)) && (trackpos >= 0)) {
+    static struct trackinfodata trackinfo;
+    struct songkey key;
+    key.size = f.flen;
+    key.mtime = fio_mtime(&f);
+    key.hit = 0;
+    key.kept = 0;
+    trackinfo.totlen = *totlen;
+    trackinfo.channelsusage = channelsusage;
+    trackinfo.miditimeunitdiv = *timeunitdiv;
+    trackinfo.trackscount = tracks;
+    trackinfo.midiformat = format;
+    memcpy(trackinfo.reqpatches, reqpatches, sizeof(reqpatches));
+    if (fioflags & LOAD_KEEP) {
+      songcache_keep(fname, &key, &trackinfo, trackpos);
+    } else if (songcache_save(CACHEDIR, fname, &key, &trackinfo, trackpos) != 0) {
+      trackpos = -2;
+    }
+  }
+  fio_close(&f);
+  return(trackpos);
+}
+
+/* returns the MIDI_LAYOUT_* of songs loaded with fioflags */
+static int layoutof(int fioflags) {
+  if (fioflags & LOAD_STREAM) return(MIDI_LAYOUT_STREAM);
+  if (fioflags & LOAD_ARRAY) return(MIDI_LAYOUT_ARRAY);
+  if (fioflags & LOAD_PACKED) return(MIDI_LAYOUT_PACKED);
+  return(MIDI_LAYOUT_LIST);
+}
+
+/* gets back to the start of the song being streamed, if trackpos is one */
+static void streamrewind(long trackpos, int layout) {
+  struct midi_progress progress;
+  if ((trackpos >= 0) && (layout == MIDI_LAYOUT_STREAM)) midi_streamstart(&progress);
+}
+
+/* walks the merged song and computes a checksum of all its events. deltas
+ * are hashed in microseconds, converted the way playfile() does unless
+ * timeunitdiv is 0 (song already in us) */
+static unsigned long songsum(long trackpos, unsigned short timeunitdiv, int layout, unsigned long *count) {
+  static unsigned char sysex[4098];
+  struct midi_event e;
+  struct midi_packreader r;
+  unsigned long sum = 0, tempo = 500000l;
+  unsigned int i, len;
+  *count = 0;
+  r.chunk = -1;
+  streamrewind(trackpos, layout);
+  while (trackpos >= 0) {
+    if (layout == MIDI_LAYOUT_STREAM) {
+      if (midi_streampull(&e, 1) != 1) return(0);
+    } else if (layout == MIDI_LAYOUT_PACKED) {
+      if (midi_packpull(&r, trackpos, &e) != 0) return(0);
+    } else {
+      mem_pull(trackpos, &e, sizeof(e));
+    }
+    if ((timeunitdiv != 0) && (e.deltatime != 0)) e.deltatime = DELTATIME2US(e.deltatime, tempo, timeunitdiv);
+    if (e.type == EVENT_TEMPO) tempo = e.data.tempoval;
+    sum = sum * 31 + e.deltatime;
+    sum = sum * 31 + e.type;
+    switch (e.type) {
+      case EVENT_TEMPO:
+        sum = sum * 31 + e.data.tempoval;
+        break;
+      case EVENT_SYSEX:
+        if (layout == MIDI_LAYOUT_STREAM) {
+          len = midi_streamsysex(e.data.sysex.sysexptr, sysex);
+        } else if (layout == MIDI_LAYOUT_PACKED) {
+          len = midi_packsysex(e.data.sysex.sysexptr, sysex);
+        } else {
+          mem_pull(e.data.sysex.sysexptr, sysex, 2);
+          len = ((uint16_t *)sysex)[0];
+          mem_pull(e.data.sysex.sysexptr, sysex, (len + 3) & ~1);
+        }
+        for (i = 0; i < len; i++) sum = sum * 31 + sysex[i + 2];
+        break;
+      case EVENT_NOTEOFF: /* velocity is not kept by packed songs */
+        sum = sum * 31 + e.data.note.note;
+        sum = sum * 31 + e.data.note.chan;
+        break;
+      case EVENT_PROGCHAN:
+      case EVENT_CHANPRESSURE: /* only two bytes of payload */
+        sum = sum * 31 + e.data.prog.prog;
+        sum = sum * 31 + e.data.prog.chan;
+        break;
+      default:
+        sum = sum * 31 + e.data.note.note;
+        sum = sum * 31 + e.data.note.chan;
+        sum = sum * 31 + e.data.note.velocity;
+        break;
+    }
+    *count += 1;
+    trackpos = e.next;
+  }
+  return(sum);
+}
+
+/* reads the whole song the way the playback cache of dosmid.c refills itself,
+ * 64 events at a time (or reads events in place, if possible), and returns
+ * the amount of events read */
+static unsigned long songwalk(long trackpos, int fioflags) {
+  static struct midi_event cache[64];
+  struct midi_packreader r;
+  struct midi_event *e;
+  unsigned long count = 0, sink = 0;
+  int n, i, layout = layoutof(fioflags);
+  r.chunk = -1;
+  streamrewind(trackpos, layout);
+  while (trackpos >= 0) {
+    if (((layout == MIDI_LAYOUT_LIST) || (layout == MIDI_LAYOUT_ARRAY)) && ((e = mem_ptr(trackpos)) != NULL)) {
+      for (n = 0; (n < 64) && (trackpos >= 0); n++) {
+        e = mem_ptr(trackpos);
+        sink += e->deltatime + e->type;
+        trackpos = e->next;
+      }
+    } else if (fioflags & LOAD_STREAM) {
+      n = midi_streampull(cache, 64);
+      if (n < 1) return(0);
+      trackpos = cache[n - 1].next;
+    } else if (fioflags & LOAD_ARRAY) {
+      n = mem_run(trackpos, sizeof(struct midi_event), 64);
+      mem_pull(trackpos, cache, n * sizeof(struct midi_event));
+      for (i = 1; i < n; i++) {
+        if (cache[i - 1].next != trackpos + (long)(i * sizeof(struct midi_event))) break;
+      }
+      n = i;
+      trackpos = cache[n - 1].next;
+    } else if (fioflags & LOAD_PACKED) {
+      for (n = 0; (n < 64) && (trackpos >= 0); n++) {
+        if (midi_packpull(&r, trackpos, cache + n) != 0) return(0);
+        trackpos = cache[n].next;
+      }
+    } else {
+      for (n = 0; (n < 64) && (trackpos >= 0); n++) {
+        mem_pull(trackpos, cache + n, sizeof(struct midi_event));
+        trackpos = cache[n].next;
+      }
+    }
+    count += n;
+  }
+  walksink += sink;
+  return(count);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* loads every file of the corpus in all modes, and prints the results */
+static int runcorpus(char **files, int filescount) {
+  int i, m, r;
+  unsigned long refsum = 0;
+  for (m = 0; modes[m].name != NULL; m++) {
+    double t0, t = 0, tread = 0, tstart = 0;
+    unsigned long sum = 0, events = 0, mem = 0, peak = 0, resv = 0;
+    int outgrown = 0;
+    mem_direct = ((modes[m].fioflags & LOAD_COPY) == 0);
+    if ((modes[m].fioflags & LOAD_ARENA2) && (mem_arena(1) < 0)) {
+      printf("ERR: mem_arena() failed\n");
+      return(-1);
+    }
+    if (modes[m].fioflags & LOAD_KEEP) {
+      songcache_setbudget(65536);
+      songcache_hits = 0;
+      songcache_misses = 0;
+    }
+    for (r = 0; r < ROUNDS; r++) {
+      for (i = 0; i < filescount; i++) {
+        unsigned long totlen, count;
+        unsigned short timeunitdiv;
+        long trackpos;
+        mem_clear();
+        t0 = now();
+        trackpos = loadmidi(files[i], modes[m].fioflags, &totlen, &timeunitdiv);
+        t += now() - t0;
+        tstart += startdelay;
+        t0 = now();
+        songwalk(trackpos, modes[m].fioflags);
+        tread += now() - t0;
+        if (r != 0) continue;
+        if (trackpos < -1) printf("%s: load error %ld\n", files[i], trackpos);
+        if (modes[m].fioflags & LOAD_USDELTA) timeunitdiv = 0;
+        sum = sum * 31 + songsum(trackpos, timeunitdiv, layoutof(modes[m].fioflags), &count) + totlen;
+        if (songwalk(trackpos, modes[m].fioflags) != count) printf("%s: walk error\n", files[i]);
+        events += count;
+        mem += memused();
+        peak += peakmem;
+        if (modes[m].fioflags & LOAD_PRESCAN) {
+          resv += reserved;
+          if (peakmem > (unsigned long)reserved) outgrown++;
+        }
+      }
+    }
+    printf("%-16s %8.2f ms/round  %10.0f events/s  %5.1f B/event (peak %5.1f)  read %6.0f ns/event  sum=%08lx\n", modes[m].name, t * 1000 / ROUNDS, events * ROUNDS / t, (double)mem / events, (double)peak / events, tread * 1e9 / (events * ROUNDS), sum);
+    if (modes[m].fioflags & LOAD_PROG) printf("%-16s %8.2f ms/round to load the first %d s of every song\n", "", tstart * 1000 / ROUNDS, PROGWINDOW);
+    if (modes[m].fioflags & LOAD_PRESCAN) printf("%-16s %8.1f B/event reserved, %d of %d songs outgrew their reservation\n", "", (double)resv / events, outgrown, filescount);
+    if (modes[m].fioflags & LOAD_KEEP) {
+      printf("%-16s %8lu songs restored from memory, %lu loaded from their file\n", "", songcache_hits, songcache_misses);
+      songcache_setbudget(0);
+    }
+    mem_arena(0);
+    if (m == 0) refsum = sum;
+    if (sum != refsum) {
+      printf("ERR: %s produced a different song\n", modes[m].name);
+      return(-1);
+    }
+  }
+  return(0);
+}
+
+/* generates a synthetic corpus of count files and benchmarks it */
+static int runsynthetic(const char *desc, int count, int tracks, int events) {
+  static char namebuf[CORPUSSIZE][32];
+  static char *files[CORPUSSIZE];
+  int i, res;
+  printf("%d synthetic files, %s:\n", count, desc);
+  for (i = 0; i < count; i++) {
+    sprintf(namebuf[i], "lb%03d.mid", i);
+    files[i] = namebuf[i];
+    if (gensong(files[i], (tracks > 0) ? tracks : 1 + rnd(16), (events > 0) ? events : 100 + rnd(600)) != 0) {
+      printf("ERR: failed to write %s\n", files[i]);
+      return(-1);
+    }
+  }
+  res = runcorpus(files, count);
+  for (i = 0; i < count; i++) unlink(files[i]);
+  return(res);
+}
+
+/* removes the cache directory and all the files in it */
+static void cleancache(void) {
+  char fname[300];
+  struct dirent *e;
+  DIR *d = opendir(CACHEDIR);
+  if (d != NULL) {
+    while ((e = readdir(d)) != NULL) {
+      if (e->d_name[0] == '.') continue;
+      snprintf(fname, sizeof(fname), "%s/%s", CACHEDIR, e->d_name);
+      unlink(fname);
+    }
+    closedir(d);
+  }
+  rmdir(CACHEDIR);
+}
+
+int main(int argc, char **argv) {
+  int res;
+
+  midi_init_static_ident();
+  mkdir(CACHEDIR, 0755);
+  if (mem_init(MEM_MALLOC) == 0) {
+    printf("ERR: mem_init() failed\n");
+    return(1);
+  }
+
+  if (argc > 1) {
+    res = runcorpus(argv + 1, argc - 1);
+  } else {
+    res = runsynthetic("1 to 16 tracks", CORPUSSIZE, 0, 0);
+    if (res == 0) res = runsynthetic("64 tracks", 20, 64, 180);
+    /* way more than the 512 KB that DOS conventional memory can hold */
+    if (res == 0) res = runsynthetic("16 tracks of 20000 events", 2, 16, 20000);
+  }
+
+  if (streaming) fio_close(&streamfile);
+  mem_close();
+  cleancache();
+  return((res == 0) ? 0 : 1);
+}
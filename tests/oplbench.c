@@ -0,0 +1,95 @@
+/*
+ * benchmark of the OPL voice allocator (opl_midi_noteon/noteoff), unix only
+ *
+ * usage: oplbench
+ * plays random notes on an OPL3 (18 voices) with a given number of notes
+ * held at any time, from a few up to more than the voices available (so
+ * voices get stolen). the chip is not there: register writes are counted
+ * and dropped, and the delays they need are skipped, so what is measured
+ * is the time spent in opl.c itself.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../opl.h"
+
+#define EVENTS 2000000l
+#define MAXHELD 64
+
+/* stand-ins for lpt.c and timer.c */
+void write_lpt(unsigned int port, unsigned int byte, unsigned int ctrl) {
+  (void)port;
+  (void)byte;
+  (void)ctrl;
+}
+
+void write_lpt_fd(int fd, unsigned int data, unsigned int ctrl) {
+  (void)fd;
+  (void)data;
+  (void)ctrl;
+}
+
+int claim_lpt(int fd) {
+  (void)fd;
+  return(0);
+}
+
+void udelay(unsigned long us) {
+  (void)us;
+}
+
+void timer_readreal(unsigned long *res) {
+  *res = 0;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void bench(int held) {
+  int chans[MAXHELD], notes[MAXHELD];
+  int first = 0, count = 0;
+  long i;
+  double t;
+  struct oplstats before, after;
+
+  srand(held);
+  opl_clear();
+  opl_getstats(&before);
+  t = now();
+  for (i = 0; i < EVENTS; i += 2) {
+    /* release the oldest note once enough are held */
+    if (count == held) {
+      opl_midi_noteoff(chans[first], notes[first]);
+      first = (first + 1) % MAXHELD;
+      count--;
+    }
+    chans[(first + count) % MAXHELD] = rand() % 16;
+    notes[(first + count) % MAXHELD] = 24 + rand() % 72;
+    opl_midi_noteon(chans[(first + count) % MAXHELD], notes[(first + count) % MAXHELD], 100);
+    count++;
+    /* a few events are due at the same time, then comes the next tick */
+    if ((i & 7) == 6) opl_flush();
+  }
+  t = now() - t;
+  opl_getstats(&after);
+  printf("%2d notes held: %6.1f ns per event, %5.2f writes per event, %lu steals\n", held, t * 1e9 / EVENTS, (double)(after.issued - before.issued) / EVENTS, after.steals - before.steals);
+}
+
+int main(void) {
+  int gen = 3;
+  static const int held[] = {1, 4, 9, 16, 18, 24, 48};
+  unsigned int i;
+
+  if (opl_init(3, &gen, OPL_ON_LPT | OPL_PORT_IS_FD) != 0) {
+    printf("ERR: opl_init()\n");
+    return(1);
+  }
+  for (i = 0; i < sizeof(held) / sizeof(held[0]); i++) bench(held[i]);
+  opl_close();
+  return(0);
+}
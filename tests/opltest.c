@@ -1,35 +1,132 @@
 /*
- * Simple test routine for DOSMid's OPL output
- * Copyright (C) 2015 Mateusz Viste
+ * test for the queue of OPL register writes (opl.c), unix only
+ *
+ * the chip is not there: writes to the OPL2LPT are decoded back into
+ * register writes, and the key-on bits written to the 0xB0..0xB8
+ * registers must tell every note that was played, even when its note-on
+ * and its note-off come in the same tick.
  */
 
-#include <unistd.h>
+#include <stdio.h>
 
 #include "../opl.h"
 
-#define PORT 0x388
+#define MAXWRITES 256
 
+static unsigned int selreg;
+static unsigned int keyregs[MAXWRITES];
+static unsigned char keyvals[MAXWRITES];
+static int keywrites;
 
+/* stand-ins for lpt.c and timer.c */
+void write_lpt(unsigned int port, unsigned int byte, unsigned int ctrl) {
+  (void)port;
+  (void)byte;
+  (void)ctrl;
+}
+
+/* the register is selected with ctrl 0xd (0x5 for the second bank of an
+ * OPL3), then the data comes with ctrl 0xc */
+void write_lpt_fd(int fd, unsigned int data, unsigned int ctrl) {
+  (void)fd;
+  if (ctrl == 0xd) {
+    selreg = data;
+  } else if (ctrl == 0x5) {
+    selreg = 0x100 | data;
+  } else if ((ctrl == 0xc) && ((selreg & 0xff) >= 0xB0) && ((selreg & 0xff) <= 0xB8)) {
+    if (keywrites == MAXWRITES) return;
+    keyregs[keywrites] = selreg;
+    keyvals[keywrites] = data;
+    keywrites++;
+  }
+}
+
+int claim_lpt(int fd) {
+  (void)fd;
+  return(0);
+}
+
+void udelay(unsigned long us) {
+  (void)us;
+}
+
+void timer_readreal(unsigned long *res) {
+  *res = 0;
+}
+
+/* returns the position of the first key-on (on != 0) or key-off written
+ * from position 'from' on, -1 if there is none */
+static int findkey(int from, int on) {
+  for (; from < keywrites; from++) {
+    if (((keyvals[from] & 0x20) != 0) == (on != 0)) return(from);
+  }
+  return(-1);
+}
+
+/* the voice keyed on must be keyed off afterwards */
+static int checkshort(const char *what) {
+  int on = findkey(0, 1);
+  int i;
+  if (on < 0) {
+    printf("ERR: %s: no key-on written\n", what);
+    return(1);
+  }
+  for (i = on + 1; i < keywrites; i++) {
+    if ((keyregs[i] == keyregs[on]) && ((keyvals[i] & 0x20) == 0)) return(0);
+  }
+  printf("ERR: %s: no key-off written after the key-on\n", what);
+  return(1);
+}
+
+static void restart(void) {
+  opl_clear();
+  keywrites = 0;
+}
 
 int main(void) {
-  opl_init(PORT);
-
-  opl_midi_changeprog(0, 0);
-  opl_midi_changeprog(1, 0);
-  opl_midi_changeprog(2, 0);
-
-  opl_midi_noteon(PORT, 0, 50, 120);
-  sleep(1);
-  opl_midi_noteoff(PORT, 0, 50);
-  opl_midi_noteon(PORT, 1, 55, 120);
-  sleep(1);
-  opl_midi_noteoff(PORT, 0, 55);
-  opl_midi_noteon(PORT, 2, 60, 120);
-  sleep(1);
-  opl_midi_noteoff(PORT, 0, 60);
-  opl_midi_noteon(PORT, 2, 65, 120);
-  sleep(1);
-
-  opl_close(PORT);
+  int gen = 3, err = 0;
+
+  if (opl_init(3, &gen, OPL_ON_LPT | OPL_PORT_IS_FD) != 0) {
+    printf("ERR: opl_init()\n");
+    return(1);
+  }
+
+  /* notes as short as nothing, on a melodic and on the percussion channel */
+  restart();
+  opl_midi_noteon(0, 60, 100);
+  opl_midi_noteoff(0, 60);
+  opl_flush();
+  err |= checkshort("zero-length note");
+
+  restart();
+  opl_midi_noteon(9, 38, 100);
+  opl_midi_noteoff(9, 38);
+  opl_flush();
+  err |= checkshort("zero-length percussion hit");
+
+  /* a note of some length */
+  restart();
+  opl_midi_noteon(0, 64, 100);
+  opl_flush();
+  opl_midi_noteoff(0, 64);
+  opl_flush();
+  err |= checkshort("note");
+
+  /* a note released and played again in the same tick must restart */
+  restart();
+  opl_midi_noteon(0, 67, 100);
+  opl_flush();
+  keywrites = 0;
+  opl_midi_noteoff(0, 67);
+  opl_midi_noteon(0, 67, 100);
+  opl_flush();
+  if ((findkey(0, 0) < 0) || (findkey(findkey(0, 0) + 1, 1) < 0)) {
+    printf("ERR: restarted note: no key-off then key-on written\n");
+    err = 1;
+  }
+
+  opl_close();
+  if (err != 0) return(1);
+  printf("OK\n");
   return(0);
 }
@@ -0,0 +1,82 @@
+/*
+ * test for the lock-free rings of rt.c: a thread pushes a sequence of items
+ * through a small ring while the main thread reads them back
+ */
+
+#include <pthread.h>
+#include <sched.h> /* sched_yield() */
+#include <stdio.h>
+
+#include "../rt.h"
+
+#define ITEMS 4000000ul
+
+struct item {
+  unsigned long seq;
+  unsigned long check;
+};
+
+static struct ring ring;
+
+static void *writer(void *arg) {
+  struct item it;
+  unsigned long i;
+  for (i = 0; i < ITEMS; i++) {
+    it.seq = i;
+    it.check = i * 2654435761ul;
+    while (ring_put(&ring, &it) != 0) sched_yield();
+  }
+  return(arg);
+}
+
+int main(void) {
+  pthread_t t;
+  struct item it;
+  unsigned long i;
+
+  if (ring_init(&ring, sizeof(struct item), 16) != 0) {
+    printf("ERR: ring_init()\n");
+    return(1);
+  }
+  /* an empty ring gives nothing */
+  if (ring_get(&ring, &it) == 0) {
+    printf("ERR: got an item out of an empty ring\n");
+    return(1);
+  }
+  /* a full ring takes nothing more */
+  for (i = 0; i < 16; i++) {
+    it.seq = i;
+    if (ring_put(&ring, &it) != 0) {
+      printf("ERR: ring full after %lu items out of 16\n", i);
+      return(1);
+    }
+  }
+  if (ring_put(&ring, &it) == 0) {
+    printf("ERR: put a 17th item into a ring of 16\n");
+    return(1);
+  }
+  for (i = 0; i < 16; i++) {
+    if ((ring_get(&ring, &it) != 0) || (it.seq != i)) {
+      printf("ERR: item %lu lost\n", i);
+      return(1);
+    }
+  }
+
+  /* items must come out in order and intact when passed between threads */
+  if (pthread_create(&t, NULL, writer, NULL) != 0) {
+    printf("ERR: pthread_create()\n");
+    return(1);
+  }
+  for (i = 0; i < ITEMS; i++) {
+    while (ring_get(&ring, &it) != 0) sched_yield();
+    if ((it.seq != i) || (it.check != i * 2654435761ul)) {
+      printf("ERR: got item %lu (check %lx) instead of %lu\n", it.seq, it.check, i);
+      return(1);
+    }
+  }
+  pthread_join(t, NULL);
+  ring_free(&ring);
+
+  printf("OK\n");
+  return(0);
+}
@@ -0,0 +1,79 @@
+/*
+ * test for the lateness histogram of stats.c: bucket bounds, percentiles
+ * and the formatting of durations
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../stats.h"
+
+static struct playstats s;
+
+static int checkfmt(unsigned long us, const char *expected) {
+  char buf[8];
+  if (strcmp(stats_fmtus(buf, us), expected) == 0) return(0);
+  printf("ERR: stats_fmtus(%lu) gives '%s' instead of '%s'\n", us, buf, expected);
+  return(1);
+}
+
+int main(void) {
+  unsigned long i, prev = 0;
+  int b, err = 0;
+
+  /* buckets must cover all values, in order, without overlapping */
+  for (b = 1; b < STATS_BUCKETS; b++) {
+    if (stats_bucketmax(b) <= stats_bucketmax(b - 1)) {
+      printf("ERR: bucket %d ends at %lu, bucket %d at %lu\n", b - 1, stats_bucketmax(b - 1), b, stats_bucketmax(b));
+      return(1);
+    }
+  }
+  if (stats_bucketmax(STATS_BUCKETS - 1) != (1lu << 24) - 1) {
+    printf("ERR: last bucket ends at %lu\n", stats_bucketmax(STATS_BUCKETS - 1));
+    return(1);
+  }
+
+  /* every value must land in the bucket that covers it */
+  for (i = 0; i < (1lu << 24); i += 1 + (i >> 6)) {
+    stats_clear(&s);
+    stats_add(&s, i);
+    for (b = 0; s.hist[b] == 0; b++);
+    if ((i > stats_bucketmax(b)) || ((b > 0) && (i <= stats_bucketmax(b - 1)))) {
+      printf("ERR: %lu falls into bucket %d (up to %lu)\n", i, b, stats_bucketmax(b));
+      return(1);
+    }
+    if (stats_percentile(&s, 5000) != i) {
+      printf("ERR: p50 of a single %lu is %lu\n", i, stats_percentile(&s, 5000));
+      return(1);
+    }
+  }
+
+  /* 1000 values from 1 to 1000 us: percentiles are known within 12.5% */
+  stats_clear(&s);
+  for (i = 1; i <= 1000; i++) stats_add(&s, i);
+  if ((s.events != 1000) || (s.maxlate != 1000)) {
+    printf("ERR: %lu events, max %lu\n", s.events, s.maxlate);
+    return(1);
+  }
+  for (b = 0; b < 3; b++) {
+    static const unsigned int p[3] = {5000, 9900, 9990};
+    static const unsigned long exact[3] = {500, 990, 999};
+    i = stats_percentile(&s, p[b]);
+    if ((i < exact[b]) || (i > exact[b] + exact[b] / 8) || (i < prev)) {
+      printf("ERR: percentile %u is %lu, expected about %lu\n", p[b], i, exact[b]);
+      return(1);
+    }
+    prev = i;
+  }
+
+  err |= checkfmt(0, "0us");
+  err |= checkfmt(999, "999us");
+  err |= checkfmt(1250, "1.2ms");
+  err |= checkfmt(45000, "45ms");
+  err |= checkfmt(3400000lu, "3.4s");
+  err |= checkfmt(4000000000lu, "4000s");
+  if (err != 0) return(1);
+
+  printf("OK\n");
+  return(0);
+}
@@ -0,0 +1,85 @@
+/*
+ * test for the clocks of timer.c: the virtual clock must give the exact same
+ * timeline whatever the speed of the computer, the scaled clock must run at
+ * the speed asked
+ */
+
+#include <stdio.h>
+
+#include "../timer.h"
+
+static int checktime(const char *what, unsigned long expected) {
+  unsigned long t;
+  timer_read(&t);
+  if (t == expected) return(0);
+  printf("ERR: %s: clock at %lu instead of %lu\n", what, t, expected);
+  return(1);
+}
+
+int main(void) {
+  unsigned long t, real;
+  int i, err = 0;
+
+  timer_init();
+
+  /* the virtual clock does not move by itself... */
+  timer_setclock(TIMER_CLOCK_VIRTUAL, 0);
+  timer_reset();
+  err |= checktime("after reset", 0);
+  for (i = 0; i < 100000; i++) timer_read(&t);
+  err |= checktime("after reading", 0);
+
+  /* ...only forward to the events, and by the hardware delays */
+  timer_advance(1000);
+  err |= checktime("advance to 1000", 1000);
+  timer_advance(500);
+  err |= checktime("advance back to 500", 1000);
+  udelay(23);
+  err |= checktime("udelay(23)", 1023);
+  timer_advance(1023);
+  err |= checktime("advance to now", 1023);
+  for (i = 0; i < 1000; i++) {
+    timer_advance(2000 + i * 1000ul);
+    udelay(4);
+  }
+  err |= checktime("1000 events", 1001004);
+  if (timer_realspan(1000) != 1000) {
+    printf("ERR: a span of the virtual clock is not real time\n");
+    err = 1;
+  }
+
+  /* a scaled clock at 250% runs 2.5 times faster than the real time */
+  timer_setclock(TIMER_CLOCK_SCALED, 250);
+  timer_reset();
+  udelay(200000);
+  timer_read(&t);
+  timer_readreal(&real);
+  if ((t < real * 2) || (t > real * 5 / 2)) {
+    printf("ERR: scaled clock at %lu after %lu us of real time\n", t, real);
+    err = 1;
+  }
+  if (timer_realspan(1000000) != 400000) {
+    printf("ERR: 1 s of the scaled clock gives %lu us of real time\n", timer_realspan(1000000));
+    err = 1;
+  }
+  timer_advance(t + 1000000);
+  timer_read(&real);
+  if (real > t + 100000) {
+    printf("ERR: timer_advance() moved a scaled clock\n");
+    err = 1;
+  }
+
+  /* and the real clock is the real time */
+  timer_setclock(TIMER_CLOCK_REAL, 0);
+  timer_reset();
+  udelay(100000);
+  timer_read(&t);
+  if ((t < 100000) || (t > 1000000)) {
+    printf("ERR: real clock at %lu after udelay(100000)\n", t);
+    err = 1;
+  }
+
+  if (err != 0) return(1);
+  printf("OK\n");
+  return(0);
+}
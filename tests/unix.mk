@@ -0,0 +1,40 @@
+#
+# Tests and benchmarks that can be built on UNIX-like systems
+#
+
+CFLAGS += -Wall -Wno-switch -O2 -D __far= -D __near= -D far= -D near=
+
+all: fiotest loadbench oplbench opltest ringtest statstest timertest
+
+fiotest: fiotest.c ../fio.c
+	$(CC) $(CFLAGS) fiotest.c ../fio.c -o $@
+
+loadbench: loadbench.c ../fio.c ../mem.c ../midi.c ../songcache.c
+	$(CC) $(CFLAGS) loadbench.c ../fio.c ../mem.c ../midi.c ../songcache.c -o $@
+
+oplbench: oplbench.c ../opl.c ../fio.c ../unixpio.c
+	$(CC) $(CFLAGS) -D OPL=1 -D OPLLPT=1 oplbench.c ../opl.c ../fio.c ../unixpio.c -o $@
+
+opltest: opltest.c ../opl.c ../fio.c ../unixpio.c
+	$(CC) $(CFLAGS) -D OPL=1 -D OPLLPT=1 opltest.c ../opl.c ../fio.c ../unixpio.c -o $@
+
+ringtest: ringtest.c ../rt.c
+	$(CC) $(CFLAGS) -pthread ringtest.c ../rt.c -o $@
+
+statstest: statstest.c ../stats.c
+	$(CC) $(CFLAGS) statstest.c ../stats.c -o $@
+
+timertest: timertest.c ../timer.c
+	$(CC) $(CFLAGS) timertest.c ../timer.c -o $@
+
+check: fiotest opltest ringtest statstest timertest
+	./fiotest
+	./opltest
+	./ringtest
+	./statstest
+	./timertest
+
+clean:
+	rm -f fiotest loadbench oplbench opltest ringtest statstest timertest
+
+.PHONY: all check clean
@@ -15,10 +15,12 @@
 #include "defines.h"
 #include "timer.h" /* include self for control */
 #include <stdlib.h> /* atexit() */
+#include <limits.h> /* ULONG_MAX */
 #ifdef MSDOS
 #include <dos.h>   /* _chain_intr(), _disable(), _enable(), _dos_setvect() */
 #include <conio.h> /* outp() */
 #else
+#include <errno.h>
 #include <unistd.h>
 #include <time.h>
 #endif
@@ -99,13 +101,25 @@ static void __interrupt handle_clock(void) {
 #define CLOCK_MONOTONIC_FAST CLOCK_MONOTONIC
 #endif
 
+/* bounds of the wake-ahead margin of timer_waituntil() (us) */
+#define WAITMARGIN_MIN 20
+#define WAITMARGIN_MAX 5000
+/* spinning time kept on top of the worst oversleep seen recently (us) */
+#define WAITMARGIN_PAD 20
+
 static struct timespec reference;
+static unsigned long waitmargin = 200;
 #endif
 
+static int clocktype = TIMER_CLOCK_REAL; /* clock set by timer_setclock() */
+static unsigned int clockscale = 100;    /* speed of the scaled clock (%) */
+static unsigned long virtualnow;         /* current time of the virtual clock */
+
 
 /* reset the timer value, this can be used by the application to make sure
  * no timer wrap occurs during critical parts of the code flow */
 void timer_reset(void) {
+  virtualnow = 0;
 #ifdef MSDOS
   disable();
   nowtime = 0;
@@ -175,6 +189,23 @@ void timer_init(void) {
  * microseconds. Interrupts are disabled during this time to prevent the
  * clock from changing while it is being read. */
 void timer_read(unsigned long int *value) {
+  unsigned long int t;
+  switch (clocktype) {
+    case TIMER_CLOCK_VIRTUAL:
+      *value = virtualnow;
+      break;
+    case TIMER_CLOCK_SCALED:
+      timer_readreal(&t);
+      /* split to avoid overflows of t * clockscale */
+      *value = (t / 100) * clockscale + ((t % 100) * clockscale) / 100;
+      break;
+    default:
+      timer_readreal(value);
+      break;
+  }
+}
+
+void timer_readreal(unsigned long int *value) {
 #ifdef MSDOS
   /* Disable interrupts */
   disable();
@@ -192,8 +223,15 @@ void timer_read(unsigned long int *value) {
 #endif
 }
 
+unsigned long int timer_realspan(unsigned long int span) {
+  if (clocktype != TIMER_CLOCK_SCALED) return(span);
+  return((span / clockscale) * 100 + ((span % clockscale) * 100) / clockscale);
+}
+
 /* high resolution sleeping routine, waits n microseconds */
 void udelay(unsigned long int usec) {
+  unsigned long int t1, t2;
+  if (clocktype == TIMER_CLOCK_VIRTUAL) virtualnow += usec;
 #ifndef MSDOS
   if(usec > 100) {
     while(usec > 1000000) {
@@ -204,9 +242,62 @@ void udelay(unsigned long int usec) {
     return;
   }
 #endif
-  unsigned long int t1, t2;
-  timer_read(&t1);
+  timer_readreal(&t1);
   do {
-    timer_read(&t2);
+    timer_readreal(&t2);
   } while(t2 >= t1 && t2 - t1 < usec);
 }
+
+void timer_setclock(int clock, unsigned int scale) {
+  /* the virtual clock starts from the time it replaces */
+  if (clock == TIMER_CLOCK_VIRTUAL) timer_read(&virtualnow);
+  if (scale == 0) scale = 100;
+  clockscale = scale;
+  clocktype = clock;
+}
+
+void timer_advance(unsigned long int t) {
+  if ((clocktype == TIMER_CLOCK_VIRTUAL) && (t - virtualnow < ULONG_MAX / 2)) virtualnow = t;
+}
+
+#ifndef MSDOS
+void timer_waituntil(unsigned long int deadline) {
+  unsigned long int t, wake;
+  struct timespec ts;
+  /* the deadline is on the clock of timer_read(), the waiting is real */
+  if (clocktype == TIMER_CLOCK_SCALED) deadline = timer_realspan(deadline);
+  timer_readreal(&t);
+  if ((t >= deadline) || (deadline - t > ULONG_MAX / 2)) return;
+  /* sleep until a little before the deadline, unless it is too close */
+  if (deadline - t > waitmargin) {
+    wake = deadline - waitmargin;
+    ts.tv_sec = reference.tv_sec + wake / 1000000;
+    ts.tv_nsec = reference.tv_nsec + (wake % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC_FAST, TIMER_ABSTIME, &ts, NULL) == EINTR);
+    /* adjust the margin: grow it at once to cover any oversleep, shrink it
+     * slowly while the system wakes up on time */
+    timer_readreal(&t);
+    t = (t > wake) ? t - wake : 0;
+    t += WAITMARGIN_PAD;
+    if (t > waitmargin) {
+      waitmargin = t;
+    } else {
+      waitmargin -= (waitmargin - t) / 16;
+    }
+    if (waitmargin < WAITMARGIN_MIN) waitmargin = WAITMARGIN_MIN;
+    if (waitmargin > WAITMARGIN_MAX) waitmargin = WAITMARGIN_MAX;
+  }
+  /* spin for the rest */
+  do {
+    timer_readreal(&t);
+  } while ((t < deadline) && (deadline - t < ULONG_MAX / 2));
+}
+
+unsigned long timer_waitmargin(void) {
+  return(waitmargin);
+}
+#endif
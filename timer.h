@@ -34,12 +34,49 @@ void timer_stop(void);
  * its higher rate, but then it returns -1 to indicate the error. */
 void timer_init(void);
 
+/* clocks that timer_read() can follow */
+#define TIMER_CLOCK_REAL    0 /* the real time (default) */
+#define TIMER_CLOCK_SCALED  1 /* the real time, running faster or slower */
+#define TIMER_CLOCK_VIRTUAL 2 /* moves only with timer_advance() and udelay() */
+
+/* selects the clock followed by timer_read(). scale is the speed of the
+ * scaled clock in percent of the real time (200 runs twice as fast), it is
+ * ignored by the other clocks. the virtual clock does not move by itself,
+ * which allows playing songs as fast as the computer can, and gives the
+ * same timeline on every run. */
+void timer_setclock(int clock, unsigned int scale);
+
 /* This routine will return the present value of the time, as a number of
  * microseconds. Interrupts are disabled during this time to prevent the
- * clock from changing while it is being read. */
+ * clock from changing while it is being read. The time follows the clock
+ * selected by timer_setclock(). */
 void timer_read(unsigned long *res);
 
-/* high resolution sleeping routine, waits n microseconds */
+/* same as timer_read(), but always returns the real time, whatever the
+ * clock. this is what timeouts waiting for the hardware must rely on. */
+void timer_readreal(unsigned long *res);
+
+/* converts a span of time of the clock into real time */
+unsigned long timer_realspan(unsigned long span);
+
+/* moves the virtual clock forward to t (never backward). does nothing if
+ * the clock is not virtual. */
+void timer_advance(unsigned long t);
+
+/* high resolution sleeping routine, waits n microseconds. this is meant for
+ * hardware delays, so it waits real time whatever the clock, but the virtual
+ * clock is moved forward by the same amount: the delays are then part of the
+ * timeline, the same on every run. */
 void udelay(unsigned long us);
 
+#ifndef MSDOS
+/* waits until timer_read() reaches deadline: sleeps until shortly before it,
+ * then spins for the rest. the margin left for spinning adjusts itself to
+ * how late the system wakes the process up */
+void timer_waituntil(unsigned long deadline);
+
+/* returns the current wake-ahead margin of timer_waituntil(), in us */
+unsigned long timer_waitmargin(void);
+#endif
+
 #endif
@@ -24,7 +24,16 @@
 #ifdef MSDOS
 #include "mem.h" /* MEM_XMS */
 #endif
+#include "stats.h" /* stats_fmtus() */
 #include "ui.h"  /* include self for control */
+#ifndef MSDOS
+#include <pthread.h>
+
+/* with /thread, the screen is drawn and the keyboard read by a thread of
+ * their own, but the playback thread might still print an error message:
+ * curses is only ever called with this lock held */
+static pthread_mutex_t cursesmutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
 #include "version.h"
 #include <assert.h>
 
@@ -218,6 +227,9 @@ void ui_puterrmsg(const char *title, const char *errmsg) {
     if (titlelen > msglen) maxlen = titlelen;
   }
   xstart = 40 - (maxlen >> 1);
+#ifndef MSDOS
+  pthread_mutex_lock(&cursesmutex);
+#endif
   /* draw a red 'box' first */
   for (y = 8; y < 13; y++) {
     for (x = maxlen + 3; x >= 0; x--) {
@@ -229,6 +241,7 @@ void ui_puterrmsg(const char *title, const char *errmsg) {
   ui_printstr(10, 40 - (msglen >> 1), errmsg, msglen, COLOR_ERRMSG[colorflag]);
 #ifndef MSDOS
   refresh();
+  pthread_mutex_unlock(&cursesmutex);
 #endif
 }
 
@@ -243,6 +256,10 @@ unsigned int port, int onlpt,
 int volume) {
   #include "gm.h"  /* GM instruments names */
   int x, y;
+  int titlerows = (trackinfo->showstats != 0) ? 3 : 5; /* lines for the title */
+#ifndef MSDOS
+  pthread_mutex_lock(&cursesmutex);
+#endif
   /* draw ascii graphic frames, etc */
   if (*refreshflags & UI_REFRESH_TUI) {
     int len;
@@ -499,23 +516,35 @@ int volume) {
   /* elapsed/total time */
   if (*refreshflags & UI_REFRESH_TIME) {
     char tmpstr1[24];
-    char tmpstr2[16];
+    char tmpstr2[64];
     unsigned long int perc;
     int rpos;
-    if (trackinfo->totlen > 0) {
+    if ((trackinfo->totlen > 0) && (trackinfo->loading == 0)) {
       perc = (trackinfo->elapsedsec * 100) / trackinfo->totlen;
     } else {
       perc = 0;
     }
 #ifdef _QC
     sprintf(tmpstr1, " %lu:%02lu (%lu%%)     ", trackinfo->elapsedsec / 60, trackinfo->elapsedsec % 60, perc);
-    rpos = 78 - sprintf(tmpstr2, "%lu:%02lu ", trackinfo->totlen / 60, trackinfo->totlen % 60);
+    if (trackinfo->loading != 0) { /* total length not known yet */
+      rpos = 78 - sprintf(tmpstr2, "loading %u%% ", trackinfo->loadperc);
+    } else if (trackinfo->nextready != 0) {
+      rpos = 78 - sprintf(tmpstr2, "next preloaded  %lu:%02lu ", trackinfo->totlen / 60, trackinfo->totlen % 60);
+    } else {
+      rpos = 78 - sprintf(tmpstr2, "%lu:%02lu ", trackinfo->totlen / 60, trackinfo->totlen % 60);
+    }
 #else
     snprintf(tmpstr1, sizeof tmpstr1, " %lu:%02lu (%lu%%)     ", trackinfo->elapsedsec / 60, trackinfo->elapsedsec % 60, perc);
-    rpos = 78 - snprintf(tmpstr2, sizeof tmpstr2, "%lu:%02lu ", trackinfo->totlen / 60, trackinfo->totlen % 60);
+    if (trackinfo->loading != 0) { /* total length not known yet */
+      rpos = 78 - snprintf(tmpstr2, sizeof tmpstr2, "loading %u%% ", trackinfo->loadperc);
+    } else if (trackinfo->nextready != 0) {
+      rpos = 78 - snprintf(tmpstr2, sizeof tmpstr2, "next preloaded  %lu:%02lu ", trackinfo->totlen / 60, trackinfo->totlen % 60);
+    } else {
+      rpos = 78 - snprintf(tmpstr2, sizeof tmpstr2, "%lu:%02lu ", trackinfo->totlen / 60, trackinfo->totlen % 60);
+    }
 #endif
     /* draw the progress bar */
-    if (trackinfo->totlen > 0) {
+    if ((trackinfo->totlen > 0) && (trackinfo->loading == 0)) {
       perc = (trackinfo->elapsedsec * 78) / trackinfo->totlen;
     } else {
       perc = 0;
@@ -532,20 +561,29 @@ int volume) {
       }
     }
     /* if we have more title nodes than fits on screen, scroll them down now */
-    if (trackinfo->titlescount > 5) *refreshflags |= UI_REFRESH_TITLECOPYR;
+    if (trackinfo->titlescount > titlerows) *refreshflags |= UI_REFRESH_TITLECOPYR;
+    /* playback statistics take the two last lines of the title area */
+    if (trackinfo->showstats != 0) {
+      char late[4][8];
+      for (x = 0; x < 4; x++) stats_fmtus(late[x], trackinfo->statlate[x]);
+      sprintf(tmpstr2, "late p50 %s  p99 %s  p99.9 %s", late[0], late[1], late[2]);
+      ui_printstr(21, 1, tmpstr2, UI_TITLEMAXLEN, COLOR_TEXT[colorflag]);
+      sprintf(tmpstr2, "max %s  %lu events/s  device %u.%u%%", late[3], trackinfo->statevps, trackinfo->statdevload / 10, trackinfo->statdevload % 10);
+      ui_printstr(22, 1, tmpstr2, UI_TITLEMAXLEN, COLOR_TEXT[colorflag]);
+    }
   }
   /* title and copyright notice */
   if (*refreshflags & UI_REFRESH_TITLECOPYR) {
     int scrolloffset = 0, i;
-    if ((trackinfo->titlescount <= 5) || (trackinfo->elapsedsec < 8)) {
+    if ((trackinfo->titlescount <= titlerows) || (trackinfo->elapsedsec < 8)) {
       /* simple case */
-      for (i = 0; i < 5; i++) {
+      for (i = 0; i < titlerows; i++) {
         ui_printstr(18 + i, 1, trackinfo->title[i], UI_TITLEMAXLEN, COLOR_TEXT[colorflag]);
       }
     } else { /* else scroll down one line every 2s */
       scrolloffset = (trackinfo->elapsedsec >> 1) % (trackinfo->titlescount + 4);
       scrolloffset -= 4;
-      for (i = 0; i < 5; i++) {
+      for (i = 0; i < titlerows; i++) {
         if ((i + scrolloffset >= 0) && (i + scrolloffset < trackinfo->titlescount)) {
           ui_printstr(18 + i, 1, trackinfo->title[i + scrolloffset], UI_TITLEMAXLEN, COLOR_TEXT[colorflag]);
         } else {
@@ -567,6 +605,7 @@ int volume) {
   }
 #ifndef MSDOS
   refresh();
+  pthread_mutex_unlock(&cursesmutex);
 #endif
   /* all refreshed now */
   *refreshflags = 0;
@@ -610,6 +649,10 @@ int getkey_ifany(void) {
     return(-1);
   }
 #else
-  return getch();
+  int k;
+  pthread_mutex_lock(&cursesmutex);
+  k = getch();
+  pthread_mutex_unlock(&cursesmutex);
+  return k;
 #endif
 }
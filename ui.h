@@ -41,6 +41,15 @@ struct trackinfodata {
   unsigned short channelsusage;  /* a bit field indicating what channels are used */
   unsigned char reqpatches[32]; /* bit field of 256 bits indicating what patches (programs) are used, 0-127=melodic ; 128-255=percussion */
   unsigned short miditimeunitdiv;
+  unsigned char usdeltas; /* non-zero if event deltatimes are in microseconds */
+  unsigned char layout;   /* MIDI_LAYOUT_xxx, how events are laid in memory */
+  unsigned char loading;  /* non-zero while the song is still being loaded */
+  unsigned char loadperc; /* how much of the song is loaded (percents) */
+  unsigned char nextready; /* non-zero once the next song is preloaded */
+  unsigned char showstats; /* non-zero if playback statistics are displayed */
+  unsigned short statdevload; /* time spent in the device (per mille of playback) */
+  unsigned long statlate[4]; /* p50, p99, p99.9 and max lateness of events (us) */
+  unsigned long statevps;    /* events played during the last second */
   unsigned char chanprogs[16];
   int titlescount;
   enum fileformat fileformat;
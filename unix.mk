@@ -28,6 +28,9 @@ DEFAULT_DEVICE := \
 CFLAGS += -Wall -Wno-switch -Os -fno-common
 CFLAGS += -D __far= -D __near= -D far= -D near= $(CPPFLAGS) $(FEATURES) $(DEFAULT_DEVICE)
 #LIBS += -l rt
+# The UI thread (see /thread) needs POSIX threads
+CFLAGS += -pthread
+LIBS += -pthread
 CURSES_LIBS ?= -l curses
 #CURSES_LIBS ?= -l ncurses
 #CURSES_LIBS ?= -l ncursesw
@@ -43,7 +46,10 @@ OBJECTS := \
 	mus.o \
 	opl.o \
 	outdev.o \
+	rt.o \
 	sbdsp.o \
+	songcache.o \
+	stats.o \
 	syx.o \
 	timer.o \
 	ui.o \